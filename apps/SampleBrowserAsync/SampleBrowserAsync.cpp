@@ -99,39 +99,24 @@ int main(int argc, char** argv)
     onServiceChanged();
 
     // beginBrowsing() and endBrowsing() is here called only ones.
-    // browse() will detect if new instance was added or removed.
-    // warning: in this case browse() doesn't detect if service instance changed description
-    // TXT for example. This should not be needed.
+    // The event thread will detect if new instance was added or removed and
+    // calls the listener as soon as the change arrives.
+    // warning: in this case doesn't detect if service instance changed
+    // description TXT for example. This should not be needed.
 
     //You can use in Linux to test same results.
     //avahi-browse -d local _daqri-test._tcp --resolve
 
-    // This should run in thread.
-    int nLoops = 100;
-    while (--nLoops) {
-        const auto& res = service->browse(-1);
-
-        //        model->printHosts();
-
-        //        if (res == servus::Servus::Result::SUCCESS)
-        //        {
-        //            std::cout << "SUCCESS" << std::endl;
-        //        }
-        //        else if (res == servus::Servus::Result::PENDING)
-        //        {
-        //            std::cout << "PENDING" << std::endl;
-        //        }
-        //        else if (res == servus::Servus::Result::NOT_SUPPORTED)
-        //        {
-        //            std::cout << "NOT_SUPPORTED" << std::endl;
-        //        }
-        //        else if (res == servus::Servus::Result::POLL_ERROR)
-        //        {
-        //            std::cout << "POLL_ERROR" << std::endl;
-        //        }
-
-        //        std::this_thread::sleep_for(std::chrono::seconds(500));
+    const auto& res = service->startEventThread();
+    if (!res) {
+        std::cerr << "Can't start event thread: " << res << std::endl;
+        return 1;
     }
 
+    std::cout << "Browsing, press Enter to quit" << std::endl;
+    std::cin.get();
+
+    service->stopEventThread();
+
     return 0;
 }
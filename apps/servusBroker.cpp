@@ -0,0 +1,72 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <servus/broker/broker.h>
+#include <servus/version.h>
+
+#include <csignal>
+#include <cstring>
+#include <iostream>
+
+namespace
+{
+servus::broker::Broker* _broker = nullptr;
+
+void _stop(int)
+{
+    if (_broker)
+        _broker->stop();
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2 || (argc == 2 && (::strcmp(argv[1], "-h") == 0 ||
+                                   ::strcmp(argv[1], "--help") == 0)))
+    {
+        std::cout << "Usage: " << argv[0] << " [socket]" << std::endl
+                  << std::endl
+                  << "Registry broker for same-host service discovery, used "
+                  << "by Servus if SERVUS_BROKER is set to the socket path."
+                  << std::endl
+                  << "The default socket is "
+                  << servus::broker::getSocketPath() << std::endl
+                  << "Servus " << servus::Version::getString() << std::endl;
+        return argc > 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    try
+    {
+        servus::broker::Broker broker(
+            argc == 2 ? argv[1] : servus::broker::getSocketPath());
+        _broker = &broker;
+        ::signal(SIGINT, _stop);
+        ::signal(SIGTERM, _stop);
+
+        std::cout << "Servus broker listening on " << broker.getPath()
+                  << std::endl;
+        broker.run();
+        _broker = nullptr;
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,297 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <servus/listener.h>
+#include <servus/servus.h>
+#include <servus/version.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace
+{
+typedef std::chrono::steady_clock Clock;
+typedef std::map<std::string, double> Results;
+
+const unsigned short PORT = 4242;
+const std::chrono::seconds TIMEOUT(10);
+const size_t MAX_REAL_INSTANCES = 32; // keep the network traffic reasonable
+const size_t NUM_LISTENERS = 16;
+
+struct Options
+{
+    size_t instances{1000};
+    size_t iterations{100000};
+    bool real{true};
+    std::string output;
+};
+
+double _elapsed(const Clock::time_point& start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+double _cpuTime()
+{
+    return double(std::clock()) / CLOCKS_PER_SEC;
+}
+
+// @return the resident set size in bytes, 0 if unknown
+size_t _getRSS()
+{
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if (statm >> pages >> resident)
+        return resident * size_t(::sysconf(_SC_PAGESIZE));
+#endif
+    return 0;
+}
+
+class CountingListener : public servus::Listener
+{
+public:
+    size_t added{0};
+    size_t removed{0};
+    size_t updated{0};
+
+    void instanceAdded(const std::string&) final { ++added; }
+    void instanceRemoved(const std::string&) final { ++removed; }
+    void instanceUpdated(const std::string&, const servus::Strings&,
+                         const servus::Strings&) final
+    {
+        ++updated;
+    }
+};
+
+// Browse until the predicate is true or the timeout passed
+template <class P>
+bool _browseUntil(servus::Servus& browser, const P& predicate)
+{
+    const Clock::time_point start = Clock::now();
+    while (!predicate())
+    {
+        if (Clock::now() - start > TIMEOUT || !browser.browse(10))
+            return false;
+    }
+    return true;
+}
+
+std::string _getPrefix()
+{
+    std::ostringstream prefix;
+    prefix << "bench_" << servus::getHostname() << "_";
+#ifndef _WIN32
+    prefix << ::getpid() << "_";
+#endif
+    return prefix.str();
+}
+
+Results _benchmark(const std::string& service, const size_t nInstances,
+                   const size_t nIterations)
+{
+    Results results;
+    const std::string prefix = _getPrefix();
+
+    // announce latency, and until discovered by a browsing peer
+    {
+        servus::Servus browser(service);
+        CountingListener listener;
+        browser.addListener(&listener);
+        browser.beginBrowsing(servus::Servus::IF_ALL);
+
+        servus::Servus announcer(service);
+        const Clock::time_point start = Clock::now();
+        if (!announcer.announce(PORT, prefix + "latency"))
+            return results;
+        results["announce_us"] = _elapsed(start) * 1e6;
+        if (_browseUntil(browser, [&] { return listener.added > 0; }))
+            results["announce_to_discover_us"] = _elapsed(start) * 1e6;
+        browser.removeListener(&listener);
+    }
+
+    // discovery of all instances
+    std::vector<std::unique_ptr<servus::Servus>> announcers;
+    for (size_t i = 0; i < nInstances; ++i)
+    {
+        announcers.emplace_back(new servus::Servus(service));
+        announcers.back()->set("index", std::to_string(i));
+        announcers.back()->announce(PORT, prefix + std::to_string(i));
+    }
+
+    const size_t rss = _getRSS();
+    servus::Servus browser(service);
+    CountingListener listener;
+    browser.addListener(&listener);
+    Clock::time_point start = Clock::now();
+    browser.beginBrowsing(servus::Servus::IF_ALL);
+    const bool complete =
+        _browseUntil(browser, [&] { return listener.added >= nInstances; });
+    results["discovered"] = double(listener.added);
+    if (complete)
+        results["discover_all_ms"] = _elapsed(start) * 1e3;
+    if (rss > 0 && listener.added > 0)
+        results["memory_per_instance_bytes"] =
+            (double(_getRSS()) - double(rss)) / double(listener.added);
+
+    // queries of the discovered data
+    start = Clock::now();
+    size_t found = 0;
+    for (size_t i = 0; i < nIterations / 100 + 1; ++i)
+        found += browser.getInstances().size();
+    results["getInstances_per_s"] = double(nIterations / 100 + 1) /
+                                    _elapsed(start);
+
+    start = Clock::now();
+    for (size_t i = 0; i < nIterations; ++i)
+        found += browser.get(prefix + std::to_string(i % nInstances), "index")
+                     .size();
+    results["get_per_s"] = double(nIterations) / _elapsed(start);
+    if (found == 0)
+        std::cerr << "No instances found for " << service << std::endl;
+
+    // browse cost per update event, without and with additional listeners
+    const auto update = [&](const size_t round) {
+        const size_t updated = listener.updated;
+        for (auto& announcer : announcers)
+            announcer->set("round", std::to_string(round));
+
+        const double cpu = _cpuTime();
+        const Clock::time_point begin = Clock::now();
+        if (!_browseUntil(browser, [&] {
+                return listener.updated >= updated + announcers.size();
+            }))
+        {
+            return std::make_pair(0., 0.);
+        }
+        return std::make_pair((_cpuTime() - cpu) / double(announcers.size()),
+                              _elapsed(begin) / double(announcers.size()));
+    };
+
+    const auto single = update(1);
+    if (single.second > 0.)
+    {
+        results["browse_cpu_us_per_event"] = single.first * 1e6;
+        results["browse_us_per_event"] = single.second * 1e6;
+    }
+
+    std::vector<CountingListener> listeners(NUM_LISTENERS);
+    for (auto& i : listeners)
+        browser.addListener(&i);
+    const auto multiple = update(2);
+    if (single.second > 0. && multiple.second > 0.)
+        results["listener_dispatch_ns"] =
+            (multiple.second - single.second) * 1e9 / NUM_LISTENERS;
+    for (auto& i : listeners)
+        browser.removeListener(&i);
+
+    browser.removeListener(&listener);
+    return results;
+}
+
+void _write(std::ostream& os, const Options& options,
+            const std::map<std::string, Results>& backends)
+{
+    os << std::fixed << std::setprecision(3) << "{" << std::endl
+       << "  \"version\": \"" << servus::Version::getString() << "\","
+       << std::endl
+       << "  \"instances\": " << options.instances << "," << std::endl
+       << "  \"iterations\": " << options.iterations << "," << std::endl
+       << "  \"backends\": {";
+    for (auto i = backends.begin(); i != backends.end(); ++i)
+    {
+        os << (i == backends.begin() ? "" : ",") << std::endl
+           << "    \"" << i->first << "\": {";
+        for (auto j = i->second.begin(); j != i->second.end(); ++j)
+            os << (j == i->second.begin() ? "" : ",") << std::endl
+               << "      \"" << j->first << "\": " << j->second;
+        os << std::endl << "    }";
+    }
+    os << std::endl << "  }" << std::endl << "}" << std::endl;
+}
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (::strcmp(argv[i], "--instances") == 0 && hasValue)
+            options.instances = std::max(1, ::atoi(argv[++i]));
+        else if (::strcmp(argv[i], "--iterations") == 0 && hasValue)
+            options.iterations = std::max(1, ::atoi(argv[++i]));
+        else if (::strcmp(argv[i], "--output") == 0 && hasValue)
+            options.output = argv[++i];
+        else if (::strcmp(argv[i], "--test-only") == 0)
+            options.real = false;
+        else
+        {
+            std::cout
+                << "Usage: " << argv[0] << " [--instances n] [--iterations n] "
+                << "[--test-only] [--output file.json]" << std::endl
+                << std::endl
+                << "Benchmarks service discovery over the test driver and the "
+                << "available backend, and writes the results as JSON."
+                << std::endl
+                << "Servus " << servus::Version::getString() << std::endl;
+            return ::strcmp(argv[i], "-h") == 0 ||
+                           ::strcmp(argv[i], "--help") == 0
+                       ? EXIT_SUCCESS
+                       : EXIT_FAILURE;
+        }
+    }
+
+    std::map<std::string, Results> backends;
+    backends["test"] = _benchmark(servus::TEST_DRIVER, options.instances,
+                                  options.iterations);
+    if (options.real && servus::Servus::isAvailable())
+        backends["default"] =
+            _benchmark("_servus-bench._tcp",
+                       std::min(options.instances, MAX_REAL_INSTANCES),
+                       options.iterations);
+
+    if (options.output.empty())
+    {
+        _write(std::cout, options, backends);
+        return EXIT_SUCCESS;
+    }
+
+    std::ofstream file(options.output);
+    _write(file, options, backends);
+    if (!file)
+    {
+        std::cerr << "Can't write " << options.output << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
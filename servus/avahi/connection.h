@@ -0,0 +1,121 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <avahi-client/client.h>
+#include <avahi-common/error.h>
+
+#include "poll.h"
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+
+namespace servus
+{
+namespace avahi
+{
+/**
+ * The process-wide connection to the avahi daemon.
+ *
+ * All avahi::Servus instances share one AvahiClient and its Poll, and
+ * serialize all avahi calls through one mutex. The connection is created by
+ * the first instance and released with the last one.
+ */
+class Connection
+{
+public:
+    /** Notified about client state changes, with the mutex locked. */
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+        virtual void clientStateChanged(AvahiClientState state) = 0;
+    };
+
+    /** @return the shared connection, created if needed. */
+    static std::shared_ptr<Connection> get()
+    {
+        static std::mutex mutex;
+        static std::weak_ptr<Connection> instance;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Connection> connection = instance.lock();
+        if (!connection)
+        {
+            connection.reset(new Connection);
+            instance = connection;
+        }
+        return connection;
+    }
+
+    ~Connection()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        avahi_client_free(_client);
+    }
+
+    // http://stackoverflow.com/questions/14430906
+    //   Serializes all avahi calls. Like avahi_threaded_poll, event threads
+    //   release it while waiting for events in Poll::wait().
+    std::mutex mutex;
+    Poll poll;
+
+    AvahiClient* getClient() { return _client; }
+    // mutex needs to be locked for all functions below
+    bool isRunning() const { return _state == AVAHI_CLIENT_S_RUNNING; }
+    void addListener(Listener* listener) { _listeners.insert(listener); }
+    void removeListener(Listener* listener) { _listeners.erase(listener); }
+
+private:
+    AvahiClient* _client;
+    AvahiClientState _state;
+    std::set<Listener*> _listeners;
+
+    Connection()
+        : _client(0)
+        , _state(AVAHI_CLIENT_CONNECTING)
+    {
+        int error = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        _client = avahi_client_new(poll.get(), (AvahiClientFlags)(0),
+                                   _clientCBS, this, &error);
+        if (!_client)
+            throw std::runtime_error(std::string("Can't setup avahi client: ") +
+                                     avahi_strerror(error));
+    }
+
+    static void _clientCBS(AvahiClient*, AvahiClientState state, void* self)
+    {
+        ((Connection*)self)->_clientCB(state);
+    }
+
+    void _clientCB(const AvahiClientState state)
+    {
+        _state = state;
+        if (state == AVAHI_CLIENT_FAILURE || state == AVAHI_CLIENT_S_COLLISION)
+            poll.quit(); // the connection is unusable for all instances
+
+        // listeners may remove themselves
+        const std::set<Listener*> listeners = _listeners;
+        for (Listener* listener : listeners)
+            listener->clientStateChanged(state);
+    }
+};
+}
+}
@@ -0,0 +1,414 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <avahi-common/watch.h>
+
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace servus
+{
+namespace avahi
+{
+class Poll;
+}
+}
+
+struct AvahiWatch
+{
+    servus::avahi::Poll* poll;
+    int fd;
+    AvahiWatchEvent events;
+    AvahiWatchEvent revents; //!< events of the last dispatch
+    AvahiWatchCallback callback;
+    void* userdata;
+    bool dead;
+};
+
+struct AvahiTimeout
+{
+    servus::avahi::Poll* poll;
+    bool enabled;
+    struct timeval expiry;
+    AvahiTimeoutCallback callback;
+    void* userdata;
+    bool dead;
+};
+
+namespace servus
+{
+namespace avahi
+{
+/**
+ * An AvahiPoll implementation multiplexing all watches and timeouts into a
+ * single epoll file descriptor.
+ *
+ * In contrast to AvahiSimplePoll, the file descriptor can be integrated into an
+ * external event loop, and waiting for events is separate from dispatching
+ * them, so that the caller does not need to hold its lock while waiting. All
+ * functions but wait() and wakeup() need to be called with the lock held.
+ */
+class Poll
+{
+public:
+    Poll()
+        : _epoll(::epoll_create1(EPOLL_CLOEXEC))
+        , _wakeup(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+        , _timer(::timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK))
+        , _nEvents(0)
+        , _quit(false)
+        , _dispatching(false)
+    {
+        if (_epoll < 0 || _wakeup < 0 || _timer < 0 ||
+            !_control(EPOLL_CTL_ADD, _wakeup, EPOLLIN) ||
+            !_control(EPOLL_CTL_ADD, _timer, EPOLLIN))
+        {
+            const std::string error = ::strerror(errno);
+            _close();
+            throw std::runtime_error("Can't setup avahi poll device: " + error);
+        }
+
+        _api.userdata = this;
+        _api.watch_new = _watchNew;
+        _api.watch_update = _watchUpdate;
+        _api.watch_get_events = _watchGetEvents;
+        _api.watch_free = _watchFree;
+        _api.timeout_new = _timeoutNew;
+        _api.timeout_update = _timeoutUpdate;
+        _api.timeout_free = _timeoutFree;
+    }
+
+    ~Poll()
+    {
+        for (AvahiWatch* watch : _watches)
+            delete watch;
+        for (AvahiTimeout* timeout : _timeouts)
+            delete timeout;
+        _close();
+    }
+
+    const AvahiPoll* get() const { return &_api; }
+    /** @return the file descriptor readable when events are pending. */
+    int getFD() const { return _epoll; }
+
+    /**
+     * Wait at most timeout milliseconds for events, without dispatching them.
+     *
+     * Thread safe, several threads may wait concurrently. The events stay
+     * pending until the next dispatch().
+     *
+     * @param wakeup an additional file descriptor to wait for, or -1.
+     * @return the number of ready file descriptors, or -1 on error.
+     */
+    int wait(const int timeout, const int wakeup = -1) const
+    {
+        pollfd fds[2] = {{_epoll, POLLIN, 0}, {wakeup, POLLIN, 0}};
+        const int nEvents = ::poll(fds, 2, timeout);
+        if (nEvents >= 0)
+            return nEvents;
+        return errno == EINTR ? 0 : -1;
+    }
+
+    /**
+     * Invoke the callbacks for all pending events, without waiting.
+     *
+     * @return 0 on success, 1 if quit() was called, -1 on error.
+     */
+    int dispatch() { return iterate(0); }
+
+    /**
+     * Wait at most timeout milliseconds for events and dispatch them.
+     *
+     * @return 0 on success, 1 if quit() was called, -1 on error.
+     */
+    int iterate(const int timeout)
+    {
+        if (_quit)
+            return 1;
+
+        // level-triggered: events reported to wait() are still pending here
+        _nEvents = ::epoll_wait(_epoll, _events, MAX_EVENTS, timeout);
+        if (_nEvents < 0)
+        {
+            _nEvents = 0;
+            if (errno != EINTR)
+                return -1;
+        }
+        return _dispatch();
+    }
+
+    /** Interrupt all concurrent wait() calls. Thread safe. */
+    void wakeup()
+    {
+        const uint64_t one = 1;
+        // EAGAIN on counter overflow is fine, a wakeup is pending anyway
+        const ssize_t written = ::write(_wakeup, &one, sizeof(one));
+        (void)written;
+    }
+
+    /** Make all subsequent iterations fail, like avahi_simple_poll_quit. */
+    void quit()
+    {
+        _quit = true;
+        wakeup();
+    }
+
+private:
+    typedef std::vector<AvahiWatch*> Watches;
+    typedef std::vector<AvahiTimeout*> Timeouts;
+    static const int MAX_EVENTS = 16;
+
+    AvahiPoll _api;
+    const int _epoll;
+    const int _wakeup;
+    const int _timer;
+    struct epoll_event _events[MAX_EVENTS];
+    int _nEvents;
+    bool _quit;
+    bool _dispatching;
+    Watches _watches;
+    Timeouts _timeouts;
+
+    int _dispatch()
+    {
+        _dispatching = true;
+        for (int i = 0; i < _nEvents; ++i)
+        {
+            const int fd = _events[i].data.fd;
+            if (fd == _wakeup || fd == _timer)
+            {
+                _drain(fd);
+                continue;
+            }
+
+            const AvahiWatchEvent revents =
+                AvahiWatchEvent(_events[i].events & (EPOLLIN | EPOLLOUT |
+                                                     EPOLLERR | EPOLLHUP));
+            // callbacks may create and free watches
+            const Watches watches = _watches;
+            for (AvahiWatch* watch : watches)
+            {
+                if (watch->dead || watch->fd != fd)
+                    continue;
+
+                const AvahiWatchEvent events = AvahiWatchEvent(
+                    revents &
+                    (watch->events | AVAHI_WATCH_ERR | AVAHI_WATCH_HUP));
+                if (!events)
+                    continue;
+
+                watch->revents = events;
+                watch->callback(watch, fd, events, watch->userdata);
+            }
+        }
+        _nEvents = 0;
+
+        struct timeval now;
+        ::gettimeofday(&now, 0);
+        const Timeouts timeouts = _timeouts;
+        for (AvahiTimeout* timeout : timeouts)
+        {
+            if (timeout->dead || !timeout->enabled ||
+                timercmp(&timeout->expiry, &now, >))
+            {
+                continue;
+            }
+
+            timeout->enabled = false; // one-shot, like AvahiSimplePoll
+            timeout->callback(timeout, timeout->userdata);
+        }
+        _dispatching = false;
+
+        _cleanup();
+        _updateTimer();
+        return _quit ? 1 : 0;
+    }
+
+    void _close()
+    {
+        if (_epoll >= 0)
+            ::close(_epoll);
+        if (_wakeup >= 0)
+            ::close(_wakeup);
+        if (_timer >= 0)
+            ::close(_timer);
+    }
+
+    static void _drain(const int fd)
+    {
+        uint64_t count;
+        const ssize_t read = ::read(fd, &count, sizeof(count));
+        (void)read; // EAGAIN if drained already
+    }
+
+    bool _control(const int operation, const int fd, const uint32_t events)
+    {
+        struct epoll_event event;
+        ::memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = fd;
+        return ::epoll_ctl(_epoll, operation, fd, &event) == 0;
+    }
+
+    // Several watches may share a file descriptor, register their union
+    void _updateFD(const int fd)
+    {
+        uint32_t events = 0;
+        for (const AvahiWatch* watch : _watches)
+            if (!watch->dead && watch->fd == fd)
+                events |= watch->events;
+
+        if (events == 0)
+            _control(EPOLL_CTL_DEL, fd, 0); // fails if fd was closed already
+        else if (!_control(EPOLL_CTL_MOD, fd, events))
+            _control(EPOLL_CTL_ADD, fd, events);
+    }
+
+    // Arm the timer for the earliest enabled timeout
+    void _updateTimer()
+    {
+        const AvahiTimeout* next = 0;
+        for (const AvahiTimeout* timeout : _timeouts)
+        {
+            if (timeout->dead || !timeout->enabled)
+                continue;
+            if (!next || timercmp(&timeout->expiry, &next->expiry, <))
+                next = timeout;
+        }
+
+        struct itimerspec spec;
+        ::memset(&spec, 0, sizeof(spec));
+        if (next)
+        {
+            spec.it_value.tv_sec = next->expiry.tv_sec;
+            spec.it_value.tv_nsec = next->expiry.tv_usec * 1000;
+            if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+                spec.it_value.tv_nsec = 1; // zero would disarm the timer
+        }
+        ::timerfd_settime(_timer, TFD_TIMER_ABSTIME, &spec, 0);
+    }
+
+    // Delete watches and timeouts freed by avahi, deferred during dispatch
+    void _cleanup()
+    {
+        if (_dispatching)
+            return;
+
+        for (auto i = _watches.begin(); i != _watches.end();)
+        {
+            if ((*i)->dead)
+            {
+                delete *i;
+                i = _watches.erase(i);
+            }
+            else
+                ++i;
+        }
+        for (auto i = _timeouts.begin(); i != _timeouts.end();)
+        {
+            if ((*i)->dead)
+            {
+                delete *i;
+                i = _timeouts.erase(i);
+            }
+            else
+                ++i;
+        }
+    }
+
+    static AvahiWatch* _watchNew(const AvahiPoll* api, const int fd,
+                                 const AvahiWatchEvent events,
+                                 const AvahiWatchCallback callback,
+                                 void* userdata)
+    {
+        Poll* poll = static_cast<Poll*>(api->userdata);
+        AvahiWatch* watch = new AvahiWatch;
+        watch->poll = poll;
+        watch->fd = fd;
+        watch->events = events;
+        watch->revents = AvahiWatchEvent(0);
+        watch->callback = callback;
+        watch->userdata = userdata;
+        watch->dead = false;
+
+        poll->_watches.push_back(watch);
+        poll->_updateFD(fd);
+        return watch;
+    }
+
+    static void _watchUpdate(AvahiWatch* watch, const AvahiWatchEvent events)
+    {
+        watch->events = events;
+        watch->poll->_updateFD(watch->fd);
+    }
+
+    static AvahiWatchEvent _watchGetEvents(AvahiWatch* watch)
+    {
+        return watch->revents;
+    }
+
+    static void _watchFree(AvahiWatch* watch)
+    {
+        watch->dead = true;
+        watch->poll->_updateFD(watch->fd);
+        watch->poll->_cleanup();
+    }
+
+    static AvahiTimeout* _timeoutNew(const AvahiPoll* api,
+                                     const struct timeval* tv,
+                                     const AvahiTimeoutCallback callback,
+                                     void* userdata)
+    {
+        Poll* poll = static_cast<Poll*>(api->userdata);
+        AvahiTimeout* timeout = new AvahiTimeout;
+        timeout->poll = poll;
+        timeout->callback = callback;
+        timeout->userdata = userdata;
+        timeout->dead = false;
+
+        poll->_timeouts.push_back(timeout);
+        _timeoutUpdate(timeout, tv);
+        return timeout;
+    }
+
+    static void _timeoutUpdate(AvahiTimeout* timeout, const struct timeval* tv)
+    {
+        timeout->enabled = tv != 0;
+        if (tv)
+            timeout->expiry = *tv;
+        timeout->poll->_updateTimer();
+    }
+
+    static void _timeoutFree(AvahiTimeout* timeout)
+    {
+        timeout->dead = true;
+        timeout->poll->_updateTimer();
+        timeout->poll->_cleanup();
+    }
+};
+}
+}
@@ -21,25 +21,30 @@
 #include <avahi-client/lookup.h>
 #include <avahi-client/publish.h>
 #include <avahi-common/error.h>
-#include <avahi-common/simple-watch.h>
+
+#include "connection.h"
 
 #include <net/if.h>
 #include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <condition_variable>
+#include <map>
 #include <mutex>
+#include <set>
+#include <tuple>
 
 using ScopedLock = std::unique_lock<std::mutex>;
 namespace chrono = std::chrono;
 
 #define WARN std::cerr << __FILE__ << ":" << __LINE__ << ": "
 
-// http://stackoverflow.com/questions/14430906
-//   Proper way of doing this is using the threaded polling in avahi
 namespace
 {
-static std::mutex _mutex;
-
 int64_t _elapsedMilliseconds(
     const chrono::high_resolution_clock::time_point& startTime)
 {
@@ -53,88 +58,83 @@ namespace servus
 {
 namespace avahi
 {
-namespace
-{
-AvahiSimplePoll* _newSimplePoll()
-{
-    ScopedLock lock(_mutex);
-    return avahi_simple_poll_new();
-}
-}
-
-class Servus : public servus::Servus::Impl
+class Servus : public servus::Servus::Impl, private Connection::Listener
 {
 public:
     explicit Servus(const std::string& name)
         : servus::Servus::Impl(name)
-        , _poll(_newSimplePoll())
-        , _client(0)
+        , _connection(Connection::get())
+        , _mutex(_connection->mutex)
+        , _poll(_connection->poll)
+        , _wakeupFD(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+        , _client(_connection->getClient())
         , _browser(0)
         , _group(0)
         , _result(servus::Servus::Result::PENDING)
         , _port(0)
         , _announcable(false)
+        , _failed(false)
+        , _allForNow(false)
         , _scope(servus::Servus::IF_ALL)
     {
-        if (!_poll)
-            throw std::runtime_error("Can't setup avahi poll device");
-
-        int error = 0;
+        if (_wakeupFD < 0)
+            throw std::runtime_error(
+                std::string("Can't create avahi wakeup: ") + ::strerror(errno));
         ScopedLock lock(_mutex);
-        _client =
-            avahi_client_new(avahi_simple_poll_get(_poll),
-                             (AvahiClientFlags)(0), _clientCBS, this, &error);
-        if (!_client)
-            throw std::runtime_error(std::string("Can't setup avahi client: ") +
-                                     avahi_strerror(error));
+        _announcable = _connection->isRunning();
+        _connection->addListener(this);
     }
 
     virtual ~Servus()
     {
+        stopEventThread();
         withdraw();
         endBrowsing();
 
-        ScopedLock lock(_mutex);
-        if (_client)
-            avahi_client_free(_client);
-        if (_poll)
-            avahi_simple_poll_free(_poll);
+        {
+            ScopedLock lock(_mutex);
+            if (_group)
+                avahi_entry_group_free(_group);
+            _connection->removeListener(this);
+        }
+        ::close(_wakeupFD);
     }
 
     std::string getClassName() const { return "avahi"; }
     servus::Servus::Result announce(const unsigned short port,
                                     const std::string& instance) final
     {
+        ValueMap data = _copyData(); // before the lock, see _updateRecord()
         ScopedLock lock(_mutex);
+        _setAnnounce(port, instance, std::move(data));
+        return _publish(lock);
+    }
 
+    servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) final
+    {
+        ScopedLock lock(_mutex);
         _result = servus::Servus::Result::PENDING;
-        _port = port;
-        if (instance.empty())
-            _announce = getHostname();
-        else
-            _announce = instance;
+        _failed = false;
+        _announcements = announcements;
+        for (auto& announcement : _announcements)
+            if (announcement.instance.empty())
+                announcement.instance = getHostname();
 
-        if (_announcable)
-            _createServices();
-        else
-        {
-            const chrono::high_resolution_clock::time_point& startTime =
-                chrono::high_resolution_clock::now();
-            while (!_announcable &&
-                   _result == servus::Servus::Result::PENDING &&
-                   _elapsedMilliseconds(startTime) < ANNOUNCE_TIMEOUT)
-            {
-                avahi_simple_poll_iterate(_poll, ANNOUNCE_TIMEOUT);
-            }
-        }
+        if (_hasServices())
+            return _publish(lock);
 
-        return servus::Servus::Result(_result);
+        if (_group)
+            avahi_entry_group_reset(_group);
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
     }
 
     void withdraw() final
     {
         ScopedLock lock(_mutex);
+        _completeAnnounce(ECANCELED);
         _announce.clear();
+        _announcements.clear();
         _port = 0;
         if (_group)
             avahi_entry_group_reset(_group);
@@ -154,7 +154,9 @@ public:
 
         ScopedLock lock(_mutex);
         _scope = addr;
-        _instanceMap.clear();
+        _failed = false;
+        _allForNow = false;
+        _clearInstances();
         _result = servus::Servus::Result::SUCCESS;
         _browser =
             avahi_service_browser_new(_client, AVAHI_IF_UNSPEC,
@@ -169,78 +171,198 @@ public:
         return servus::Servus::Result(_result);
     }
 
-    servus::Servus::Result browse(const int32_t timeout) final
+    void endBrowsing() final
     {
         ScopedLock lock(_mutex);
-        _result = servus::Servus::Result::PENDING;
-        const chrono::high_resolution_clock::time_point& startTime =
-            chrono::high_resolution_clock::now();
+        for (const auto& i : _resolvers)
+            avahi_service_resolver_free(i.second);
+        _resolvers.clear();
+        _unresolved.clear();
+        if (_browser)
+            avahi_service_browser_free(_browser);
+        _browser = 0;
+    }
+
+    bool isBrowsing() const final { return _browser; }
+    int getEventFD() final { return _poll.getFD(); }
+private:
+    typedef std::tuple<std::string, AvahiIfIndex, AvahiProtocol> ResolverKey;
+    typedef std::map<ResolverKey, AvahiServiceResolver*> Resolvers;
+
+    const std::shared_ptr<Connection> _connection;
+    std::mutex& _mutex; //!< of the shared connection
+    Poll& _poll;        //!< of the shared connection
+    const int _wakeupFD; //!< of this instance, the poll one is shared
+    std::condition_variable _condition; //!< signaled on announce progress
+    AvahiClient* _client;
+    AvahiServiceBrowser* _browser;
+    AvahiEntryGroup* _group;
+    int32_t _result;
+    std::string _announce;
+    unsigned short _port;
+    ValueMap _record; //!< copy of _data, published from the event thread
+    servus::Servus::Announcements _announcements; //!< in the same group
+    bool _announcable;
+    bool _failed;     //!< browser or entry group failure, poll is shared
+    bool _allForNow;  //!< the browser reported all cached services
+    servus::Servus::Interface _scope;
+    Resolvers _resolvers; //!< kept alive to monitor TXT record changes
+    std::set<AvahiServiceResolver*> _unresolved; //!< without first result
+
+    servus::Servus::Result _processEvents(const int32_t timeout) final
+    {
+        typedef chrono::steady_clock Clock; // Impl's is private
+        ScopedLock lock(_mutex);
+        const Clock::time_point end =
+            Clock::now() + chrono::milliseconds(timeout);
 
         size_t nErrors = 0;
         do
         {
-            if (avahi_simple_poll_iterate(_poll, timeout) != 0)
+            if (_failed)
+                return servus::Servus::Result(
+                    servus::Servus::Result::POLL_ERROR);
+
+            int32_t remaining = timeout;
+            if (timeout > 0)
             {
+                const Clock::time_point now = Clock::now();
+                remaining = int32_t(
+                    chrono::duration_cast<chrono::milliseconds>(
+                        std::max(end, now) - now)
+                        .count());
+            }
+            if (_iterate(lock, remaining) != 0)
+            {
+                count(Metrics::POLL_ERRORS);
                 if (++nErrors < 10)
                     continue;
 
-                _result = servus::Servus::Result::POLL_ERROR;
-                break;
+                return servus::Servus::Result(
+                    servus::Servus::Result::POLL_ERROR);
             }
-        } while (_elapsedMilliseconds(startTime) < timeout);
 
-        if (_result != servus::Servus::Result::POLL_ERROR)
-            _result = servus::Servus::Result::SUCCESS;
+            // like mdns::Servus, return once woken up
+            uint64_t value;
+            if (::read(_wakeupFD, &value, sizeof(value)) > 0)
+                break;
+        } while (Clock::now() < end && !_isBrowseInterrupted());
 
-        return servus::Servus::Result(_result);
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
     }
 
-    void endBrowsing() final
+    int _iterate(ScopedLock& lock, const int32_t timeout)
     {
+        if (!hasEventThread())
+            return _poll.iterate(timeout);
+
+        // Like avahi_threaded_poll, do not block other threads while waiting
+        lock.unlock();
+        const int nEvents = _poll.wait(timeout, _wakeupFD);
+        lock.lock();
+        return nEvents < 0 ? -1 : _poll.dispatch();
+    }
+
+    // Not the shared eventfd of the poll, which the dispatch() of any
+    // instance drains
+    void _wakeup() final
+    {
+        const uint64_t one = 1;
+        // EAGAIN on counter overflow is fine, a wakeup is pending anyway
+        const ssize_t written = ::write(_wakeupFD, &one, sizeof(one));
+        (void)written;
+    }
+
+    servus::Servus::Result _startAnnounce(const unsigned short port,
+                                          const std::string& instance) final
+    {
+        ValueMap data = _copyData();
         ScopedLock lock(_mutex);
-        if (_browser)
-            avahi_service_browser_free(_browser);
-        _browser = 0;
+        _setAnnounce(port, instance, std::move(data));
+        _beginAnnounce();
+        if (_announcable)
+            _createServices(); // completes on error
+        return servus::Servus::Result(servus::Servus::Result::PENDING);
     }
 
-    bool isBrowsing() const final { return _browser; }
-private:
-    AvahiSimplePoll* const _poll;
-    AvahiClient* _client;
-    AvahiServiceBrowser* _browser;
-    AvahiEntryGroup* _group;
-    int32_t _result;
-    std::string _announce;
-    unsigned short _port;
-    bool _announcable;
-    servus::Servus::Interface _scope;
+    void _setAnnounce(const unsigned short port, const std::string& instance,
+                      ValueMap&& data)
+    {
+        _result = servus::Servus::Result::PENDING;
+        _failed = false;
+        _port = port;
+        _record = std::move(data);
+        if (instance.empty())
+            _announce = getHostname();
+        else
+            _announce = instance;
+    }
+
+    bool _hasServices() const
+    {
+        return !_announce.empty() || !_announcements.empty();
+    }
+
+    // Commit all services, waiting for the client to be running if needed
+    servus::Servus::Result _publish(ScopedLock& lock)
+    {
+        if (_announcable)
+            _createServices();
+        else if (hasEventThread())
+        {
+            _condition.wait_for(lock,
+                                chrono::milliseconds(ANNOUNCE_TIMEOUT), [this] {
+                                    return _announcable ||
+                                           _result !=
+                                               servus::Servus::Result::PENDING;
+                                });
+        }
+        else
+        {
+            const chrono::high_resolution_clock::time_point& startTime =
+                chrono::high_resolution_clock::now();
+            while (!_announcable &&
+                   _result == servus::Servus::Result::PENDING &&
+                   _elapsedMilliseconds(startTime) < ANNOUNCE_TIMEOUT)
+            {
+                _poll.iterate(ANNOUNCE_TIMEOUT);
+            }
+        }
 
-    // Client state change
-    static void _clientCBS(AvahiClient*, AvahiClientState state, void* servus)
+        return servus::Servus::Result(_result);
+    }
+
+    bool _isDiscoveryComplete() const final
     {
-        ((Servus*)servus)->_clientCB(state);
+        ScopedLock lock(_mutex);
+        return _browser && _allForNow && _unresolved.empty();
     }
 
-    void _clientCB(AvahiClientState state)
+    // Client state change of the shared connection
+    void clientStateChanged(const AvahiClientState state) final
     {
         switch (state)
         {
         case AVAHI_CLIENT_S_RUNNING:
             _announcable = true;
-            if (!_announce.empty())
+            if (_hasServices())
                 _createServices();
+            _condition.notify_all();
             break;
 
         case AVAHI_CLIENT_FAILURE:
             _result = avahi_client_errno(_client);
             WARN << "Client failure: " << avahi_strerror(_result) << std::endl;
-            avahi_simple_poll_quit(_poll);
+            count(Metrics::POLL_ERRORS);
+            _completeAnnounce(_result);
+            _condition.notify_all();
             break;
 
         case AVAHI_CLIENT_S_COLLISION:
             // Can't setup client
             _result = EEXIST;
-            avahi_simple_poll_quit(_poll);
+            _completeAnnounce(_result);
+            _condition.notify_all();
             break;
 
         case AVAHI_CLIENT_S_REGISTERING:
@@ -277,35 +399,62 @@ private:
         case AVAHI_BROWSER_FAILURE:
             _result = avahi_client_errno(_client);
             WARN << "Browser failure: " << avahi_strerror(_result) << std::endl;
-            avahi_simple_poll_quit(_poll);
+            count(Metrics::POLL_ERRORS);
+            _failed = true;
             break;
 
         case AVAHI_BROWSER_NEW:
-            // We ignore the returned resolver object. In the callback function
-            // we free it. If the server is terminated before the callback
-            // function is called the server will free the resolver for us.
-            if (!avahi_service_resolver_new(_client, ifIndex, protocol, name,
-                                            type, domain, AVAHI_PROTO_UNSPEC,
-                                            (AvahiLookupFlags)(0), _resolveCBS,
-                                            this))
+        {
+            // The resolver is kept until the service disappears, it reports
+            // each subsequent change of the TXT record.
+            const ResolverKey key(name, ifIndex, protocol);
+            if (_resolvers.count(key))
+                break;
+
+            AvahiServiceResolver* resolver =
+                avahi_service_resolver_new(_client, ifIndex, protocol, name,
+                                           type, domain, AVAHI_PROTO_UNSPEC,
+                                           (AvahiLookupFlags)(0), _resolveCBS,
+                                           this);
+            if (resolver)
+            {
+                _resolvers[key] = resolver;
+                _unresolved.insert(resolver);
+                count(Metrics::RESOLVES_STARTED);
+            }
+            else
             {
                 _result = avahi_client_errno(_client);
                 WARN << "Error creating resolver: " << avahi_strerror(_result)
                      << std::endl;
-                avahi_simple_poll_quit(_poll);
+                _failed = true;
             }
             break;
+        }
 
         case AVAHI_BROWSER_REMOVE:
-            _instanceMap.erase(name);
-            for (Listener* listener : _listeners)
-                listener->instanceRemoved(name);
+        {
+            Resolvers::iterator i =
+                _resolvers.find(ResolverKey(name, ifIndex, protocol));
+            if (i != _resolvers.end())
+            {
+                _unresolved.erase(i->second);
+                avahi_service_resolver_free(i->second);
+                _resolvers.erase(i);
+            }
 
+            // The same instance may still be reachable on another interface
+            for (const auto& j : _resolvers)
+                if (std::get<0>(j.first) == name)
+                    return;
+            _removeInstance(name);
             break;
+        }
 
         case AVAHI_BROWSER_ALL_FOR_NOW:
         case AVAHI_BROWSER_CACHE_EXHAUSTED:
             _result = servus::Result::SUCCESS;
+            _allForNow = true;
             break;
         }
     }
@@ -325,6 +474,13 @@ private:
                     const char* host, AvahiStringList* txt,
                     const AvahiLookupResultFlags flags)
     {
+        // the resolver reports each change of the TXT record after the first
+        const bool first = _unresolved.erase(resolver) > 0;
+        if (event == AVAHI_RESOLVER_FAILURE)
+            count(Metrics::RESOLVES_FAILED);
+        else if (first)
+            count(Metrics::RESOLVES_COMPLETED);
+
         // If browsing through the local interface, consider only the local
         // instances
         if (_scope == servus::Servus::IF_LOCAL &&
@@ -336,11 +492,20 @@ private:
         case AVAHI_RESOLVER_FAILURE:
             _result = avahi_client_errno(_client);
             WARN << "Resolver error: " << avahi_strerror(_result) << std::endl;
+            for (Resolvers::iterator i = _resolvers.begin();
+                 i != _resolvers.end(); ++i)
+            {
+                if (i->second != resolver)
+                    continue;
+                _resolvers.erase(i);
+                avahi_service_resolver_free(resolver);
+                break;
+            }
             break;
 
         case AVAHI_RESOLVER_FOUND:
         {
-            ValueMap& values = _instanceMap[name];
+            ValueMap values;
             values["servus_host"] = host;
             for (; txt; txt = txt->next)
             {
@@ -352,19 +517,18 @@ private:
                 const std::string value = entry.substr(pos + 1);
                 values[key] = value;
             }
-            for (Listener* listener : _listeners)
-                listener->instanceAdded(name);
+            _updateInstance(name, std::move(values));
         }
         break;
         }
-
-        avahi_service_resolver_free(resolver);
     }
 
     void _updateRecord() final
     {
+        ScopedLock lock(_mutex);
+        _record = _data;
         if (_announce.empty() || !_announcable)
-            return;
+            return; // announcements have their own data
 
         if (_group)
             avahi_entry_group_reset(_group);
@@ -381,27 +545,50 @@ private:
         if (!_group)
             return;
 
-        AvahiStringList* data = 0;
-        for (const auto& i : _data)
-            data = avahi_string_list_add_pair(data, i.first.c_str(),
-                                              i.second.c_str());
-
-        _result = avahi_entry_group_add_service_strlst(
-            _group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, (AvahiPublishFlags)(0),
-            _announce.c_str(), _name.c_str(), 0, 0, _port, data);
-
-        if (data)
-            avahi_string_list_free(data);
+        // All services are published with one commit of the entry group
+        _result = servus::Result::SUCCESS;
+        if (!_announce.empty())
+            _result = _addService(_announce, _port, _record);
+        for (const auto& announcement : _announcements)
+        {
+            if (_result != servus::Result::SUCCESS)
+                break;
+            _result = _addService(announcement.instance, announcement.port,
+                                  announcement.data);
+        }
 
         if (_result != servus::Result::SUCCESS)
         {
-            avahi_simple_poll_quit(_poll);
+            _failed = true;
+            _completeAnnounce(_result);
             return;
         }
 
         _result = avahi_entry_group_commit(_group);
         if (_result != servus::Result::SUCCESS)
-            avahi_simple_poll_quit(_poll);
+        {
+            _failed = true;
+            _completeAnnounce(_result);
+        }
+    }
+
+    int _addService(const std::string& instance, const unsigned short port,
+                    const ValueMap& values)
+    {
+        AvahiStringList* data = 0;
+        for (const auto& i : TXTRecord::chunk(values))
+            data = avahi_string_list_add_pair_arbitrary(
+                data, i.first.c_str(),
+                reinterpret_cast<const uint8_t*>(i.second.data()),
+                i.second.size()); // binary values may contain zero bytes
+
+        const int result = avahi_entry_group_add_service_strlst(
+            _group, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, (AvahiPublishFlags)(0),
+            instance.c_str(), _name.c_str(), 0, 0, port, data);
+
+        if (data)
+            avahi_string_list_free(data);
+        return result;
     }
 
     static void _groupCBS(AvahiEntryGroup*, AvahiEntryGroupState state,
@@ -415,12 +602,15 @@ private:
         switch (state)
         {
         case AVAHI_ENTRY_GROUP_ESTABLISHED:
+            _completeAnnounce(servus::Result::SUCCESS);
             break;
 
         case AVAHI_ENTRY_GROUP_COLLISION:
         case AVAHI_ENTRY_GROUP_FAILURE:
             _result = EEXIST;
-            avahi_simple_poll_quit(_poll);
+            _failed = true;
+            _completeAnnounce(_result);
+            _condition.notify_all();
             break;
 
         case AVAHI_ENTRY_GROUP_UNCOMMITED:
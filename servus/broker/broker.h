@@ -0,0 +1,435 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_BROKER_BROKER_H
+#define SERVUS_BROKER_BROKER_H
+
+#include "protocol.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifndef MSG_NOSIGNAL // macOS, SO_NOSIGPIPE is set on the sockets instead
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace servus
+{
+namespace broker
+{
+/**
+ * The registry broker for same-host discovery, run by apps/servusBroker.
+ *
+ * Serves the clients of one Unix socket from a single thread. The broker
+ * owns the registry of all announced instances, and pushes each change to the
+ * subscribed clients right away. Slow clients never block the broker, their
+ * messages are buffered up to MAX_BUFFER_SIZE.
+ */
+class Broker
+{
+public:
+    /** Buffered data per client, exceeding clients are disconnected. */
+    static const size_t MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+
+    /**
+     * Listen on the given socket path.
+     * @throw std::runtime_error if the socket is used by another broker, or
+     *        can't be created.
+     */
+    explicit Broker(const std::string& path = getSocketPath())
+        : _path(path)
+        , _socket(::socket(AF_UNIX, SOCK_STREAM, 0))
+        , _stop{-1, -1}
+    {
+        try
+        {
+            if (_socket < 0 || ::pipe(_stop) != 0)
+                _throw("Can't setup broker socket");
+            for (const int fd : {_socket, _stop[0], _stop[1]})
+                _setNonBlocking(fd);
+
+            sockaddr_un address;
+            ::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                errno = ENAMETOOLONG;
+                _throw("Can't bind broker socket " + path);
+            }
+            ::strncpy(address.sun_path, path.c_str(),
+                      sizeof(address.sun_path) - 1);
+
+            // replace a stale socket of a crashed broker, but not a live one
+            const int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            const bool used = probe >= 0 &&
+                              ::connect(probe, (const sockaddr*)&address,
+                                        sizeof(address)) == 0;
+            if (probe >= 0)
+                ::close(probe);
+            if (used)
+            {
+                errno = EADDRINUSE;
+                _throw("Can't bind broker socket " + path);
+            }
+            ::unlink(path.c_str());
+
+            if (::bind(_socket, (const sockaddr*)&address, sizeof(address)) !=
+                    0 ||
+                ::listen(_socket, SOMAXCONN) != 0)
+            {
+                _throw("Can't bind broker socket " + path);
+            }
+        }
+        catch (...)
+        {
+            _close();
+            throw;
+        }
+    }
+
+    ~Broker()
+    {
+        for (const auto& i : _clients)
+            ::close(i.first);
+        ::unlink(_path.c_str());
+        _close();
+    }
+
+    /** @return the socket path. */
+    const std::string& getPath() const { return _path; }
+
+    /** Serve the clients until stop() is called. */
+    void run()
+    {
+        char buffer[65536];
+        while (::read(_stop[0], buffer, sizeof(buffer)) > 0)
+            ;
+
+        for (;;)
+        {
+            std::vector<pollfd> fds(2);
+            fds[0].fd = _stop[0];
+            fds[0].events = POLLIN;
+            fds[1].fd = _socket;
+            fds[1].events = POLLIN;
+            for (const auto& i : _clients)
+            {
+                pollfd fd;
+                fd.fd = i.first;
+                fd.events = POLLIN | (i.second.out.empty() ? 0 : POLLOUT);
+                fd.revents = 0;
+                fds.push_back(fd);
+            }
+
+            if (::poll(fds.data(), fds.size(), -1) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                _throw("Can't poll broker sockets");
+            }
+            if (fds[0].revents)
+                return;
+            if (fds[1].revents & POLLIN)
+                _accept();
+
+            for (size_t i = 2; i < fds.size(); ++i)
+            {
+                if (!fds[i].revents || !_clients.count(fds[i].fd))
+                    continue;
+                Client& client = _clients[fds[i].fd];
+                if (fds[i].revents & POLLOUT)
+                    _flush(client);
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    _receive(client);
+            }
+            _removeClosed();
+        }
+    }
+
+    /** Make run() return. Thread safe. */
+    void stop()
+    {
+        const char one = 1;
+        const ssize_t written = ::write(_stop[1], &one, sizeof(one));
+        (void)written;
+    }
+
+private:
+    struct Client
+    {
+        int fd;
+        std::string in;
+        std::string out;
+        std::map<std::string, size_t> subscriptions; //!< service, count
+        bool closed;
+    };
+
+    struct Instance
+    {
+        int owner; //!< fd of the announcing client
+        std::string host;
+        std::map<std::string, std::string> data;
+    };
+    typedef std::map<std::string, Instance> Instances;
+
+    const std::string _path;
+    int _socket;
+    int _stop[2];
+    std::map<int, Client> _clients;
+    std::map<std::string, Instances> _services;
+
+    void _close()
+    {
+        for (const int fd : {_socket, _stop[0], _stop[1]})
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    void _throw(const std::string& what)
+    {
+        throw std::runtime_error(what + ": " + ::strerror(errno));
+    }
+
+    static void _setNonBlocking(const int fd)
+    {
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+        const int on = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+
+    void _accept()
+    {
+        for (;;)
+        {
+            const int fd = ::accept(_socket, 0, 0);
+            if (fd < 0)
+                return;
+            _setNonBlocking(fd);
+            Client& client = _clients[fd];
+            client.fd = fd;
+            client.closed = false;
+        }
+    }
+
+    void _receive(Client& client)
+    {
+        char buffer[65536];
+        for (;;)
+        {
+            const ssize_t size = ::recv(client.fd, buffer, sizeof(buffer), 0);
+            if (size > 0)
+            {
+                client.in.append(buffer, size_t(size));
+                continue;
+            }
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                client.closed = true;
+            break;
+        }
+
+        Message message;
+        while (!client.closed)
+        {
+            const int read = broker::read(client.in, message);
+            if (read == 0)
+                break;
+            if (read < 0)
+                client.closed = true;
+            else
+                _handle(client, message);
+        }
+        if (client.in.size() > MAX_BUFFER_SIZE)
+            client.closed = true;
+    }
+
+    void _handle(Client& client, const Message& message)
+    {
+        switch (message.type)
+        {
+        case MSG_ANNOUNCE:
+            _announce(client, message);
+            break;
+        case MSG_WITHDRAW:
+        {
+            Instances& instances = _services[message.service];
+            const auto i = instances.find(message.instance);
+            if (i != instances.end() && i->second.owner == client.fd)
+                _remove(message.service, i);
+            break;
+        }
+        case MSG_SUBSCRIBE:
+        {
+            ++client.subscriptions[message.service];
+            Message reply;
+            reply.type = MSG_INSTANCE;
+            reply.service = message.service;
+            for (const auto& i : _services[message.service])
+            {
+                reply.instance = i.first;
+                reply.host = i.second.host;
+                reply.data = i.second.data;
+                _send(client, reply);
+            }
+            Message synced;
+            synced.type = MSG_SYNCED;
+            synced.service = message.service;
+            _send(client, synced);
+            break;
+        }
+        case MSG_UNSUBSCRIBE:
+        {
+            const auto i = client.subscriptions.find(message.service);
+            if (i != client.subscriptions.end() && --i->second == 0)
+                client.subscriptions.erase(i);
+            break;
+        }
+        default:
+            client.closed = true;
+            break;
+        }
+    }
+
+    void _announce(Client& client, const Message& message)
+    {
+        Message reply;
+        reply.type = MSG_RESULT;
+        reply.id = message.id;
+
+        Instances& instances = _services[message.service];
+        const auto i = instances.find(message.instance);
+        if (i != instances.end() && i->second.owner != client.fd)
+        {
+            reply.result = EEXIST;
+            _send(client, reply);
+            return;
+        }
+
+        const bool changed = i == instances.end() ||
+                             i->second.host != message.host ||
+                             i->second.data != message.data;
+        instances[message.instance] =
+            Instance{client.fd, message.host, message.data};
+        _send(client, reply);
+
+        if (!changed)
+            return;
+        Message instance;
+        instance.type = MSG_INSTANCE;
+        instance.service = message.service;
+        instance.instance = message.instance;
+        instance.host = message.host;
+        instance.data = message.data;
+        _publish(instance);
+    }
+
+    void _remove(const std::string& service, Instances::iterator i)
+    {
+        Message removed;
+        removed.type = MSG_REMOVED;
+        removed.service = service;
+        removed.instance = i->first;
+        _services[service].erase(i);
+        _publish(removed);
+    }
+
+    // Send a change to all subscribed clients
+    void _publish(const Message& message)
+    {
+        for (auto& i : _clients)
+            if (i.second.subscriptions.count(message.service))
+                _send(i.second, message);
+    }
+
+    void _send(Client& client, const Message& message)
+    {
+        if (client.closed)
+            return;
+        write(client.out, message);
+        _flush(client);
+    }
+
+    void _flush(Client& client)
+    {
+        while (!client.out.empty() && !client.closed)
+        {
+            const ssize_t size = ::send(client.fd, client.out.data(),
+                                        client.out.size(), MSG_NOSIGNAL);
+            if (size > 0)
+            {
+                client.out.erase(0, size_t(size));
+                continue;
+            }
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            client.closed = true;
+        }
+        if (client.out.size() > MAX_BUFFER_SIZE)
+            client.closed = true;
+    }
+
+    // Disconnect closed clients and remove their instances
+    void _removeClosed()
+    {
+        for (;;)
+        {
+            auto client = _clients.begin();
+            while (client != _clients.end() && !client->second.closed)
+                ++client;
+            if (client == _clients.end())
+                return;
+
+            const int fd = client->first;
+            ::close(fd);
+            _clients.erase(client);
+
+            for (auto& service : _services)
+            {
+                Instances& instances = service.second;
+                for (auto i = instances.begin(); i != instances.end();)
+                {
+                    if (i->second.owner == fd)
+                        _remove(service.first, i++);
+                    else
+                        ++i;
+                }
+            }
+        }
+    }
+};
+}
+}
+
+#endif
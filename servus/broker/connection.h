@@ -0,0 +1,323 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "protocol.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+
+#ifndef MSG_NOSIGNAL // macOS, SO_NOSIGPIPE is set on the socket instead
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace servus
+{
+namespace broker
+{
+/**
+ * The process-wide connection to the registry broker.
+ *
+ * All broker::Servus instances using the same socket path share one Unix
+ * socket. Received messages are dispatched to all instances, which filter
+ * them by service name and request identifier, and serialize all access
+ * through one mutex.
+ */
+class Connection
+{
+public:
+    /** Notified about messages and the loss of the broker, mutex locked. */
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+        virtual void messageReceived(const Message& message) = 0;
+        virtual void disconnected() = 0;
+    };
+
+    /** @return the shared connection to the given socket, created if needed */
+    static std::shared_ptr<Connection> get(const std::string& path)
+    {
+        static std::mutex mutex;
+        static std::map<std::string, std::weak_ptr<Connection>> instances;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Connection> connection = instances[path].lock();
+        if (!connection || !connection->isConnected())
+        {
+            connection.reset(new Connection(path));
+            instances[path] = connection;
+        }
+        return connection;
+    }
+
+    ~Connection() { _close(); }
+
+    /** Serializes all calls, except wait(), wakeup() and isConnected(). */
+    std::mutex mutex;
+
+    // mutex needs to be locked for all functions below, unless noted otherwise
+    void addListener(Listener* listener) { _listeners.insert(listener); }
+    void removeListener(Listener* listener) { _listeners.erase(listener); }
+
+    /** @return the pollable socket of the connection. Thread safe. */
+    int getFD() const { return _socket; }
+
+    /** @return false if the broker closed the connection. Thread safe. */
+    bool isConnected() const { return _connected; }
+
+    /** @return a new identifier for a request. */
+    uint32_t newID() { return ++_lastID; }
+
+    /**
+     * Wait at most timeout milliseconds for messages, without dispatching
+     * them. Call without the lock held.
+     * @return the number of events, or -1 on error.
+     */
+    int wait(const int timeout) const
+    {
+        pollfd fds[2];
+        fds[0].fd = _wakeup[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = _socket;
+        fds[1].events = POLLIN;
+        const int nEvents = ::poll(fds, _connected ? 2 : 1, timeout);
+        if (nEvents < 0 && errno == EINTR)
+            return 0;
+        return nEvents;
+    }
+
+    /** Interrupt a wait(). Thread safe. */
+    void wakeup()
+    {
+        const char one = 1;
+        // EAGAIN on a full pipe is fine, a wakeup is pending anyway
+        const ssize_t written = ::write(_wakeup[1], &one, sizeof(one));
+        (void)written;
+    }
+
+    /** Receive and dispatch all pending messages. */
+    void dispatch()
+    {
+        char buffer[65536];
+        while (::read(_wakeup[0], buffer, sizeof(buffer)) > 0)
+            ;
+        if (!_connected)
+            return;
+
+        for (;;)
+        {
+            const ssize_t size = ::recv(_socket, buffer, sizeof(buffer), 0);
+            if (size > 0)
+            {
+                _in.append(buffer, size_t(size));
+                continue;
+            }
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (size < 0 && errno == EINTR)
+                continue;
+            _disconnect();
+            return;
+        }
+
+        Message message;
+        for (;;)
+        {
+            const int read = broker::read(_in, message);
+            if (read == 0)
+                return;
+            if (read < 0)
+            {
+                _disconnect();
+                return;
+            }
+            const std::set<Listener*> listeners = _listeners;
+            for (Listener* listener : listeners)
+                if (_listeners.count(listener))
+                    listener->messageReceived(message);
+        }
+    }
+
+    /** Send a message to the broker. @return false if disconnected. */
+    bool send(const Message& message)
+    {
+        if (!_connected)
+            return false;
+
+        std::string frame;
+        write(frame, message);
+        size_t pos = 0;
+        while (pos < frame.size())
+        {
+            const ssize_t size = ::send(_socket, frame.data() + pos,
+                                        frame.size() - pos, MSG_NOSIGNAL);
+            if (size > 0)
+            {
+                pos += size_t(size);
+                continue;
+            }
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                // the broker never blocks on its clients, wait for it
+                pollfd fd;
+                fd.fd = _socket;
+                fd.events = POLLOUT;
+                ::poll(&fd, 1, -1);
+                continue;
+            }
+            if (size < 0 && errno == EINTR)
+                continue;
+            // notify the listeners from the next dispatch(), not from within
+            // their calls
+            ::shutdown(_socket, SHUT_RDWR);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Claim an instance name of a service for the given owner within this
+     * process, the broker detects conflicts with other processes.
+     * @return false if the name is owned by another owner.
+     */
+    bool claim(const std::string& service, const std::string& instance,
+               const void* owner)
+    {
+        const auto i = _names.insert(std::make_pair(Name(service, instance),
+                                                    owner));
+        return i.first->second == owner;
+    }
+
+    /** Release a name claimed by the given owner. */
+    void release(const std::string& service, const std::string& instance,
+                 const void* owner)
+    {
+        const auto i = _names.find(Name(service, instance));
+        if (i != _names.end() && i->second == owner)
+            _names.erase(i);
+    }
+
+private:
+    typedef std::pair<std::string, std::string> Name; //!< service, instance
+
+    int _socket;
+    int _wakeup[2];
+    std::atomic<bool> _connected;
+    uint32_t _lastID;
+    std::string _in; //!< received data of incomplete messages
+    std::set<Listener*> _listeners;
+    std::map<Name, const void*> _names; //!< claimed instances
+
+    explicit Connection(const std::string& path)
+        : _socket(::socket(AF_UNIX, SOCK_STREAM, 0))
+        , _wakeup{-1, -1}
+        , _connected(false)
+        , _lastID(0)
+    {
+        try
+        {
+            if (_socket < 0 || ::pipe(_wakeup) != 0)
+                _throw("Can't setup broker socket");
+            for (const int fd : {_socket, _wakeup[0], _wakeup[1]})
+            {
+                ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+#ifdef SO_NOSIGPIPE
+            const int on = 1;
+            ::setsockopt(_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+            sockaddr_un address;
+            ::memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                errno = ENAMETOOLONG;
+                _throw("Can't connect to broker " + path);
+            }
+            ::strncpy(address.sun_path, path.c_str(),
+                      sizeof(address.sun_path) - 1);
+
+            // only trust a broker of this user or root, the socket may be in
+            // a world-writable directory
+            struct stat status;
+            if (::lstat(path.c_str(), &status) != 0)
+                _throw("Can't connect to broker " + path);
+            if (!S_ISSOCK(status.st_mode) ||
+                (status.st_uid != ::geteuid() && status.st_uid != 0))
+            {
+                errno = EPERM;
+                _throw("Untrusted broker socket " + path);
+            }
+
+            // a local connect completes immediately, even if non-blocking
+            if (::connect(_socket, (const sockaddr*)&address,
+                          sizeof(address)) != 0)
+            {
+                _throw("Can't connect to broker " + path);
+            }
+            _connected = true;
+        }
+        catch (...)
+        {
+            _close();
+            throw;
+        }
+    }
+
+    void _close()
+    {
+        for (const int fd : {_socket, _wakeup[0], _wakeup[1]})
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    void _throw(const std::string& what)
+    {
+        throw std::runtime_error(what + ": " + ::strerror(errno));
+    }
+
+    void _disconnect()
+    {
+        if (!_connected)
+            return;
+        _connected = false;
+        _in.clear();
+        const std::set<Listener*> listeners = _listeners;
+        for (Listener* listener : listeners)
+            if (_listeners.count(listener))
+                listener->disconnected();
+    }
+};
+}
+}
@@ -0,0 +1,193 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_BROKER_PROTOCOL_H
+#define SERVUS_BROKER_PROTOCOL_H
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+namespace servus
+{
+namespace broker
+{
+/**
+ * @return the socket path of the broker, from SERVUS_BROKER if set. The
+ *         default is in the private XDG_RUNTIME_DIR of the user, or a per-user
+ *         path in /tmp.
+ */
+inline std::string getSocketPath()
+{
+    const char* path = ::getenv("SERVUS_BROKER");
+    if (path && *path)
+        return path;
+    const char* runtimeDir = ::getenv("XDG_RUNTIME_DIR");
+    if (runtimeDir && *runtimeDir)
+        return std::string(runtimeDir) + "/servus.broker";
+    return "/tmp/servus.broker." + std::to_string(::getuid());
+}
+
+/**
+ * The messages exchanged between clients and the registry broker.
+ *
+ * Each message is a frame of a 32 bit size followed by the message fields.
+ * The broker keeps the instances announced by each client until they are
+ * withdrawn or the client disconnects, and pushes all changes of a service to
+ * the clients subscribed to it.
+ */
+enum MessageType
+{
+    MSG_ANNOUNCE = 1, //!< client: add or update an instance, replied by RESULT
+    MSG_WITHDRAW,     //!< client: remove an instance
+    MSG_SUBSCRIBE,    //!< client: replied by INSTANCE for each, then SYNCED
+    MSG_UNSUBSCRIBE,  //!< client: stop receiving changes of a service
+    MSG_RESULT,       //!< broker: result of the ANNOUNCE of the same id
+    MSG_INSTANCE,     //!< broker: an instance was added or updated
+    MSG_REMOVED,      //!< broker: an instance was removed
+    MSG_SYNCED        //!< broker: all instances of a subscription were sent
+};
+
+struct Message
+{
+    uint8_t type;
+    uint32_t id;     //!< of ANNOUNCE and RESULT
+    int32_t result;  //!< of RESULT, a servus::Result code
+    std::string service;
+    std::string instance;
+    std::string host; //!< of the announcing client
+    std::map<std::string, std::string> data;
+
+    Message()
+        : type(0)
+        , id(0)
+        , result(0)
+    {
+    }
+};
+
+namespace detail
+{
+inline void write32(std::string& buffer, const uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        buffer += char(uint8_t(value >> shift));
+}
+
+inline void writeString(std::string& buffer, const std::string& string)
+{
+    write32(buffer, uint32_t(string.size()));
+    buffer += string;
+}
+
+inline bool read32(const std::string& buffer, size_t& pos, uint32_t& value)
+{
+    if (pos + 4 > buffer.size())
+        return false;
+    value = 0;
+    for (size_t i = 0; i < 4; ++i)
+        value = (value << 8) | uint8_t(buffer[pos++]);
+    return true;
+}
+
+inline bool readString(const std::string& buffer, size_t& pos,
+                       std::string& string)
+{
+    uint32_t size;
+    if (!read32(buffer, pos, size) || pos + size > buffer.size())
+        return false;
+    string = buffer.substr(pos, size);
+    pos += size;
+    return true;
+}
+}
+
+/** Append the frame of the given message to the buffer. */
+inline void write(std::string& buffer, const Message& message)
+{
+    std::string frame;
+    frame += char(message.type);
+    detail::write32(frame, message.id);
+    detail::write32(frame, uint32_t(message.result));
+    detail::writeString(frame, message.service);
+    detail::writeString(frame, message.instance);
+    detail::writeString(frame, message.host);
+    detail::write32(frame, uint32_t(message.data.size()));
+    for (const auto& i : message.data)
+    {
+        detail::writeString(frame, i.first);
+        detail::writeString(frame, i.second);
+    }
+
+    detail::write32(buffer, uint32_t(frame.size()));
+    buffer += frame;
+}
+
+/**
+ * Read and consume the first complete frame of the buffer.
+ *
+ * @return 1 if a message was read, 0 if the frame is incomplete, -1 if the
+ *         frame is malformed.
+ */
+inline int read(std::string& buffer, Message& message)
+{
+    size_t pos = 0;
+    uint32_t size;
+    if (!detail::read32(buffer, pos, size) || pos + size > buffer.size())
+        return 0;
+
+    const std::string frame = buffer.substr(pos, size);
+    buffer.erase(0, pos + size);
+
+    pos = 0;
+    uint32_t id, result, nValues;
+    if (frame.empty())
+        return -1;
+    message = Message();
+    message.type = uint8_t(frame[pos++]);
+    if (!detail::read32(frame, pos, id) ||
+        !detail::read32(frame, pos, result) ||
+        !detail::readString(frame, pos, message.service) ||
+        !detail::readString(frame, pos, message.instance) ||
+        !detail::readString(frame, pos, message.host) ||
+        !detail::read32(frame, pos, nValues))
+    {
+        return -1;
+    }
+    message.id = id;
+    message.result = int32_t(result);
+
+    for (uint32_t i = 0; i < nValues; ++i)
+    {
+        std::string key, value;
+        if (!detail::readString(frame, pos, key) ||
+            !detail::readString(frame, pos, value))
+        {
+            return -1;
+        }
+        message.data[key] = value;
+    }
+    return pos == frame.size() ? 1 : -1;
+}
+}
+}
+
+#endif
@@ -0,0 +1,405 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "connection.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+
+namespace servus
+{
+namespace broker
+{
+using ScopedLock = std::unique_lock<std::mutex>;
+using std::chrono::milliseconds;
+
+/**
+ * Same-host discovery through a registry broker, see apps/servusBroker.
+ *
+ * Announced instances are registered with the broker over the shared
+ * broker::Connection, which pushes all changes of a service to the browsing
+ * clients as they happen. The broker removes the instances of a client when
+ * it disconnects, e.g. when its process crashes.
+ */
+class Servus : public servus::Servus::Impl, private Connection::Listener
+{
+    typedef std::chrono::steady_clock Clock; // Impl's is private
+
+public:
+    explicit Servus(const std::string& name)
+        : servus::Servus::Impl(name)
+        , _connection(Connection::get(getSocketPath()))
+        , _mutex(_connection->mutex)
+        , _host(getHostname())
+        , _result(servus::Servus::Result::SUCCESS)
+        , _browsing(false)
+        , _synced(false)
+    {
+        ScopedLock lock(_mutex);
+        _connection->addListener(this);
+    }
+
+    virtual ~Servus()
+    {
+        stopEventThread();
+        withdraw();
+        endBrowsing();
+
+        ScopedLock lock(_mutex);
+        _connection->removeListener(this);
+    }
+
+    std::string getClassName() const { return "broker"; }
+    servus::Servus::Result announce(const unsigned short,
+                                    const std::string& instance) final
+    {
+        ScopedLock lock(_mutex);
+        const servus::Servus::Result result = _announcePrimary(instance);
+        return result == servus::Servus::Result::PENDING ? _wait(lock)
+                                                        : result;
+    }
+
+    servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) final
+    {
+        ScopedLock lock(_mutex);
+        _withdrawInstances();
+        for (const auto& announcement : announcements)
+        {
+            const std::string& instance = announcement.instance.empty()
+                                              ? _host
+                                              : announcement.instance;
+            if (!_connection->claim(_name, instance, this))
+            {
+                _withdrawInstances();
+                return servus::Servus::Result(EEXIST);
+            }
+            _instances.insert(instance);
+            if (!_send(MSG_ANNOUNCE, instance, announcement.data, true))
+            {
+                _withdrawInstances();
+                return servus::Servus::Result(ENOTCONN);
+            }
+        }
+
+        const servus::Servus::Result result = _wait(lock);
+        if (!result)
+            _withdrawInstances();
+        return result;
+    }
+
+    void withdraw() final
+    {
+        ScopedLock lock(_mutex);
+        _completeAnnounce(ECANCELED);
+        _withdrawPrimary();
+        _withdrawInstances();
+    }
+
+    bool isAnnounced() const final
+    {
+        ScopedLock lock(_mutex);
+        return !_primary.empty() || !_instances.empty();
+    }
+
+    servus::Servus::Result beginBrowsing(
+        const ::servus::Servus::Interface) final
+    {
+        ScopedLock lock(_mutex);
+        if (_browsing)
+            return servus::Servus::Result(servus::Servus::Result::PENDING);
+
+        _clearInstances();
+        _discovered.clear();
+        _synced = false;
+        if (!_send(MSG_SUBSCRIBE, std::string()))
+            return servus::Servus::Result(ENOTCONN);
+        _browsing = true;
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void endBrowsing() final
+    {
+        ScopedLock lock(_mutex);
+        if (_browsing)
+            _send(MSG_UNSUBSCRIBE, std::string());
+        _browsing = false;
+        _synced = false;
+        _discovered.clear();
+    }
+
+    bool isBrowsing() const final
+    {
+        ScopedLock lock(_mutex);
+        return _browsing;
+    }
+
+    int getEventFD() final { return _connection->getFD(); }
+private:
+    const std::shared_ptr<Connection> _connection;
+    std::mutex& _mutex; //!< of the shared connection
+    std::condition_variable _condition; //!< signaled when all results arrived
+    const std::string _host;
+
+    // announce
+    std::string _primary;            //!< instance of announce(port, instance)
+    std::set<std::string> _instances; //!< of announce(Announcements)
+    std::map<uint32_t, std::string> _requests; //!< instance of pending id
+    int32_t _result; //!< first error of the pending requests
+
+    // browse
+    bool _browsing;
+    bool _synced; //!< all instances of the subscription were received
+    std::set<std::string> _discovered;
+
+    // Send a message for the given instance of this service. Tracks the
+    // result of announcements if request is set.
+    bool _send(const MessageType type, const std::string& instance,
+               const ValueMap& data = ValueMap(), const bool request = false)
+    {
+        Message message;
+        message.type = type;
+        message.service = _name;
+        message.instance = instance;
+        if (type == MSG_ANNOUNCE)
+        {
+            message.host = _host;
+            message.data = data;
+        }
+        if (request)
+        {
+            if (_requests.empty())
+                _result = servus::Servus::Result::SUCCESS;
+            message.id = _connection->newID();
+            _requests[message.id] = instance;
+        }
+
+        if (_connection->send(message))
+            return true;
+        _requests.erase(message.id);
+        return false;
+    }
+
+    // Announce the primary instance. Returns PENDING if sent.
+    servus::Servus::Result _announcePrimary(const std::string& instance)
+    {
+        const std::string& name = instance.empty() ? _host : instance;
+        if (_primary != name)
+            _withdrawPrimary();
+        if (!_connection->claim(_name, name, this))
+            return servus::Servus::Result(EEXIST);
+
+        _primary = name;
+        if (_send(MSG_ANNOUNCE, name, _data, true))
+            return servus::Servus::Result(servus::Servus::Result::PENDING);
+        _withdrawPrimary();
+        return servus::Servus::Result(ENOTCONN);
+    }
+
+    void _withdrawPrimary()
+    {
+        if (_primary.empty())
+            return;
+        _send(MSG_WITHDRAW, _primary);
+        _connection->release(_name, _primary, this);
+        _primary.clear();
+    }
+
+    void _withdrawInstances()
+    {
+        for (const std::string& instance : _instances)
+        {
+            _send(MSG_WITHDRAW, instance);
+            _connection->release(_name, instance, this);
+        }
+        _instances.clear();
+    }
+
+    // Wait for the results of all pending requests
+    servus::Servus::Result _wait(ScopedLock& lock)
+    {
+        const Clock::time_point end =
+            Clock::now() + milliseconds(ANNOUNCE_TIMEOUT);
+        while (!_requests.empty())
+        {
+            const Clock::time_point now = Clock::now();
+            if (now >= end)
+                return servus::Servus::Result(
+                    servus::Servus::Result::PENDING);
+
+            if (hasEventThread())
+            {
+                _connection->wakeup();
+                _condition.wait_until(lock, end);
+                continue;
+            }
+
+            lock.unlock();
+            const int nEvents = _connection->wait(int(
+                std::chrono::duration_cast<milliseconds>(end - now).count()));
+            lock.lock();
+            if (nEvents < 0)
+            {
+                count(Metrics::POLL_ERRORS);
+                return servus::Servus::Result(
+                    servus::Servus::Result::POLL_ERROR);
+            }
+            _connection->dispatch();
+        }
+        return servus::Servus::Result(_result);
+    }
+
+    servus::Servus::Result _startAnnounce(const unsigned short,
+                                          const std::string& instance) final
+    {
+        ScopedLock lock(_mutex);
+        const servus::Servus::Result result = _announcePrimary(instance);
+        if (result == servus::Servus::Result::PENDING)
+        {
+            _beginAnnounce();
+            _connection->wakeup();
+        }
+        return result;
+    }
+
+    void _updateRecord() final
+    {
+        ScopedLock lock(_mutex);
+        if (!_primary.empty())
+            _send(MSG_ANNOUNCE, _primary, _data);
+    }
+
+    void messageReceived(const Message& message) final
+    {
+        if (message.type == MSG_RESULT)
+        {
+            _resultReceived(message);
+            return;
+        }
+        if (!_browsing || message.service != _name)
+            return;
+
+        switch (message.type)
+        {
+        case MSG_INSTANCE:
+        {
+            ValueMap values = message.data;
+            values["servus_host"] = message.host;
+            _discovered.insert(message.instance);
+            _updateInstance(message.instance, std::move(values));
+            break;
+        }
+        case MSG_REMOVED:
+            _discovered.erase(message.instance);
+            _removeInstance(message.instance);
+            break;
+        case MSG_SYNCED:
+            _synced = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void _resultReceived(const Message& message)
+    {
+        const auto i = _requests.find(message.id);
+        if (i == _requests.end())
+            return;
+
+        if (message.result != servus::Servus::Result::SUCCESS)
+        {
+            if (_result == servus::Servus::Result::SUCCESS)
+                _result = message.result;
+            _connection->release(_name, i->second, this);
+            if (i->second == _primary)
+                _primary.clear();
+            _instances.erase(i->second);
+        }
+        _requests.erase(i);
+        if (!_requests.empty())
+            return;
+
+        _completeAnnounce(_result);
+        _condition.notify_all();
+    }
+
+    void disconnected() final
+    {
+        _connection->release(_name, _primary, this);
+        for (const std::string& instance : _instances)
+            _connection->release(_name, instance, this);
+        _primary.clear();
+        _instances.clear();
+        if (!_requests.empty())
+        {
+            _requests.clear();
+            _result = ENOTCONN;
+            _completeAnnounce(_result);
+            _condition.notify_all();
+        }
+
+        for (const std::string& instance : _discovered)
+            _removeInstance(instance);
+        _discovered.clear();
+    }
+
+    bool _isDiscoveryComplete() const final
+    {
+        ScopedLock lock(_mutex);
+        return _browsing && _synced;
+    }
+
+    servus::Servus::Result _processEvents(const int32_t timeout) final
+    {
+        ScopedLock lock(_mutex);
+        const Clock::time_point end = Clock::now() + milliseconds(timeout);
+        do
+        {
+            const Clock::time_point now = Clock::now();
+            const int remaining =
+                timeout < 0 ? -1 : int(std::chrono::duration_cast<milliseconds>(
+                                           std::max(end, now) - now)
+                                           .count());
+
+            // Do not block other threads while waiting
+            lock.unlock();
+            const int nEvents = _connection->wait(remaining);
+            lock.lock();
+            if (nEvents < 0)
+            {
+                count(Metrics::POLL_ERRORS);
+                return servus::Servus::Result(
+                    servus::Servus::Result::POLL_ERROR);
+            }
+            _connection->dispatch();
+            if (!_connection->isConnected())
+                return servus::Servus::Result(ENOTCONN);
+        } while (Clock::now() < end && !_isBrowseInterrupted());
+
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void _wakeup() final { _connection->wakeup(); }
+};
+}
+}
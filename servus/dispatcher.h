@@ -0,0 +1,501 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_DISPATCHER_H
+#define SERVUS_DISPATCHER_H
+
+#include "listener.h"
+#include "metrics.h"
+#include "servus.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace servus
+{
+/**
+ * Delivers the instance events of a Servus to its listeners, see
+ * Servus::setDispatch().
+ *
+ * Inline, events are delivered by the producing thread. Otherwise they are
+ * queued in a bounded queue, and delivered by a worker thread or by tasks
+ * passed to an executor. Tasks keep the dispatcher alive, but do not deliver
+ * anything after stop(). The listener set is guarded by a recursive mutex,
+ * held during each delivery, so that listeners may modify it from their
+ * callbacks.
+ *
+ * Batch listeners collect the delivered events per instance. A flush event,
+ * queued by flush() after each event processing iteration, passes the batches
+ * whose window expired to their listeners.
+ */
+class Dispatcher : public std::enable_shared_from_this<Dispatcher>
+{
+public:
+    explicit Dispatcher(Metrics& metrics)
+        : _metrics(metrics)
+    {
+    }
+
+    ~Dispatcher() { stop(); }
+
+    void addListener(Listener* listener)
+    {
+        std::lock_guard<std::recursive_mutex> lock(_listenersMutex);
+        _listeners.insert(listener);
+    }
+
+    void removeListener(Listener* listener)
+    {
+        std::lock_guard<std::recursive_mutex> lock(_listenersMutex);
+        _listeners.erase(listener);
+    }
+
+    void addListener(BatchListener* listener, const uint32_t window)
+    {
+        std::lock_guard<std::recursive_mutex> lock(_listenersMutex);
+        _batches[listener].window = std::chrono::milliseconds(window);
+        _updateBatching();
+    }
+
+    void removeListener(BatchListener* listener)
+    {
+        std::lock_guard<std::recursive_mutex> lock(_listenersMutex);
+        _batches.erase(listener);
+        _updateBatching();
+    }
+
+    void configure(const Servus::DispatchPolicy policy, const size_t queueSize,
+                   const Servus::Executor& executor)
+    {
+        _stopWorker();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _policy = policy;
+            _queueSize = std::max(queueSize, size_t(1));
+            _executor = executor;
+        }
+        _drain(); // events queued for a previous executor
+
+        if (policy == Servus::DISPATCH_INLINE || executor)
+            return;
+
+        // the worker keeps the dispatcher alive when it is detached
+        const std::shared_ptr<Dispatcher> self = shared_from_this();
+        std::lock_guard<std::mutex> lock(_mutex);
+        const size_t generation = _generation;
+        _worker = std::thread([self, generation] { self->_run(generation); });
+    }
+
+    /** Stop the delivery and drop all queued events. */
+    void stop()
+    {
+        {
+            std::lock_guard<std::recursive_mutex> lock(_listenersMutex);
+            _stopped = true; // waits for a running delivery
+        }
+        _stopWorker();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.clear();
+        _condition.notify_all();
+    }
+
+    void instanceAdded(const std::string& instance)
+    {
+        _push(Event{ADDED, instance, Strings(), Strings()});
+    }
+
+    void instanceUpdated(const std::string& instance,
+                         const Strings& changedKeys, const Strings& removedKeys)
+    {
+        _push(Event{UPDATED, instance, changedKeys, removedKeys});
+    }
+
+    void instanceRemoved(const std::string& instance)
+    {
+        _push(Event{REMOVED, instance, Strings(), Strings()});
+    }
+
+    /** Deliver the expired batches after the events pushed so far. */
+    void flush()
+    {
+        const Batching batching = _batching;
+        if (batching == BATCH_NONE)
+            return;
+        if (!_unflushed.exchange(false) && batching != BATCH_WINDOWED)
+            return;
+        _push(Event{FLUSH, std::string(), Strings(), Strings()});
+    }
+
+private:
+    enum Type
+    {
+        ADDED,
+        UPDATED,
+        REMOVED,
+        FLUSH //!< of the batch listeners
+    };
+
+    enum Batching
+    {
+        BATCH_NONE,     //!< no batch listeners
+        BATCH_FLUSHED,  //!< only flush after new events
+        BATCH_WINDOWED  //!< flush after each iteration, until windows expire
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Batch
+    {
+        Clock::duration window{0};
+        Clock::time_point start; //!< of the first collected change
+        std::map<std::string, Type> changes;
+    };
+
+    struct Event
+    {
+        Type type;
+        std::string instance;
+        Strings changedKeys;
+        Strings removedKeys;
+    };
+
+    Metrics& _metrics; //!< of the Servus, not used after stop()
+
+    std::recursive_mutex _listenersMutex;
+    std::unordered_set<Listener*> _listeners;
+    std::map<BatchListener*, Batch> _batches;
+    std::atomic<Batching> _batching{BATCH_NONE};
+    std::atomic<bool> _unflushed{false}; //!< events pushed since last flush
+    std::atomic<bool> _stopped{false};
+
+    std::mutex _mutex; //!< guards the members below
+    std::condition_variable _condition; //!< signaled on queue changes
+    std::deque<Event> _queue;
+    Servus::DispatchPolicy _policy{Servus::DISPATCH_INLINE};
+    size_t _queueSize{1};
+    Servus::Executor _executor;
+    bool _scheduled{false}; //!< a task was passed to the executor
+    bool _exit{false};      //!< the worker exits once the queue is empty
+    size_t _generation{0};  //!< of the worker, detached workers exit
+    std::thread _worker;
+
+    void _push(Event&& event)
+    {
+        if (event.type != FLUSH && _batching != BATCH_NONE)
+            _unflushed = true;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_policy == Servus::DISPATCH_INLINE)
+        {
+            lock.unlock();
+            _deliver(event);
+            return;
+        }
+
+        if (event.type == FLUSH && _queue.size() >= _queueSize)
+        {
+            _unflushed = true; // retry after the next iteration
+            return;
+        }
+        while (_queue.size() >= _queueSize && !_stopped)
+        {
+            if (_policy == Servus::DISPATCH_DROP_OLDEST)
+            {
+                if (_queue.front().type == FLUSH)
+                    _unflushed = true; // retry after the next iteration
+                _queue.pop_front();
+                _metrics.count(Metrics::EVENTS_DROPPED);
+                Metrics::getGlobal().count(Metrics::EVENTS_DROPPED);
+                continue;
+            }
+            if (_policy == Servus::DISPATCH_COALESCE && _coalesce(event))
+                return;
+            _condition.wait(lock);
+        }
+        if (_stopped)
+            return;
+
+        _queue.push_back(std::move(event));
+        _condition.notify_all();
+        if (!_executor || _scheduled)
+            return;
+
+        _scheduled = true;
+        const Servus::Executor executor = _executor;
+        const std::shared_ptr<Dispatcher> self = shared_from_this();
+        lock.unlock();
+        executor([self] { self->_drain(); });
+    }
+
+    // Merge the event into the last pending event of its instance.
+    // @return false if they can't be merged
+    bool _coalesce(const Event& event)
+    {
+        auto i = std::find_if(_queue.rbegin(), _queue.rend(),
+                              [&event](const Event& candidate) {
+                                  return candidate.type != FLUSH &&
+                                         candidate.instance == event.instance;
+                              });
+        if (i == _queue.rend())
+            return false;
+
+        Event& pending = *i;
+        if (event.type == UPDATED &&
+            (pending.type == ADDED || pending.type == UPDATED))
+        {
+            if (pending.type == UPDATED)
+                _mergeKeys(pending, event);
+            return true;
+        }
+        if (event.type != REMOVED || pending.type == REMOVED)
+            return false;
+
+        if (pending.type == ADDED) // never seen by the listeners
+            _queue.erase(std::next(i).base());
+        else
+            pending = event;
+        _condition.notify_all();
+        return true;
+    }
+
+    static void _mergeKeys(Event& pending, const Event& event)
+    {
+        std::set<std::string> changed(pending.changedKeys.begin(),
+                                      pending.changedKeys.end());
+        std::set<std::string> removed(pending.removedKeys.begin(),
+                                      pending.removedKeys.end());
+        for (const std::string& key : event.changedKeys)
+        {
+            removed.erase(key);
+            changed.insert(key);
+        }
+        for (const std::string& key : event.removedKeys)
+        {
+            changed.erase(key);
+            removed.insert(key);
+        }
+        pending.changedKeys.assign(changed.begin(), changed.end());
+        pending.removedKeys.assign(removed.begin(), removed.end());
+    }
+
+    void _updateBatching()
+    {
+        Batching batching = _batches.empty() ? BATCH_NONE : BATCH_FLUSHED;
+        for (const auto& batch : _batches)
+            if (batch.second.window > Clock::duration::zero())
+                batching = BATCH_WINDOWED;
+        _batching = batching;
+    }
+
+    // Merge the event into the changes of the batch listeners
+    void _collect(const Event& event)
+    {
+        if (_batches.empty())
+            return;
+
+        const Clock::time_point now = Clock::now();
+        for (auto& i : _batches)
+        {
+            Batch& batch = i.second;
+            if (batch.changes.empty())
+                batch.start = now;
+
+            auto change = batch.changes.find(event.instance);
+            if (change == batch.changes.end())
+                batch.changes[event.instance] = event.type;
+            else if (change->second == ADDED) // never seen by the listener
+            {
+                if (event.type == REMOVED)
+                    batch.changes.erase(change);
+            }
+            else if (change->second == REMOVED)
+                change->second = event.type == ADDED ? UPDATED : event.type;
+            else
+                change->second = event.type;
+        }
+    }
+
+    // Pass the batches with an expired window to their listeners
+    // @return true if a listener was notified
+    bool _flush()
+    {
+        const Clock::time_point now = Clock::now();
+        // listeners may be removed by the callbacks
+        std::vector<BatchListener*> listeners;
+        for (const auto& i : _batches)
+            listeners.push_back(i.first);
+
+        bool notified = false;
+        for (BatchListener* listener : listeners)
+        {
+            auto i = _batches.find(listener);
+            if (i == _batches.end() || i->second.changes.empty() ||
+                now - i->second.start < i->second.window)
+            {
+                continue;
+            }
+
+            Strings added, removed, updated;
+            for (const auto& change : i->second.changes)
+            {
+                switch (change.second)
+                {
+                case ADDED:
+                    added.push_back(change.first);
+                    break;
+                case REMOVED:
+                    removed.push_back(change.first);
+                    break;
+                default:
+                    updated.push_back(change.first);
+                    break;
+                }
+            }
+            i->second.changes.clear();
+            listener->instancesChanged(added, removed, updated);
+            notified = true;
+        }
+        return notified;
+    }
+
+    void _deliver(const Event& event)
+    {
+        std::lock_guard<std::recursive_mutex> lock(_listenersMutex);
+        if (_stopped)
+            return;
+
+        const auto start = std::chrono::steady_clock::now();
+        if (event.type == FLUSH)
+        {
+            if (_flush())
+                _record(start);
+            return;
+        }
+
+        _collect(event);
+        // listeners may be removed by the callbacks
+        const std::unordered_set<Listener*> listeners = _listeners;
+        for (Listener* listener : listeners)
+        {
+            if (!_listeners.count(listener))
+                continue;
+            switch (event.type)
+            {
+            case ADDED:
+                listener->instanceAdded(event.instance);
+                break;
+            case UPDATED:
+                listener->instanceUpdated(event.instance, event.changedKeys,
+                                          event.removedKeys);
+                break;
+            case REMOVED:
+                listener->instanceRemoved(event.instance);
+                break;
+            case FLUSH:
+                break;
+            }
+        }
+        _record(start);
+    }
+
+    void _record(const Clock::time_point& start)
+    {
+        if (_stopped) // the Servus may be destroyed by the listener
+            return;
+        const auto time = Clock::now() - start;
+        _metrics.record(Metrics::LISTENER_TIME, time);
+        Metrics::getGlobal().record(Metrics::LISTENER_TIME, time);
+    }
+
+    // Deliver the queued events, run by the executor
+    void _drain()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_queue.empty() && !_stopped)
+        {
+            const Event event = std::move(_queue.front());
+            _queue.pop_front();
+            _condition.notify_all();
+
+            lock.unlock();
+            _deliver(event);
+            lock.lock();
+        }
+        _scheduled = false;
+    }
+
+    void _run(const size_t generation)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (!_stopped && _generation == generation)
+        {
+            if (_queue.empty())
+            {
+                if (_exit)
+                    break;
+                _condition.wait(lock);
+                continue;
+            }
+
+            const Event event = std::move(_queue.front());
+            _queue.pop_front();
+            _condition.notify_all();
+
+            lock.unlock();
+            _deliver(event);
+            lock.lock();
+        }
+    }
+
+    // Stop the worker thread after it delivered the queued events
+    void _stopWorker()
+    {
+        if (!_worker.joinable())
+            return;
+        if (_worker.get_id() == std::this_thread::get_id())
+        {
+            // stopped from a listener, exits after it without delivering the
+            // queue to a new worker
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_generation;
+            _condition.notify_all();
+            _worker.detach();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _exit = true;
+            _condition.notify_all();
+        }
+        _worker.join();
+        std::lock_guard<std::mutex> lock(_mutex);
+        _exit = false;
+    }
+};
+}
+
+#endif
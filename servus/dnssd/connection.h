@@ -0,0 +1,76 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <dns_sd.h>
+
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace servus
+{
+namespace dnssd
+{
+/**
+ * The process-wide connection to the DNSServiceDiscovery daemon.
+ *
+ * All dnssd::Servus instances create their operations with
+ * kDNSServiceFlagsShareConnection on this connection, and serialize all
+ * DNSService calls through one mutex. The connection is created by the first
+ * instance and released with the last one.
+ */
+class Connection
+{
+public:
+    /** @return the shared connection, created if needed. */
+    static std::shared_ptr<Connection> get()
+    {
+        static std::mutex mutex;
+        static std::weak_ptr<Connection> instance;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Connection> connection = instance.lock();
+        if (!connection)
+        {
+            connection.reset(new Connection);
+            instance = connection;
+        }
+        return connection;
+    }
+
+    ~Connection() { DNSServiceRefDeallocate(_ref); }
+    DNSServiceRef getRef() const { return _ref; }
+    /** Recursive, since callbacks may invoke the API of any instance. */
+    std::recursive_mutex mutex;
+
+private:
+    DNSServiceRef _ref;
+
+    Connection()
+        : _ref(0)
+    {
+        const DNSServiceErrorType error = DNSServiceCreateConnection(&_ref);
+        if (error != kDNSServiceErr_NoError)
+            throw std::runtime_error(
+                "Can't connect to DNSServiceDiscovery daemon: " +
+                std::to_string(error));
+    }
+};
+}
+}
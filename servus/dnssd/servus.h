@@ -18,64 +18,136 @@
 
 #ifndef _MSC_VER
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <unistd.h>
 #endif
-#include <dns_sd.h>
+#include "connection.h"
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 
 #define WARN std::cerr << __FILE__ << ":" << __LINE__ << ": "
+#define RESOLVE_TIMEOUT 5000 /*ms*/
+#define MAX_RESOLVES 16 //!< default limit of concurrent resolves
 
 namespace servus
 {
 namespace dnssd
 {
+using ScopedLock = std::unique_lock<std::recursive_mutex>;
+
 class Servus : public servus::Servus::Impl
 {
 public:
     explicit Servus(const std::string& name)
         : Servus::Impl(name)
+        , _sharedConnection(Connection::get())
+        , _connection(_sharedConnection->getRef())
         , _out(0)
         , _in(0)
         , _result(servus::Servus::Result::PENDING)
+        , _registering(false)
+        , _announcementsResult(kDNSServiceErr_NoError)
+        , _maxResolves(MAX_RESOLVES)
+        , _allForNow(false)
+        , _mutex(_sharedConnection->mutex)
     {
+        const char* maxResolves = ::getenv("SERVUS_MAX_RESOLVES");
+        if (maxResolves && ::atoi(maxResolves) > 0)
+            _maxResolves = size_t(::atoi(maxResolves));
+#ifndef _MSC_VER
+        if (::pipe(_wakeupPipe) != 0)
+            throw std::runtime_error(std::string("Can't create wakeup pipe: ") +
+                                     ::strerror(errno));
+        for (const int fd : _wakeupPipe)
+        {
+            ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+#endif
     }
 
     virtual ~Servus()
     {
+        stopEventThread();
         withdraw();
         endBrowsing();
+#ifndef _MSC_VER
+        for (const int fd : _wakeupPipe)
+            ::close(fd);
+#endif
     }
 
     std::string getClassName() const { return "dnssd"; }
     servus::Servus::Result announce(const unsigned short port,
                                     const std::string& instance) final
     {
+        ScopedLock lock(_mutex);
         if (_out)
             return servus::Servus::Result(servus::Servus::Result::PENDING);
 
-        TXTRecordRef record;
-        _createTXTRecord(record);
+        const servus::Servus::Result result = _register(port, instance);
+        if (!result)
+            return result;
+        return _waitRegistered(lock);
+    }
 
-        const servus::Servus::Result result(DNSServiceRegister(
-            &_out, 0 /* flags */, 0 /* all interfaces */,
-            instance.empty() ? 0 : instance.c_str(), _name.c_str(),
-            0 /* default domains */, 0 /* hostname */, htons(port),
-            TXTRecordGetLength(&record), TXTRecordGetBytesPtr(&record),
-            (DNSServiceRegisterReply)registerCBS_, this));
-        TXTRecordDeallocate(&record);
+    servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) final
+    {
+        ScopedLock lock(_mutex);
+        _withdrawAnnouncements();
 
-        if (result)
-            return _handleEvents(_out, ANNOUNCE_TIMEOUT);
+        // Register all instances before processing any reply, the daemon
+        // handles them in one go on the shared connection.
+        for (const auto& announcement : announcements)
+        {
+            TXTRecordRef record;
+            _createTXTRecord(record, announcement.data);
+
+            DNSServiceRef ref = _connection;
+            const DNSServiceErrorType error = DNSServiceRegister(
+                &ref, kDNSServiceFlagsShareConnection, 0 /* all interfaces */,
+                announcement.instance.empty() ? 0
+                                              : announcement.instance.c_str(),
+                _name.c_str(), 0 /* default domains */, 0 /* hostname */,
+                htons(announcement.port), TXTRecordGetLength(&record),
+                TXTRecordGetBytesPtr(&record),
+                (DNSServiceRegisterReply)_announcementCBS, this);
+            TXTRecordDeallocate(&record);
+
+            if (error != kDNSServiceErr_NoError)
+            {
+                WARN << "DNSServiceRegister returned: " << error << std::endl;
+                _withdrawAnnouncements();
+                return servus::Servus::Result(error);
+            }
+            _announcements.insert(ref);
+            _unregistered.insert(ref);
+        }
 
-        WARN << "DNSServiceRegister returned: " << result << std::endl;
-        return result;
+        if (_unregistered.empty())
+            return servus::Servus::Result(kDNSServiceErr_NoError);
+        _announcementsResult = kDNSServiceErr_NoError;
+        return _waitRegistered(lock);
     }
 
     void withdraw() final
     {
+        ScopedLock lock(_mutex);
+        _completeAnnounce(ECANCELED);
+        _withdrawAnnouncements();
         if (!_out)
             return;
 
@@ -83,61 +155,170 @@ public:
         _out = 0;
     }
 
-    bool isAnnounced() const final { return _out != 0; }
+    bool isAnnounced() const final
+    {
+        ScopedLock lock(_mutex);
+        return _out != 0 || !_announcements.empty();
+    }
     servus::Servus::Result beginBrowsing(
         const ::servus::Servus::Interface addr) final
     {
+        ScopedLock lock(_mutex);
         if (_in)
             return servus::Servus::Result(servus::Servus::Result::PENDING);
 
-        _instanceMap.clear();
+        _clearInstances();
+        _allForNow = false;
         return _browse(addr);
     }
 
-    servus::Servus::Result browse(const int32_t timeout) final
-    {
-        return _handleEvents(_in, timeout);
-    }
-
     void endBrowsing() final
     {
+        ScopedLock lock(_mutex);
         if (!_in)
             return;
 
+        for (const auto& i : _resolves)
+            DNSServiceRefDeallocate(i.first);
+        _resolves.clear();
+        _pendingResolves.clear();
+        for (const auto& i : _queries)
+            DNSServiceRefDeallocate(i.first);
+        _queries.clear();
         DNSServiceRefDeallocate(_in);
         _in = 0;
     }
 
     bool isBrowsing() const final { return _in != 0; }
+    int getEventFD() final { return DNSServiceRefSockFD(_connection); }
 private:
-    DNSServiceRef _out; //!< used for announce()
-    DNSServiceRef _in;  //!< used to browse()
+    const std::shared_ptr<Connection> _sharedConnection;
+    const DNSServiceRef _connection; //!< shared by all operations
+    DNSServiceRef _out;              //!< used for announce()
+    DNSServiceRef _in;               //!< used to browse()
     int32_t _result;
-    std::string _browsedName;
+    bool _registering; //!< _waitRegistered() waits for a reply in _result
+
+    std::set<DNSServiceRef> _announcements;   //!< of announce(Announcements)
+    std::set<DNSServiceRef> _unregistered;    //!< waiting for the reply
+    DNSServiceErrorType _announcementsResult; //!< first error of the batch
+
+    struct Resolve
+    {
+        std::string name;
+        std::string type;
+        std::string domain;
+        uint32_t interfaceIdx;
+        std::chrono::steady_clock::time_point started;
+    };
+    std::deque<Resolve> _pendingResolves;       //!< waiting for a free slot
+    std::map<DNSServiceRef, Resolve> _resolves; //!< running
+    size_t _maxResolves; //!< concurrent resolves, env SERVUS_MAX_RESOLVES
+    bool _allForNow;     //!< no more browse results are queued
+    std::map<DNSServiceRef, std::string> _queries; //!< TXT monitor, instance
+    std::recursive_mutex& _mutex; //!< of the shared connection
+#ifndef _MSC_VER
+    int _wakeupPipe[2]; //!< interrupts _wait(), see _wakeup()
+#endif
+    std::condition_variable_any _condition; //!< signaled on register reply
+
+    servus::Servus::Result _startAnnounce(const unsigned short port,
+                                          const std::string& instance) final
+    {
+        ScopedLock lock(_mutex);
+        if (_out)
+            return servus::Servus::Result(kDNSServiceErr_AlreadyRegistered);
+
+        const servus::Servus::Result result = _register(port, instance);
+        if (!result)
+            return result;
+        _beginAnnounce(); // completed by registerCB_
+        return servus::Servus::Result(servus::Servus::Result::PENDING);
+    }
+
+    servus::Servus::Result _register(const unsigned short port,
+                                     const std::string& instance)
+    {
+        TXTRecordRef record;
+        _createTXTRecord(record, _data);
+
+        _out = _connection;
+        const servus::Servus::Result result(DNSServiceRegister(
+            &_out, kDNSServiceFlagsShareConnection, 0 /* all interfaces */,
+            instance.empty() ? 0 : instance.c_str(), _name.c_str(),
+            0 /* default domains */, 0 /* hostname */, htons(port),
+            TXTRecordGetLength(&record), TXTRecordGetBytesPtr(&record),
+            (DNSServiceRegisterReply)registerCBS_, this));
+        TXTRecordDeallocate(&record);
+
+        if (!result)
+        {
+            WARN << "DNSServiceRegister returned: " << result << std::endl;
+            _out = 0;
+        }
+        return result;
+    }
+
+    // Wait for the reply of a registration in progress
+    // Wait for the reply of a registration in progress. A reply arriving
+    // after the timeout is ignored, it would end the next _handleEvents().
+    servus::Servus::Result _waitRegistered(ScopedLock& lock)
+    {
+        _registering = true;
+        if (!hasEventThread())
+        {
+            const servus::Servus::Result result =
+                _handleEvents(lock, ANNOUNCE_TIMEOUT);
+            _registering = false;
+            return result;
+        }
+
+        // registerCB_ is invoked from the event thread
+        const bool replied = _condition.wait_for(
+            lock, std::chrono::milliseconds(ANNOUNCE_TIMEOUT), [this] {
+                return _result != servus::Servus::Result::PENDING;
+            });
+        const servus::Servus::Result registered(
+            replied ? _result : int32_t(kDNSServiceErr_NoError));
+        _result = servus::Servus::Result::PENDING;
+        _registering = false;
+        return registered;
+    }
+
+    void _withdrawAnnouncements()
+    {
+        for (DNSServiceRef ref : _announcements)
+            DNSServiceRefDeallocate(ref);
+        _announcements.clear();
+        _unregistered.clear();
+    }
 
     servus::Servus::Result _browse(const ::servus::Servus::Interface addr)
     {
         assert(!_in);
+        _in = _connection;
         const DNSServiceErrorType error =
-            DNSServiceBrowse(&_in, 0, addr, _name.c_str(), "",
+            DNSServiceBrowse(&_in, kDNSServiceFlagsShareConnection, addr,
+                             _name.c_str(), "",
                              (DNSServiceBrowseReply)_browseCBS, this);
 
         if (error != kDNSServiceErr_NoError)
         {
             WARN << "DNSServiceDiscovery error: " << error << " for " << _name
                  << " on " << addr << std::endl;
-            endBrowsing();
+            _in = 0;
         }
         return servus::Servus::Result(error);
     }
 
     void _updateRecord() final
     {
+        ScopedLock lock(_mutex);
         if (!_out)
             return;
 
         TXTRecordRef record;
-        _createTXTRecord(record);
+        _createTXTRecord(record, _data);
 
         const DNSServiceErrorType error =
             DNSServiceUpdateRecord(_out, 0, 0, TXTRecordGetLength(&record),
@@ -147,10 +328,10 @@ private:
             WARN << "DNSServiceUpdateRecord error: " << error << std::endl;
     }
 
-    void _createTXTRecord(TXTRecordRef& record)
+    void _createTXTRecord(TXTRecordRef& record, const ValueMap& data)
     {
         TXTRecordCreate(&record, 0, 0);
-        for (const auto& i : _data)
+        for (const auto& i : TXTRecord::chunk(data))
         {
             const std::string& key = i.first;
             const std::string& value = i.second;
@@ -160,64 +341,103 @@ private:
         }
     }
 
-    servus::Servus::Result _handleEvents(DNSServiceRef service,
-                                         const int32_t timeout = -1)
+    servus::Servus::Result _processEvents(const int32_t timeout) final
     {
-        assert(service);
-        if (!service)
-            return servus::Servus::Result(kDNSServiceErr_Unknown);
+        ScopedLock lock(_mutex);
+        _expireResolves();
+        if (!hasEventThread())
+            return _handleEvents(lock, timeout);
+
+        // Event thread: wait without holding the lock, so that the API remains
+        // usable from other threads.
+        if (_wait(lock, timeout) < 0)
+        {
+            if (errno == EINTR)
+                return servus::Servus::Result(kDNSServiceErr_NoError);
+            WARN << "Select error: " << strerror(errno) << " (" << errno << ")"
+                 << std::endl;
+            count(Metrics::POLL_ERRORS);
+            return servus::Servus::Result(errno);
+        }
+
+        const DNSServiceErrorType error = _dispatch();
+        if (error != kDNSServiceErr_NoError)
+        {
+            WARN << "DNSServiceProcessResult error: " << error << std::endl;
+            count(Metrics::POLL_ERRORS);
+        }
+        return servus::Servus::Result(error);
+    }
 
-        const int fd = DNSServiceRefSockFD(service);
-        const int nfds = fd + 1;
+#ifndef _MSC_VER
+    // Interrupt the _wait() of this instance, on stopEventThread() or a
+    // register reply dispatched by another thread
+    void _wakeup() final
+    {
+        const char wakeup = 0;
+        // EAGAIN on a full pipe is fine, a wakeup is pending anyway
+        const ssize_t written = ::write(_wakeupPipe[1], &wakeup, 1);
+        (void)written;
+    }
+#endif
 
-        assert(fd >= 0);
-        if (fd < 0)
-            return servus::Servus::Result(kDNSServiceErr_BadParam);
+    // Process the events of the shared connection until _result is set by a
+    // callback, or the timeout expires. Waits without holding the lock, so
+    // that other threads may dispatch the reply, which wakes up the wait.
+    servus::Servus::Result _handleEvents(ScopedLock& lock,
+                                         const int32_t timeout = -1)
+    {
+        typedef std::chrono::steady_clock Clock; // Impl's is private
+        const Clock::time_point end =
+            timeout < 0 ? Clock::time_point::max()
+                        : Clock::now() + std::chrono::milliseconds(timeout);
 
         while (_result == servus::Servus::Result::PENDING)
         {
-            fd_set fdSet;
-            FD_ZERO(&fdSet);
-            FD_SET(fd, &fdSet);
-
-            struct timeval tv;
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-
-            const int result =
-                ::select(nfds, &fdSet, 0, 0, timeout < 0 ? 0 : &tv);
-            switch (result)
+            int32_t remaining = -1;
+            if (timeout >= 0)
             {
-            case 0: // timeout
-                _result = kDNSServiceErr_NoError;
-                break;
+                const Clock::time_point now = Clock::now();
+                remaining = int32_t(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::max(end, now) - now)
+                        .count());
+            }
 
-            case -1: // error
+            const int result = _wait(lock, remaining);
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                    continue;
                 WARN << "Select error: " << strerror(errno) << " (" << errno
                      << ")" << std::endl;
-                if (errno != EINTR)
+                count(Metrics::POLL_ERRORS);
+                withdraw();
+                _result = errno;
+                break;
+            }
+            if (_result != servus::Servus::Result::PENDING)
+                break; // dispatched by another thread while waiting
+
+            if (result > 0)
+            {
+                const DNSServiceErrorType error = _dispatch();
+                if (error != kDNSServiceErr_NoError)
                 {
+                    WARN << "DNSServiceProcessResult error: " << error
+                         << std::endl;
+                    count(Metrics::POLL_ERRORS);
                     withdraw();
-                    _result = errno;
+                    _result = error;
                 }
-                break;
-
-            default:
-                if (FD_ISSET(fd, &fdSet))
+                else if (_isBrowseInterrupted() &&
+                         _result == servus::Servus::Result::PENDING)
                 {
-                    const DNSServiceErrorType error =
-                        DNSServiceProcessResult(service);
-
-                    if (error != kDNSServiceErr_NoError)
-                    {
-                        WARN << "DNSServiceProcessResult error: " << error
-                             << std::endl;
-                        withdraw();
-                        _result = error;
-                    }
+                    _result = kDNSServiceErr_NoError; // waitFor() matched
                 }
-                break;
             }
+            else if (Clock::now() >= end) // timeout
+                _result = kDNSServiceErr_NoError;
         }
 
         const servus::Servus::Result result(_result);
@@ -225,6 +445,57 @@ private:
         return result;
     }
 
+    // Wait at most timeout milliseconds for a message on the shared
+    // connection, or for _wakeup(), with the lock released.
+    // @return the number of ready file descriptors, or -1 on error.
+    int _wait(ScopedLock& lock, const int32_t timeout)
+    {
+        const int fd = DNSServiceRefSockFD(_connection);
+        fd_set fdSet;
+        FD_ZERO(&fdSet);
+        FD_SET(fd, &fdSet);
+        int nfds = fd + 1;
+#ifndef _MSC_VER
+        FD_SET(_wakeupPipe[0], &fdSet);
+        nfds = std::max(nfds, _wakeupPipe[0] + 1);
+#endif
+
+        struct timeval tv;
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+
+        lock.unlock();
+        const int result = ::select(nfds, &fdSet, 0, 0, timeout < 0 ? 0 : &tv);
+        const int error = errno;
+        lock.lock();
+
+#ifndef _MSC_VER
+        if (result > 0 && FD_ISSET(_wakeupPipe[0], &fdSet))
+        {
+            char buffer[64];
+            while (::read(_wakeupPipe[0], buffer, sizeof(buffer)) > 0)
+                ;
+        }
+#endif
+        errno = error;
+        return result;
+    }
+
+    // Process one message of the shared connection, if it was not processed
+    // by another thread since _wait() returned. The lock needs to be held, so
+    // that DNSServiceProcessResult() does not block on an empty socket.
+    DNSServiceErrorType _dispatch()
+    {
+        const int fd = DNSServiceRefSockFD(_connection);
+        fd_set fdSet;
+        FD_ZERO(&fdSet);
+        FD_SET(fd, &fdSet);
+        struct timeval tv = {0, 0};
+        if (::select(fd + 1, &fdSet, 0, 0, &tv) <= 0)
+            return kDNSServiceErr_NoError;
+        return DNSServiceProcessResult(_connection);
+    }
+
     static void registerCBS_(DNSServiceRef, DNSServiceFlags,
                              DNSServiceErrorType error, const char* name,
                              const char* type, const char* domain,
@@ -240,12 +511,45 @@ private:
         //    LBINFO << "Registered " << name << "." << type << "." << domain
         //              << std::endl;
 
+        const bool async = _completeAnnounce(error);
         if (error != kDNSServiceErr_NoError)
         {
             WARN << "Register callback error: " << error << std::endl;
             withdraw();
         }
+        if (async || !_registering) // nobody waits for the result
+            return;
         _result = error;
+        _condition.notify_all();
+        _wakeup(); // may be dispatched by another thread, see _handleEvents()
+    }
+
+    static void _announcementCBS(DNSServiceRef ref, DNSServiceFlags,
+                                 DNSServiceErrorType error, const char*,
+                                 const char*, const char*, Servus* servus)
+    {
+        servus->_announcementCB(ref, error);
+    }
+
+    void _announcementCB(DNSServiceRef ref, const DNSServiceErrorType error)
+    {
+        if (_unregistered.erase(ref) == 0)
+            return;
+
+        if (error != kDNSServiceErr_NoError)
+        {
+            WARN << "Register callback error: " << error << std::endl;
+            if (_announcementsResult == kDNSServiceErr_NoError)
+                _announcementsResult = error;
+            _announcements.erase(ref);
+            DNSServiceRefDeallocate(ref);
+        }
+
+        if (!_unregistered.empty() || !_registering)
+            return;
+        _result = _announcementsResult;
+        _condition.notify_all();
+        _wakeup();
     }
 
     static void _browseCBS(DNSServiceRef, DNSServiceFlags flags,
@@ -265,49 +569,209 @@ private:
             WARN << "Browse callback error: " << error << std::endl;
             return;
         }
+        _allForNow = !(flags & kDNSServiceFlagsMoreComing);
 
         if (flags & kDNSServiceFlagsAdd)
         {
-            _browsedName = name;
+            // The instance may be reported on multiple interfaces
+            if (_isResolving(name))
+                return;
 
-            DNSServiceRef service = 0;
-            const DNSServiceErrorType resolve =
-                DNSServiceResolve(&service, 0, interfaceIdx, name, type, domain,
-                                  (DNSServiceResolveReply)resolveCBS_, this);
-            if (resolve != kDNSServiceErr_NoError)
-                WARN << "DNSServiceResolve error: " << resolve << std::endl;
+            _pendingResolves.push_back({name, type, domain, interfaceIdx, {}});
+            _startResolves();
+        }
+        else // dns_sd.h: callback with the Add flag NOT set indicates a Remove
+        {
+            _pendingResolves.erase(
+                std::remove_if(_pendingResolves.begin(),
+                               _pendingResolves.end(),
+                               [name](const Resolve& resolve) {
+                                   return resolve.name == name;
+                               }),
+                _pendingResolves.end());
+            for (auto i = _resolves.begin(); i != _resolves.end(); ++i)
+            {
+                if (i->second.name != name)
+                    continue;
+                DNSServiceRefDeallocate(i->first);
+                _resolves.erase(i);
+                break;
+            }
+            _startResolves();
 
-            if (service)
+            for (auto i = _queries.begin(); i != _queries.end(); ++i)
             {
-                _handleEvents(service, 500);
-                DNSServiceRefDeallocate(service);
+                if (i->second != name)
+                    continue;
+                DNSServiceRefDeallocate(i->first);
+                _queries.erase(i);
+                break;
             }
+            _removeInstance(name);
         }
-        else // dns_sd.h: callback with the Add flag NOT set indicates a Remove
+    }
+
+    // Long-lived query reporting all changes of the instance's TXT record
+    void _monitor(const uint32_t interfaceIdx, const char* name,
+                  const char* type, const char* domain)
+    {
+        for (const auto& i : _queries)
+            if (i.second == name)
+                return;
+
+        char fullName[kDNSServiceMaxDomainName];
+        if (DNSServiceConstructFullName(fullName, name, type, domain) !=
+            kDNSServiceErr_NoError)
+        {
+            return;
+        }
+
+        DNSServiceRef query = _connection;
+        const DNSServiceErrorType error =
+            DNSServiceQueryRecord(&query, kDNSServiceFlagsShareConnection |
+                                              kDNSServiceFlagsLongLivedQuery,
+                                  interfaceIdx, fullName, kDNSServiceType_TXT,
+                                  kDNSServiceClass_IN,
+                                  (DNSServiceQueryRecordReply)queryCBS_, this);
+        if (error == kDNSServiceErr_NoError)
+            _queries[query] = name;
+        else
+            WARN << "DNSServiceQueryRecord error: " << error << std::endl;
+    }
+
+    bool _isResolving(const std::string& name) const
+    {
+        for (const auto& i : _pendingResolves)
+            if (i.name == name)
+                return true;
+        for (const auto& i : _resolves)
+            if (i.second.name == name)
+                return true;
+        return false;
+    }
+
+    bool _isDiscoveryComplete() const final
+    {
+        ScopedLock lock(_mutex);
+        return _in && _allForNow && _pendingResolves.empty() &&
+               _resolves.empty();
+    }
+
+    // Issue queued resolves on the shared connection, up to _maxResolves
+    void _startResolves()
+    {
+        while (_resolves.size() < _maxResolves && !_pendingResolves.empty())
         {
-            _instanceMap.erase(name);
-            for (Listener* listener : _listeners)
-                listener->instanceRemoved(name);
+            Resolve resolve = std::move(_pendingResolves.front());
+            _pendingResolves.pop_front();
+
+            DNSServiceRef service = _connection;
+            const DNSServiceErrorType error =
+                DNSServiceResolve(&service, kDNSServiceFlagsShareConnection,
+                                  resolve.interfaceIdx, resolve.name.c_str(),
+                                  resolve.type.c_str(), resolve.domain.c_str(),
+                                  (DNSServiceResolveReply)resolveCBS_, this);
+            count(Metrics::RESOLVES_STARTED);
+            if (error != kDNSServiceErr_NoError)
+            {
+                WARN << "DNSServiceResolve error: " << error << std::endl;
+                count(Metrics::RESOLVES_FAILED);
+                continue;
+            }
+            resolve.started = std::chrono::steady_clock::now();
+            _resolves[service] = std::move(resolve);
         }
     }
 
-    static void resolveCBS_(DNSServiceRef, DNSServiceFlags,
+    // Cancel resolves of instances which did not answer in time
+    void _expireResolves()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const size_t nResolves = _resolves.size();
+        for (auto i = _resolves.begin(); i != _resolves.end();)
+        {
+            if (now - i->second.started <
+                std::chrono::milliseconds(RESOLVE_TIMEOUT))
+            {
+                ++i;
+                continue;
+            }
+            WARN << "Timeout resolving " << i->second.name << std::endl;
+            count(Metrics::RESOLVES_FAILED);
+            DNSServiceRefDeallocate(i->first);
+            i = _resolves.erase(i);
+        }
+        if (_resolves.size() != nResolves)
+            _startResolves();
+    }
+
+    static void resolveCBS_(DNSServiceRef service, DNSServiceFlags,
                             uint32_t /*interfaceIdx*/,
                             DNSServiceErrorType error, const char* /*name*/,
                             const char* host, uint16_t /*port*/,
                             uint16_t txtLen, const unsigned char* txt,
                             Servus* servus)
     {
+        servus->resolveCB_(service, error, host, txtLen, txt);
+    }
+
+    void resolveCB_(DNSServiceRef service, const DNSServiceErrorType error,
+                    const char* host, uint16_t txtLen, const unsigned char* txt)
+    {
+        const auto i = _resolves.find(service);
+        if (i == _resolves.end())
+            return;
+
+        const Resolve resolve = std::move(i->second);
+        _resolves.erase(i);
+        DNSServiceRefDeallocate(service); // one result is enough
+
         if (error == kDNSServiceErr_NoError)
-            servus->resolveCB_(host, txtLen, txt);
-        servus->_result = error;
+        {
+            count(Metrics::RESOLVES_COMPLETED);
+            ValueMap values;
+            values["servus_host"] = host;
+            _parseTXTRecord(values, txtLen, txt);
+            _updateInstance(resolve.name, std::move(values));
+            _monitor(resolve.interfaceIdx, resolve.name.c_str(),
+                     resolve.type.c_str(), resolve.domain.c_str());
+        }
+        else
+        {
+            WARN << "Resolve callback error: " << error << std::endl;
+            count(Metrics::RESOLVES_FAILED);
+        }
+        _startResolves();
+    }
+
+    static void queryCBS_(DNSServiceRef query, DNSServiceFlags flags,
+                          uint32_t /*interfaceIdx*/, DNSServiceErrorType error,
+                          const char* /*fullName*/, uint16_t /*rrtype*/,
+                          uint16_t /*rrclass*/, uint16_t rdlen,
+                          const void* rdata, uint32_t /*ttl*/, Servus* servus)
+    {
+        if (error == kDNSServiceErr_NoError && (flags & kDNSServiceFlagsAdd))
+            servus->queryCB_(query, rdlen,
+                             static_cast<const unsigned char*>(rdata));
     }
 
-    void resolveCB_(const char* host, uint16_t txtLen, const unsigned char* txt)
+    void queryCB_(DNSServiceRef query, uint16_t txtLen,
+                  const unsigned char* txt)
     {
-        ValueMap& values = _instanceMap[_browsedName];
-        values["servus_host"] = host;
+        const auto i = _queries.find(query);
+        if (i == _queries.end())
+            return;
 
+        // the TXT record does not carry the host, keep the resolved one
+        ValueMap values;
+        values["servus_host"] = get(i->second, "servus_host");
+        _parseTXTRecord(values, txtLen, txt);
+        _updateInstance(i->second, std::move(values));
+    }
+
+    static void _parseTXTRecord(ValueMap& values, const uint16_t txtLen,
+                                const unsigned char* txt)
+    {
         char key[256] = {0};
         const char* value = 0;
         uint8_t valueLen = 0;
@@ -320,8 +784,6 @@ private:
             values[key] = std::string(value, valueLen);
             ++i;
         }
-        for (Listener* listener : _listeners)
-            listener->instanceAdded(_browsedName);
     }
 };
 }
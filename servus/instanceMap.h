@@ -0,0 +1,371 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_INSTANCEMAP_H
+#define SERVUS_INSTANCEMAP_H
+
+#include "value.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace servus
+{
+/**
+ * Compact, immutable storage of the discovered instances.
+ *
+ * Instances are kept in a contiguous vector indexed by an open-addressed hash
+ * table, and sorted by name on the first iteration. Each instance stores its
+ * key/value pairs in one sorted vector, with keys interned in a table shared
+ * by the versions of the map, since all instances of a service announce the
+ * same keys. The table is rebuilt from the current instances once it has
+ * grown to twice the keys in use. Typed values are decoded once when the
+ * instance is created, announced Serializable objects on first use.
+ *
+ * Instances are immutable and shared between the versions of the map. A new
+ * version is a clone of the previous one, modified in place by all changes of
+ * one event processing iteration before it is published.
+ */
+class InstanceMap
+{
+public:
+    struct Entry
+    {
+        const std::string* key; //!< interned
+        std::string value;
+        Value typed; //!< decoded value
+    };
+    typedef std::vector<Entry> Entries;
+
+    /**
+     * The interned keys of the instances of a map and its clones. Only
+     * modified by the construction of instances for an unpublished map.
+     */
+    class Keys
+    {
+    public:
+        /** @return the unique copy of the given key in this table. */
+        const std::string* intern(const std::string& key)
+        {
+            return &*_keys.insert(key).first;
+        }
+
+        size_t size() const { return _keys.size(); }
+
+    private:
+        std::unordered_set<std::string> _keys; //!< nodes are never moved
+    };
+    typedef std::shared_ptr<Keys> KeysPtr;
+
+    class Instance
+    {
+    public:
+        /** Deserialized objects of this version of the instance, by key. */
+        struct Objects
+        {
+            std::mutex mutex;
+            std::map<std::string, std::shared_ptr<const Serializable>> map;
+        };
+
+        Instance(const std::string& name_,
+                 std::map<std::string, std::string>&& values,
+                 const KeysPtr& keys)
+            : name(name_)
+            , hash(std::hash<std::string>()(name_))
+            , _keys(keys)
+        {
+            entries.reserve(values.size());
+            for (auto& i : values)
+            {
+                const Value typed = Value::decode(i.second);
+                entries.push_back(
+                    {keys->intern(i.first), std::move(i.second), typed});
+            }
+        }
+
+        /** Copy an instance, with its keys interned in the given table. */
+        Instance(const Instance& from, const KeysPtr& keys)
+            : name(from.name)
+            , hash(from.hash)
+            , entries(from.entries)
+            , _keys(keys)
+        {
+            for (Entry& entry : entries)
+                entry.key = keys->intern(*entry.key);
+        }
+
+        ~Instance() { delete _objects.load(); }
+
+        /** @return the value of the given key, or nullptr. */
+        const std::string* find(const std::string& key) const
+        {
+            const Entry* entry = findEntry(key);
+            return entry ? &entry->value : nullptr;
+        }
+
+        /** @return the entry of the given key, or nullptr. */
+        const Entry* findEntry(const std::string& key) const
+        {
+            const auto i =
+                std::lower_bound(entries.begin(), entries.end(), key,
+                                 [](const Entry& entry, const std::string& k) {
+                                     return *entry.key < k;
+                                 });
+            if (i == entries.end() || *i->key != key)
+                return nullptr;
+            return &*i;
+        }
+
+        /**
+         * @return the deserialized objects, allocated on first use since most
+         *         instances announce none. Thread safe.
+         */
+        Objects& getObjects() const
+        {
+            Objects* objects = _objects.load();
+            if (objects)
+                return *objects;
+
+            std::unique_ptr<Objects> created(new Objects);
+            if (_objects.compare_exchange_strong(objects, created.get()))
+                return *created.release();
+            return *objects; // allocated concurrently
+        }
+
+        const std::string name;
+        const size_t hash;
+        Entries entries; //!< sorted by key
+
+    private:
+        std::shared_ptr<const Keys> _keys; //!< of the entries, kept alive
+        mutable std::atomic<Objects*> _objects{nullptr};
+    };
+    typedef std::map<std::string, std::map<std::string, std::string> > Data;
+    typedef std::shared_ptr<const Instance> InstancePtr;
+    typedef std::vector<const Instance*> Sorted;
+    typedef Sorted::const_iterator const_iterator;
+
+    InstanceMap()
+        : _keys(std::make_shared<Keys>())
+        , _maxKeys(MIN_MAX_KEYS)
+    {
+    }
+
+    /** Iterate the instances sorted by name, sorted on first use. */
+    const_iterator begin() const { return _getSorted().begin(); }
+    const_iterator end() const { return _getSorted().end(); }
+    size_t size() const { return _instances.size(); }
+    bool empty() const { return _instances.empty(); }
+
+    /** @return the instance of the given name, or nullptr. */
+    const Instance* find(const std::string& name) const
+    {
+        const size_t slot = _findSlot(name);
+        return slot == NONE ? nullptr : _instances[_index[slot] - 1].get();
+    }
+
+    /** @return all data as nested maps, created on first use. Thread safe. */
+    std::shared_ptr<const Data> getData() const
+    {
+        std::call_once(_dataOnce, [this] {
+            std::shared_ptr<Data> data = std::make_shared<Data>();
+            for (const Instance* instance : *this)
+            {
+                std::map<std::string, std::string>& values =
+                    (*data)[instance->name];
+                for (const Entry& entry : instance->entries)
+                    values.emplace_hint(values.end(), *entry.key, entry.value);
+            }
+            _data = data;
+        });
+        return _data;
+    }
+
+    /**
+     * @return a copy of this map to be modified by set() and erase() before
+     *         it is published.
+     */
+    std::shared_ptr<InstanceMap> clone() const
+    {
+        std::shared_ptr<InstanceMap> map = std::make_shared<InstanceMap>();
+        map->_instances = _instances;
+        map->_index = _index;
+        map->_keys = _keys;
+        map->_maxKeys = _maxKeys;
+        return map;
+    }
+
+    /**
+     * Add or replace the instance of the given name, in amortized constant
+     * time. Only valid on an unpublished map, before iterating it.
+     */
+    void set(const std::string& name,
+             std::map<std::string, std::string>&& values)
+    {
+        _set(std::make_shared<const Instance>(name, std::move(values), _keys));
+        if (_keys->size() > _maxKeys)
+            _compactKeys();
+    }
+
+    /**
+     * Remove the given instance, in constant time. Only valid on an
+     * unpublished map, before iterating it.
+     */
+    void erase(const std::string& name)
+    {
+        const size_t slot = _findSlot(name);
+        if (slot == NONE)
+            return;
+
+        const size_t position = _index[slot] - 1;
+        _eraseSlot(slot);
+
+        // move the last instance into the free position
+        const size_t last = _instances.size() - 1;
+        if (position != last)
+        {
+            _index[_findSlot(_instances[last]->name)] = uint32_t(position + 1);
+            _instances[position] = std::move(_instances[last]);
+        }
+        _instances.pop_back();
+    }
+
+private:
+    typedef std::vector<InstancePtr> Instances;
+    static const size_t NONE = size_t(-1);
+    static const size_t MIN_MAX_KEYS = 256; //!< lower bound of _maxKeys
+
+    Instances _instances;         //!< in insertion order
+    std::vector<uint32_t> _index; //!< position + 1 of _instances, 0 if free
+    KeysPtr _keys;                //!< shared with the previous versions
+    size_t _maxKeys;              //!< of _keys before rebuilding it
+    mutable std::once_flag _sortedOnce;
+    mutable Sorted _sorted;
+    mutable std::once_flag _dataOnce;
+    mutable std::shared_ptr<const Data> _data;
+
+    void _set(InstancePtr instance)
+    {
+        const size_t slot = _findSlot(instance->name);
+        if (slot != NONE)
+        {
+            _instances[_index[slot] - 1] = std::move(instance);
+            return;
+        }
+
+        _instances.push_back(std::move(instance));
+        if (_instances.size() * 2 > _index.size()) // load factor <= 0.5
+            _buildIndex();
+        else
+            _insertSlot(_instances.size() - 1);
+    }
+
+    // Intern the keys of all instances in a new table, the previous one is
+    // released with the versions of the map still using it
+    void _compactKeys()
+    {
+        const KeysPtr keys = std::make_shared<Keys>();
+        for (InstancePtr& instance : _instances)
+            instance = std::make_shared<const Instance>(*instance, keys);
+        _keys = keys;
+        _maxKeys = std::max(size_t(MIN_MAX_KEYS), 2 * keys->size());
+    }
+
+    const Sorted& _getSorted() const
+    {
+        std::call_once(_sortedOnce, [this] {
+            _sorted.reserve(_instances.size());
+            for (const InstancePtr& instance : _instances)
+                _sorted.push_back(instance.get());
+            std::sort(_sorted.begin(), _sorted.end(),
+                      [](const Instance* a, const Instance* b) {
+                          return a->name < b->name;
+                      });
+        });
+        return _sorted;
+    }
+
+    // @return the index slot of the given name, or NONE
+    size_t _findSlot(const std::string& name) const
+    {
+        if (_index.empty())
+            return NONE;
+
+        const size_t hash = std::hash<std::string>()(name);
+        const size_t mask = _index.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask)
+        {
+            const uint32_t position = _index[slot];
+            if (position == 0)
+                return NONE;
+
+            const Instance* instance = _instances[position - 1].get();
+            if (instance->hash == hash && instance->name == name)
+                return slot;
+        }
+    }
+
+    void _insertSlot(const size_t position)
+    {
+        const size_t mask = _index.size() - 1;
+        size_t slot = _instances[position]->hash & mask;
+        while (_index[slot] != 0)
+            slot = (slot + 1) & mask;
+        _index[slot] = uint32_t(position + 1);
+    }
+
+    // Free the slot and shift the following entries of its probe sequence
+    // back, keeping the linear probing invariant without tombstones
+    void _eraseSlot(size_t slot)
+    {
+        const size_t mask = _index.size() - 1;
+        for (size_t next = (slot + 1) & mask; _index[next] != 0;
+             next = (next + 1) & mask)
+        {
+            const size_t home = _instances[_index[next] - 1]->hash & mask;
+            // move next into slot if its home is not within (slot, next]
+            if (((next - home) & mask) >= ((next - slot) & mask))
+            {
+                _index[slot] = _index[next];
+                slot = next;
+            }
+        }
+        _index[slot] = 0;
+    }
+
+    void _buildIndex()
+    {
+        size_t size = 8;
+        while (size < _instances.size() * 2) // load factor <= 0.5
+            size <<= 1;
+        _index.assign(size, 0);
+        for (size_t i = 0; i < _instances.size(); ++i)
+            _insertSlot(i);
+    }
+};
+}
+
+#endif
@@ -20,6 +20,8 @@
 #ifndef SERVUS_LISTENER_H
 #define SERVUS_LISTENER_H
 
+#include <servus/types.h>
+
 namespace servus
 {
 /**
@@ -48,6 +50,54 @@ public:
      * @version 1.2
      */
     virtual void instanceRemoved(const std::string& instance) = 0;
+
+    /**
+     * Called after the announced data of a discovered instance changed.
+     *
+     * Only the modified keys are reported, the new values can be retrieved
+     * using Servus::get().
+     *
+     * @param instance the name of the updated instance.
+     * @param changedKeys the keys which were added or got a new value.
+     * @param removedKeys the keys which are no longer announced.
+     * @version 1.6
+     */
+    virtual void instanceUpdated(const std::string& instance,
+                                 const Strings& changedKeys,
+                                 const Strings& removedKeys)
+    {
+        (void)instance;
+        (void)changedKeys;
+        (void)removedKeys;
+    }
+};
+
+/**
+ * A listener receiving the changes of the discovered instances in batches.
+ *
+ * Instead of one notification per change, a batch listener is notified once
+ * per iteration of the event processing, or once per time window, with all
+ * instances which changed since its last notification. Changes of the same
+ * instance are merged: an instance added and removed again within a batch is
+ * not reported, an instance removed and added again is reported as updated.
+ *
+ * @version 1.6
+ */
+class BatchListener
+{
+public:
+    virtual ~BatchListener() {}
+
+    /**
+     * Called with the instances which changed since the last call.
+     *
+     * @param added the new instances.
+     * @param removed the instances which disappeared.
+     * @param updated the instances with changed announced data.
+     * @version 1.6
+     */
+    virtual void instancesChanged(const Strings& added, const Strings& removed,
+                                  const Strings& updated) = 0;
 };
 }
 
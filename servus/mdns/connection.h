@@ -0,0 +1,421 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "message.h"
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace servus
+{
+namespace mdns
+{
+typedef std::chrono::steady_clock Clock;
+
+static const uint16_t MDNS_PORT = 5353;
+static const char* const MDNS_GROUP = "224.0.0.251";
+static const size_t MAX_MESSAGE_SIZE = 1440; // fits the Ethernet MTU
+
+/**
+ * The process-wide multicast DNS socket.
+ *
+ * All mdns::Servus instances share one UDP socket bound to the mDNS port and
+ * joined to the mDNS group on all multicast-capable IPv4 interfaces. Received
+ * messages are dispatched to all instances, which implement the responder and
+ * querier logic, and serialize all access through one mutex.
+ *
+ * Like avahi::Poll, the socket, a wakeup event and a timer are multiplexed
+ * into one epoll file descriptor. Instances schedule their timers through
+ * schedule(), and run them from dispatch().
+ */
+class Connection
+{
+public:
+    /** Notified about messages and timers, with the mutex locked. */
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+        virtual void messageReceived(const Message& message,
+                                     const sockaddr_in& from, bool local) = 0;
+
+        /** @return the time of the next timer of this listener. */
+        virtual Clock::time_point processTimers(Clock::time_point now) = 0;
+    };
+
+    /** @return the shared connection, created if needed. */
+    static std::shared_ptr<Connection> get()
+    {
+        static std::mutex mutex;
+        static std::weak_ptr<Connection> instance;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Connection> connection = instance.lock();
+        if (!connection)
+        {
+            connection.reset(new Connection);
+            instance = connection;
+        }
+        return connection;
+    }
+
+    ~Connection() { _close(); }
+
+    /** Serializes all calls, except wait() and wakeup(). */
+    std::mutex mutex;
+
+    // mutex needs to be locked for all functions below, unless noted otherwise
+    void addListener(Listener* listener) { _listeners.insert(listener); }
+    void removeListener(Listener* listener) { _listeners.erase(listener); }
+
+    /** @return the pollable file descriptor of all events. Thread safe. */
+    int getFD() const { return _epoll; }
+
+    /** @return the IPv4 addresses of the used interfaces. */
+    const std::vector<uint32_t>& getAddresses() const { return _addresses; }
+
+    /**
+     * Wait at most timeout milliseconds for events, without dispatching them.
+     * Call without the lock held.
+     * @param wakeup an additional file descriptor to wait for, or -1.
+     * @return the number of events, or -1 on error.
+     */
+    int wait(const int timeout, const int wakeup = -1) const
+    {
+        pollfd fds[2] = {{_epoll, POLLIN, 0}, {wakeup, POLLIN, 0}};
+        const int nEvents = ::poll(fds, 2, timeout);
+        if (nEvents < 0 && errno == EINTR)
+            return 0;
+        return nEvents;
+    }
+
+    /** Interrupt the wait() of all instances. Thread safe. */
+    void wakeup()
+    {
+        const uint64_t one = 1;
+        // EAGAIN on counter overflow is fine, a wakeup is pending anyway
+        const ssize_t written = ::write(_wakeup, &one, sizeof(one));
+        (void)written;
+    }
+
+    /** Receive and dispatch all pending messages, then run due timers. */
+    void dispatch()
+    {
+        uint64_t value;
+        while (::read(_wakeup, &value, sizeof(value)) > 0)
+            ;
+        while (::read(_timer, &value, sizeof(value)) > 0)
+            ;
+        _deadline = Clock::time_point::max();
+
+        Message message;
+        sockaddr_in from;
+        while (_receive(message, from))
+        {
+            const bool local = _isLocal(from.sin_addr.s_addr);
+            const std::set<Listener*> listeners = _listeners;
+            for (Listener* listener : listeners)
+                if (_listeners.count(listener))
+                    listener->messageReceived(message, from, local);
+        }
+
+        const Clock::time_point now = Clock::now();
+        Clock::time_point next = Clock::time_point::max();
+        const std::set<Listener*> listeners = _listeners;
+        for (Listener* listener : listeners)
+            if (_listeners.count(listener))
+                next = std::min(next, listener->processTimers(now));
+        schedule(next);
+    }
+
+    /** Make dispatch() run the timers at the given time, at the latest. */
+    void schedule(const Clock::time_point& time)
+    {
+        if (time >= _deadline)
+            return;
+        _deadline = time;
+
+        const Clock::time_point now = Clock::now();
+        const int64_t nanoseconds =
+            time <= now ? 1 : std::chrono::duration_cast<
+                                  std::chrono::nanoseconds>(time - now)
+                                  .count();
+        itimerspec spec;
+        ::memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = time_t(nanoseconds / 1000000000);
+        spec.it_value.tv_nsec = long(nanoseconds % 1000000000);
+        ::timerfd_settime(_timer, 0, &spec, 0);
+    }
+
+    /**
+     * Send a message to the mDNS group on all interfaces, or unicast to the
+     * given address. Messages larger than MAX_MESSAGE_SIZE are split.
+     */
+    void send(const Message& message, const sockaddr_in* to = 0)
+    {
+        const std::string packet = encode(message);
+        if (packet.size() > MAX_MESSAGE_SIZE && message.size() > 1)
+        {
+            Message first;
+            Message second;
+            first.id = second.id = message.id;
+            first.flags = second.flags = message.flags;
+            size_t nFirst = (message.size() + 1) / 2;
+            _split(message.questions, first.questions, second.questions,
+                   nFirst);
+            _split(message.answers, first.answers, second.answers, nFirst);
+            _split(message.authorities, first.authorities, second.authorities,
+                   nFirst);
+            _split(message.additionals, first.additionals, second.additionals,
+                   nFirst);
+            send(first, to);
+            send(second, to);
+            return;
+        }
+
+        if (to)
+        {
+            _send(packet, *to);
+            return;
+        }
+
+        sockaddr_in group;
+        ::memset(&group, 0, sizeof(group));
+        group.sin_family = AF_INET;
+        group.sin_port = htons(MDNS_PORT);
+        group.sin_addr.s_addr = ::inet_addr(MDNS_GROUP);
+        for (const unsigned index : _interfaces)
+        {
+            ip_mreqn request;
+            ::memset(&request, 0, sizeof(request));
+            request.imr_ifindex = int(index);
+            ::setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_IF, &request,
+                         sizeof(request));
+            _send(packet, group);
+        }
+    }
+
+    /**
+     * Claim a name for the given owner within this process.
+     * @return false if the name is owned by another owner.
+     */
+    bool claim(const std::string& name, const void* owner)
+    {
+        const auto i = _names.insert(std::make_pair(toLower(name), owner));
+        return i.first->second == owner;
+    }
+
+    /** Release a name claimed by the given owner. */
+    void release(const std::string& name, const void* owner)
+    {
+        const auto i = _names.find(toLower(name));
+        if (i != _names.end() && i->second == owner)
+            _names.erase(i);
+    }
+
+private:
+    int _socket;
+    int _wakeup;
+    int _timer;
+    int _epoll;
+    std::vector<unsigned> _interfaces; //!< indices of the joined interfaces
+    std::vector<uint32_t> _addresses;  //!< of the joined interfaces
+    Clock::time_point _deadline;       //!< of the armed timer
+    std::set<Listener*> _listeners;
+    std::map<std::string, const void*> _names; //!< claimed, lower case
+
+    Connection()
+        : _socket(::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                           0))
+        , _wakeup(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+        , _timer(::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK))
+        , _epoll(::epoll_create1(EPOLL_CLOEXEC))
+        , _deadline(Clock::time_point::max())
+    {
+        try
+        {
+            if (_socket < 0 || _wakeup < 0 || _timer < 0 || _epoll < 0)
+                _throw("Can't setup mDNS socket");
+            _bind();
+            _join();
+            for (const int fd : {_socket, _wakeup, _timer})
+            {
+                epoll_event event;
+                ::memset(&event, 0, sizeof(event));
+                event.events = EPOLLIN;
+                event.data.fd = fd;
+                if (::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+                    _throw("Can't poll mDNS socket");
+            }
+        }
+        catch (...)
+        {
+            _close();
+            throw;
+        }
+    }
+
+    void _close()
+    {
+        for (const int fd : {_socket, _wakeup, _timer, _epoll})
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    void _throw(const std::string& what)
+    {
+        throw std::runtime_error(what + ": " + ::strerror(errno));
+    }
+
+    void _bind()
+    {
+        // other responders on this host, e.g. avahi, share the port
+        const int on = 1;
+        ::setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+        ::setsockopt(_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+        ::setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on));
+        const int ttl = 255; // RFC 6762 11
+        ::setsockopt(_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+        sockaddr_in address;
+        ::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(MDNS_PORT);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (::bind(_socket, (const sockaddr*)&address, sizeof(address)) != 0)
+            _throw("Can't bind mDNS port");
+    }
+
+    // Join the group on all multicast interfaces, or on the loopback interface
+    // if there is none.
+    void _join()
+    {
+        ifaddrs* addresses = 0;
+        if (::getifaddrs(&addresses) != 0)
+            _throw("Can't list network interfaces");
+
+        std::vector<std::pair<unsigned, uint32_t>> multicast;
+        std::vector<std::pair<unsigned, uint32_t>> loopback;
+        for (const ifaddrs* i = addresses; i; i = i->ifa_next)
+        {
+            if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET ||
+                !(i->ifa_flags & IFF_UP))
+            {
+                continue;
+            }
+            const unsigned index = ::if_nametoindex(i->ifa_name);
+            const uint32_t address =
+                ((const sockaddr_in*)i->ifa_addr)->sin_addr.s_addr;
+            if (i->ifa_flags & IFF_MULTICAST)
+                multicast.push_back(std::make_pair(index, address));
+            else if (i->ifa_flags & IFF_LOOPBACK)
+                loopback.push_back(std::make_pair(index, address));
+        }
+        ::freeifaddrs(addresses);
+
+        for (const auto& i : multicast.empty() ? loopback : multicast)
+        {
+            ip_mreqn request;
+            ::memset(&request, 0, sizeof(request));
+            request.imr_multiaddr.s_addr = ::inet_addr(MDNS_GROUP);
+            request.imr_ifindex = int(i.first);
+            if (::setsockopt(_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request,
+                             sizeof(request)) != 0 &&
+                errno != EADDRINUSE)
+            {
+                continue;
+            }
+            if (std::find(_interfaces.begin(), _interfaces.end(), i.first) ==
+                _interfaces.end())
+            {
+                _interfaces.push_back(i.first);
+            }
+            _addresses.push_back(i.second);
+        }
+        if (_interfaces.empty())
+            _throw("Can't join mDNS group on any interface");
+    }
+
+    bool _isLocal(const uint32_t address) const
+    {
+        return (ntohl(address) >> 24) == 127 ||
+               std::find(_addresses.begin(), _addresses.end(), address) !=
+                   _addresses.end();
+    }
+
+    bool _receive(Message& message, sockaddr_in& from)
+    {
+        uint8_t buffer[9000]; // RFC 6762 17: maximum message size
+        for (;;)
+        {
+            socklen_t length = sizeof(from);
+            const ssize_t size = ::recvfrom(_socket, buffer, sizeof(buffer), 0,
+                                            (sockaddr*)&from, &length);
+            if (size < 0)
+                return false;
+
+            message = Message();
+            // RFC 6762 18: ignore messages with an opcode or response code
+            if (decode(buffer, size_t(size), message) &&
+                (message.flags & 0x780F) == 0)
+            {
+                return true;
+            }
+        }
+    }
+
+    void _send(const std::string& packet, const sockaddr_in& to)
+    {
+        ::sendto(_socket, packet.data(), packet.size(), MSG_NOSIGNAL,
+                 (const sockaddr*)&to, sizeof(to));
+    }
+
+    // move the first nFirst items to first, the remaining ones to second
+    template <class T>
+    static void _split(const std::vector<T>& in, std::vector<T>& first,
+                       std::vector<T>& second, size_t& nFirst)
+    {
+        const size_t n = std::min(nFirst, in.size());
+        first.assign(in.begin(), in.begin() + n);
+        second.assign(in.begin() + n, in.end());
+        nFirst -= n;
+    }
+};
+}
+}
@@ -0,0 +1,493 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_MDNS_MESSAGE_H
+#define SERVUS_MDNS_MESSAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace servus
+{
+namespace mdns
+{
+/** DNS resource record types used by DNS-SD. */
+enum Type
+{
+    TYPE_A = 1,
+    TYPE_PTR = 12,
+    TYPE_TXT = 16,
+    TYPE_SRV = 33,
+    TYPE_ANY = 255
+};
+
+static const uint16_t CLASS_IN = 1;
+static const uint16_t CLASS_FLAG = 0x8000; //!< cache flush or unicast reply
+static const uint16_t FLAG_RESPONSE = 0x8000;
+static const uint16_t FLAG_AUTHORITATIVE = 0x0400;
+
+/**
+ * @return the lower case version of the given domain name, for comparisons.
+ *         DNS names are case-insensitive for ASCII letters only.
+ */
+inline std::string toLower(std::string name)
+{
+    for (char& c : name)
+        if (c >= 'A' && c <= 'Z')
+            c = char(c - 'A' + 'a');
+    return name;
+}
+
+/** @return the label in presentation format, escaping dots and backslashes */
+inline std::string escapeLabel(const std::string& label)
+{
+    std::string escaped;
+    escaped.reserve(label.size());
+    for (const char c : label)
+    {
+        if (c == '.' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+/** @return the unescaped labels of a name in presentation format. */
+inline std::vector<std::string> splitName(const std::string& name)
+{
+    std::vector<std::string> labels(1);
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        if (name[i] == '\\' && i + 1 < name.size())
+            labels.back() += name[++i];
+        else if (name[i] == '.')
+            labels.push_back(std::string());
+        else
+            labels.back() += name[i];
+    }
+    if (labels.back().empty())
+        labels.pop_back();
+    return labels;
+}
+
+struct Question
+{
+    std::string name; //!< in presentation format, without trailing dot
+    uint16_t type;
+    bool unicast; //!< QU question, the response is sent unicast
+};
+
+struct Record
+{
+    std::string name; //!< in presentation format, without trailing dot
+    uint16_t type;
+    bool cacheFlush; //!< unique record, replaces all cached older data
+    uint32_t ttl;    //!< in seconds, zero for a goodbye
+
+    std::string target; //!< PTR, SRV
+    uint16_t port;      //!< SRV
+    uint32_t address;   //!< A, in network byte order
+    std::vector<std::string> txt; //!< TXT strings
+    std::string data;             //!< raw data of other types
+
+    Record()
+        : type(0)
+        , cacheFlush(false)
+        , ttl(0)
+        , port(0)
+        , address(0)
+    {
+    }
+
+    Record(const std::string& name_, const uint16_t type_, const uint32_t ttl_,
+           const bool cacheFlush_)
+        : name(name_)
+        , type(type_)
+        , cacheFlush(cacheFlush_)
+        , ttl(ttl_)
+        , port(0)
+        , address(0)
+    {
+    }
+
+    /** @return true if both records have the same name, type and data. */
+    bool isSame(const Record& rhs) const
+    {
+        return type == rhs.type && toLower(name) == toLower(rhs.name) &&
+               hasSameData(rhs);
+    }
+
+    /** @return true if both records have the same data. */
+    bool hasSameData(const Record& rhs) const
+    {
+        switch (type)
+        {
+        case TYPE_PTR:
+            return toLower(target) == toLower(rhs.target);
+        case TYPE_SRV:
+            return port == rhs.port && toLower(target) == toLower(rhs.target);
+        case TYPE_TXT:
+            return txt == rhs.txt;
+        case TYPE_A:
+            return address == rhs.address;
+        default:
+            return data == rhs.data;
+        }
+    }
+};
+typedef std::vector<Question> Questions;
+typedef std::vector<Record> Records;
+
+struct Message
+{
+    uint16_t id;
+    uint16_t flags;
+    Questions questions;
+    Records answers;
+    Records authorities;
+    Records additionals;
+
+    Message()
+        : id(0)
+        , flags(0)
+    {
+    }
+
+    bool isResponse() const { return (flags & FLAG_RESPONSE) != 0; }
+    size_t size() const
+    {
+        return questions.size() + answers.size() + authorities.size() +
+               additionals.size();
+    }
+};
+
+namespace detail
+{
+class Writer
+{
+public:
+    void write8(const uint8_t value) { _data += char(value); }
+    void write16(const uint16_t value)
+    {
+        write8(uint8_t(value >> 8));
+        write8(uint8_t(value));
+    }
+    void write32(const uint32_t value)
+    {
+        write16(uint16_t(value >> 16));
+        write16(uint16_t(value));
+    }
+
+    // RFC 1035 4.1.4 message compression of name suffixes
+    void writeName(const std::string& name)
+    {
+        const std::vector<std::string> labels = splitName(name);
+        for (size_t i = 0; i < labels.size(); ++i)
+        {
+            std::string suffix;
+            for (size_t j = i; j < labels.size(); ++j)
+                suffix += toLower(labels[j]) + '\0';
+
+            const auto known = _names.find(suffix);
+            if (known != _names.end())
+            {
+                write16(uint16_t(0xC000 | known->second));
+                return;
+            }
+            if (_data.size() < 0x3FFF)
+                _names[suffix] = uint16_t(_data.size());
+
+            const size_t length = std::min(labels[i].size(), size_t(63));
+            write8(uint8_t(length));
+            _data.append(labels[i], 0, length);
+        }
+        write8(0);
+    }
+
+    void writeQuestion(const Question& question)
+    {
+        writeName(question.name);
+        write16(question.type);
+        write16(CLASS_IN | (question.unicast ? CLASS_FLAG : 0));
+    }
+
+    void writeRecord(const Record& record)
+    {
+        writeName(record.name);
+        write16(record.type);
+        write16(CLASS_IN | (record.cacheFlush ? CLASS_FLAG : 0));
+        write32(record.ttl);
+
+        const size_t lengthPos = _data.size();
+        write16(0);
+        switch (record.type)
+        {
+        case TYPE_PTR:
+            writeName(record.target);
+            break;
+        case TYPE_SRV:
+            write16(0); // priority
+            write16(0); // weight
+            write16(record.port);
+            writeName(record.target);
+            break;
+        case TYPE_TXT:
+            if (record.txt.empty())
+                write8(0); // RFC 6763 6.1: at least one, empty string
+            for (const std::string& string : record.txt)
+            {
+                const size_t length = std::min(string.size(), size_t(255));
+                write8(uint8_t(length));
+                _data.append(string, 0, length);
+            }
+            break;
+        case TYPE_A:
+            _data.append(reinterpret_cast<const char*>(&record.address), 4);
+            break;
+        default:
+            _data += record.data;
+        }
+
+        const size_t length = _data.size() - lengthPos - 2;
+        _data[lengthPos] = char(length >> 8);
+        _data[lengthPos + 1] = char(length);
+    }
+
+    const std::string& getData() const { return _data; }
+private:
+    std::string _data;
+    std::map<std::string, uint16_t> _names; //!< written suffixes, offsets
+};
+
+class Reader
+{
+public:
+    Reader(const uint8_t* data, const size_t size)
+        : _data(data)
+        , _size(size)
+        , _pos(0)
+        , _ok(true)
+    {
+    }
+
+    bool isOK() const { return _ok; }
+    uint8_t read8()
+    {
+        if (_pos + 1 > _size)
+        {
+            _ok = false;
+            return 0;
+        }
+        return _data[_pos++];
+    }
+    uint16_t read16()
+    {
+        const uint16_t high = read8();
+        return uint16_t((high << 8) | read8());
+    }
+    uint32_t read32()
+    {
+        const uint32_t high = read16();
+        return (high << 16) | read16();
+    }
+
+    std::string readString(const size_t size)
+    {
+        if (_pos + size > _size)
+        {
+            _ok = false;
+            return std::string();
+        }
+        const std::string string(reinterpret_cast<const char*>(_data + _pos),
+                                 size);
+        _pos += size;
+        return string;
+    }
+
+    std::string readName()
+    {
+        std::string name;
+        size_t pos = _pos;
+        bool jumped = false;
+        for (size_t nJumps = 0; nJumps < 64;)
+        {
+            if (pos >= _size)
+                break;
+            const uint8_t length = _data[pos];
+            if ((length & 0xC0) == 0xC0) // compression pointer
+            {
+                if (pos + 1 >= _size)
+                    break;
+                if (!jumped)
+                    _pos = pos + 2;
+                jumped = true;
+                ++nJumps;
+                pos = size_t((length & 0x3F) << 8) | _data[pos + 1];
+                continue;
+            }
+            if (length > 63 || pos + 1 + length > _size)
+                break;
+            if (length == 0)
+            {
+                if (!jumped)
+                    _pos = pos + 1;
+                return name;
+            }
+
+            if (!name.empty())
+                name += '.';
+            name += escapeLabel(
+                std::string(reinterpret_cast<const char*>(_data + pos + 1),
+                            length));
+            pos += 1 + length;
+        }
+        _ok = false;
+        return std::string();
+    }
+
+    Question readQuestion()
+    {
+        Question question;
+        question.name = readName();
+        question.type = read16();
+        question.unicast = (read16() & CLASS_FLAG) != 0;
+        return question;
+    }
+
+    Record readRecord()
+    {
+        Record record;
+        record.name = readName();
+        record.type = read16();
+        record.cacheFlush = (read16() & CLASS_FLAG) != 0;
+        record.ttl = read32();
+
+        const size_t length = read16();
+        const size_t end = _pos + length;
+        if (!_ok || end > _size)
+        {
+            _ok = false;
+            return record;
+        }
+
+        switch (record.type)
+        {
+        case TYPE_PTR:
+            record.target = readName();
+            break;
+        case TYPE_SRV:
+            read16(); // priority
+            read16(); // weight
+            record.port = read16();
+            record.target = readName();
+            break;
+        case TYPE_TXT:
+            while (_ok && _pos < end)
+            {
+                const std::string string = readString(read8());
+                if (!string.empty())
+                    record.txt.push_back(string);
+            }
+            break;
+        case TYPE_A:
+            if (length == 4)
+                ::memcpy(&record.address, readString(4).data(), 4);
+            break;
+        default:
+            record.data = readString(length);
+        }
+        if (_pos != end)
+            _ok = false;
+        return record;
+    }
+
+private:
+    const uint8_t* const _data;
+    const size_t _size;
+    size_t _pos;
+    bool _ok;
+};
+}
+
+/** @return the wire format of the given message. */
+inline std::string encode(const Message& message)
+{
+    detail::Writer writer;
+    writer.write16(message.id);
+    writer.write16(message.flags);
+    writer.write16(uint16_t(message.questions.size()));
+    writer.write16(uint16_t(message.answers.size()));
+    writer.write16(uint16_t(message.authorities.size()));
+    writer.write16(uint16_t(message.additionals.size()));
+
+    for (const Question& question : message.questions)
+        writer.writeQuestion(question);
+    for (const Record& record : message.answers)
+        writer.writeRecord(record);
+    for (const Record& record : message.authorities)
+        writer.writeRecord(record);
+    for (const Record& record : message.additionals)
+        writer.writeRecord(record);
+    return writer.getData();
+}
+
+/**
+ * Decode a message in wire format.
+ *
+ * @return false if the message is malformed, in which case the message
+ *         contains the records decoded so far.
+ */
+inline bool decode(const uint8_t* data, const size_t size, Message& message)
+{
+    detail::Reader reader(data, size);
+    message.id = reader.read16();
+    message.flags = reader.read16();
+    const size_t nQuestions = reader.read16();
+    const size_t nAnswers = reader.read16();
+    const size_t nAuthorities = reader.read16();
+    const size_t nAdditionals = reader.read16();
+
+    for (size_t i = 0; i < nQuestions && reader.isOK(); ++i)
+    {
+        const Question question = reader.readQuestion();
+        if (reader.isOK())
+            message.questions.push_back(question);
+    }
+
+    Records* const sections[] = {&message.answers, &message.authorities,
+                                 &message.additionals};
+    const size_t sizes[] = {nAnswers, nAuthorities, nAdditionals};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        for (size_t j = 0; j < sizes[i] && reader.isOK(); ++j)
+        {
+            const Record record = reader.readRecord();
+            if (reader.isOK())
+                sections[i]->push_back(record);
+        }
+    }
+    return reader.isOK();
+}
+}
+}
+
+#endif
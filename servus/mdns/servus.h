@@ -0,0 +1,1069 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "connection.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+
+#define WARN std::cerr << __FILE__ << ":" << __LINE__ << ": "
+
+namespace servus
+{
+namespace mdns
+{
+using ScopedLock = std::unique_lock<std::mutex>;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+static const uint32_t HOST_TTL = 120;   // RFC 6762 10: SRV and A records
+static const uint32_t OTHER_TTL = 4500; // RFC 6762 10: PTR and TXT records
+static const uint32_t LEGACY_TTL = 10;  // RFC 6762 6.7
+static const size_t NUM_PROBES = 3;     // RFC 6762 8.1
+static const milliseconds PROBE_INTERVAL(250);
+static const size_t NUM_ANNOUNCEMENTS = 2; // RFC 6762 8.3
+static const seconds ANNOUNCEMENT_INTERVAL(1);
+static const seconds MAX_QUERY_INTERVAL(3600); // RFC 6762 5.2
+static const milliseconds ALL_FOR_NOW_TIME(500); // > max. response delay
+static const milliseconds RESOLVE_TIMEOUT(5000);
+static const char* const SERVICES_NAME = "_services._dns-sd._udp.local";
+
+/**
+ * A native multicast DNS service discovery implementation (RFC 6762/6763).
+ *
+ * Speaks mDNS directly over the shared mdns::Connection socket, without a
+ * daemon. Announced instances are probed for name conflicts, announced, and
+ * answered on queries with known-answer suppression. Browsing uses continuous
+ * queries with exponential back-off, and a per-instance record cache with TTL
+ * expiry, cache refresh queries and goodbye handling. IPv4 only.
+ */
+class Servus : public servus::Servus::Impl, private Connection::Listener
+{
+    typedef mdns::Clock Clock; // not the one of Impl
+
+public:
+    explicit Servus(const std::string& name)
+        : servus::Servus::Impl(name)
+        , _connection(Connection::get())
+        , _mutex(_connection->mutex)
+        , _type(name + ".local")
+        , _typeKey(toLower(_type))
+        , _host(escapeLabel(_getHostLabel()) + ".local")
+        , _wakeupFD(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+        , _result(servus::Servus::Result::PENDING)
+        , _probing(false)
+        , _nProbes(0)
+        , _browsing(false)
+        , _scope(servus::Servus::IF_ALL)
+        , _queryInterval(ANNOUNCEMENT_INTERVAL)
+    {
+        if (_wakeupFD < 0)
+            throw std::runtime_error(std::string("Can't create mDNS wakeup: ") +
+                                     ::strerror(errno));
+        ScopedLock lock(_mutex);
+        _connection->addListener(this);
+    }
+
+    virtual ~Servus()
+    {
+        stopEventThread();
+        withdraw();
+        endBrowsing();
+
+        {
+            ScopedLock lock(_mutex);
+            _connection->removeListener(this);
+        }
+        ::close(_wakeupFD);
+    }
+
+    std::string getClassName() const { return "mdns"; }
+    servus::Servus::Result announce(const unsigned short port,
+                                    const std::string& instance) final
+    {
+        ScopedLock lock(_mutex);
+        _withdraw([](const Service& service) { return service.primary; });
+        const servus::Servus::Result result =
+            _add({_newService(instance, port, _data, true)});
+        return result == servus::Servus::Result::PENDING ? _waitProbed(lock)
+                                                        : result;
+    }
+
+    servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) final
+    {
+        ScopedLock lock(_mutex);
+        _withdraw([](const Service& service) { return !service.primary; });
+
+        std::vector<Service> services;
+        for (const auto& announcement : announcements)
+            services.push_back(_newService(announcement.instance,
+                                           announcement.port,
+                                           announcement.data, false));
+        const servus::Servus::Result result = _add(std::move(services));
+        return result == servus::Servus::Result::PENDING ? _waitProbed(lock)
+                                                        : result;
+    }
+
+    void withdraw() final
+    {
+        ScopedLock lock(_mutex);
+        _completeAnnounce(ECANCELED);
+        _withdraw([](const Service&) { return true; });
+    }
+
+    bool isAnnounced() const final
+    {
+        ScopedLock lock(_mutex);
+        return !_services.empty();
+    }
+
+    servus::Servus::Result beginBrowsing(
+        const ::servus::Servus::Interface addr) final
+    {
+        ScopedLock lock(_mutex);
+        if (_browsing)
+            return servus::Servus::Result(servus::Servus::Result::PENDING);
+
+        _clearInstances();
+        _cache.clear();
+        _discovered.clear();
+        _unresolved.clear();
+        _browsing = true;
+        _scope = addr;
+
+        // RFC 6762 5.2: the first two queries are one second apart, the
+        // interval doubles after each following query
+        const Clock::time_point now = Clock::now();
+        _browseStart = now;
+        _queryInterval = ANNOUNCEMENT_INTERVAL;
+        _sendQuery(now);
+        _nextQuery = now + _queryInterval;
+        _connection->schedule(_nextQuery);
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void endBrowsing() final
+    {
+        ScopedLock lock(_mutex);
+        _browsing = false;
+        _cache.clear();
+        _discovered.clear();
+        _unresolved.clear();
+    }
+
+    bool isBrowsing() const final
+    {
+        ScopedLock lock(_mutex);
+        return _browsing;
+    }
+
+    int getEventFD() final { return _connection->getFD(); }
+private:
+    enum State
+    {
+        STATE_PROBING,
+        STATE_ANNOUNCED
+    };
+
+    struct Service
+    {
+        std::string name; //!< full instance name, instance._service.local
+        unsigned short port;
+        ValueMap data;
+        bool primary; //!< announce(port, instance) or announce(Announcements)
+        State state;
+        size_t nAnnouncements; //!< remaining unsolicited announcements
+    };
+    typedef std::vector<Service> Services;
+
+    struct CachedRecord
+    {
+        Record record;
+        Clock::time_point received;
+        Clock::time_point expires;
+        Clock::time_point refresh; //!< next cache refresh query
+        size_t nRefreshes;
+        bool local;   //!< received from a local address
+        bool goodbye; //!< removed or flushed, kept until it expires
+    };
+    typedef std::vector<CachedRecord> CachedRecords;
+    typedef std::pair<std::string, uint16_t> CacheKey; //!< lower name, type
+
+    struct Resolve
+    {
+        Clock::time_point started;
+        Clock::time_point next; //!< next query for the SRV and TXT records
+        bool failed;            //!< timed out
+    };
+
+    const std::shared_ptr<Connection> _connection;
+    std::mutex& _mutex; //!< of the shared connection
+    std::condition_variable _condition; //!< signaled when probing finishes
+    const std::string _type;    //!< service type, _name._tcp.local
+    const std::string _typeKey; //!< lower case _type
+    const std::string _host;    //!< target of the SRV records, host.local
+    const int _wakeupFD; //!< of this instance, the connection one is shared
+
+    // announce
+    Services _services;
+    int32_t _result;
+    bool _probing;
+    size_t _nProbes;
+    Clock::time_point _nextProbe;
+    Clock::time_point _nextAnnouncement;
+
+    // browse
+    bool _browsing;
+    servus::Servus::Interface _scope;
+    Clock::time_point _browseStart;
+    Clock::time_point _nextQuery;
+    Clock::duration _queryInterval;
+    std::map<CacheKey, CachedRecords> _cache;
+    std::map<std::string, std::string> _discovered; //!< lower name, instance
+    std::map<std::string, Resolve> _unresolved;     //!< lower name
+
+    static std::string _getHostLabel()
+    {
+        const std::string hostname = getHostname();
+        return hostname.substr(0, hostname.find('.'));
+    }
+
+    Service _newService(const std::string& instance, const unsigned short port,
+                        const ValueMap& data, const bool primary) const
+    {
+        const std::string& label = instance.empty() ? getHostname() : instance;
+        return Service{escapeLabel(label) + "." + _type, port, data, primary,
+                       STATE_PROBING, 0};
+    }
+
+    // Claim and start probing the given services. Returns PENDING if probing.
+    servus::Servus::Result _add(Services&& services)
+    {
+        for (size_t i = 0; i < services.size(); ++i)
+        {
+            if (_connection->claim(services[i].name, this))
+                continue;
+
+            WARN << "Instance name " << services[i].name
+                 << " is used by another Servus in this process" << std::endl;
+            for (size_t j = 0; j < i; ++j)
+                _connection->release(services[j].name, this);
+            return servus::Servus::Result(EEXIST);
+        }
+        if (services.empty())
+            return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+
+        for (Service& service : services)
+            _services.push_back(std::move(service));
+
+        // Probe all new services with the same queries
+        const Clock::time_point now = Clock::now();
+        _result = servus::Servus::Result::PENDING;
+        _probing = true;
+        _nProbes = 0;
+        _nextProbe = now;
+        _connection->schedule(now);
+        return servus::Servus::Result(servus::Servus::Result::PENDING);
+    }
+
+    // Wait for the probing started by _add()
+    servus::Servus::Result _waitProbed(ScopedLock& lock)
+    {
+        const Clock::time_point end =
+            Clock::now() + milliseconds(ANNOUNCE_TIMEOUT);
+        while (_result == servus::Servus::Result::PENDING)
+        {
+            const Clock::time_point now = Clock::now();
+            if (now >= end)
+                break;
+
+            if (hasEventThread())
+            {
+                _connection->wakeup();
+                _condition.wait_until(lock, end);
+                continue;
+            }
+
+            lock.unlock();
+            const int nEvents = _connection->wait(int(
+                std::chrono::duration_cast<milliseconds>(end - now).count()));
+            lock.lock();
+            if (nEvents < 0)
+            {
+                count(Metrics::POLL_ERRORS);
+                return servus::Servus::Result(
+                    servus::Servus::Result::POLL_ERROR);
+            }
+            _connection->dispatch();
+        }
+        return servus::Servus::Result(_result);
+    }
+
+    // Withdraw the matching services with goodbye records
+    template <class P>
+    void _withdraw(const P& predicate)
+    {
+        Message goodbye;
+        goodbye.flags = FLAG_RESPONSE | FLAG_AUTHORITATIVE;
+        for (auto i = _services.begin(); i != _services.end();)
+        {
+            if (!predicate(*i))
+            {
+                ++i;
+                continue;
+            }
+            if (i->state == STATE_ANNOUNCED)
+                _addRecords(*i, goodbye.answers, 0);
+            _connection->release(i->name, this);
+            i = _services.erase(i);
+        }
+
+        if (!goodbye.answers.empty())
+            _connection->send(goodbye);
+        if (_probing && !_hasState(STATE_PROBING))
+        {
+            _probing = false;
+            _result = servus::Servus::Result::SUCCESS;
+            _condition.notify_all();
+        }
+    }
+
+    bool _hasState(const State state) const
+    {
+        for (const Service& service : _services)
+            if (service.state == state)
+                return true;
+        return false;
+    }
+
+    servus::Servus::Result _startAnnounce(const unsigned short port,
+                                          const std::string& instance) final
+    {
+        ScopedLock lock(_mutex);
+        _withdraw([](const Service& service) { return service.primary; });
+        const servus::Servus::Result result =
+            _add({_newService(instance, port, _data, true)});
+        if (result == servus::Servus::Result::PENDING)
+        {
+            _beginAnnounce();
+            _connection->wakeup();
+        }
+        return result;
+    }
+
+    void _updateRecord() final
+    {
+        ScopedLock lock(_mutex);
+        for (Service& service : _services)
+        {
+            if (!service.primary)
+                continue;
+
+            service.data = _data;
+            if (service.state != STATE_ANNOUNCED)
+                continue;
+
+            // Announce the new TXT record now, and repeat it once
+            const Clock::time_point now = Clock::now();
+            Message message;
+            message.flags = FLAG_RESPONSE | FLAG_AUTHORITATIVE;
+            message.answers.push_back(_txtRecord(service, OTHER_TTL));
+            _connection->send(message);
+            service.nAnnouncements = NUM_ANNOUNCEMENTS - 1;
+            _nextAnnouncement = now + ANNOUNCEMENT_INTERVAL;
+            _connection->schedule(_nextAnnouncement);
+        }
+    }
+
+    Record _srvRecord(const Service& service, const uint32_t ttl) const
+    {
+        Record record(service.name, TYPE_SRV, ttl, true);
+        record.port = service.port;
+        record.target = _host;
+        return record;
+    }
+
+    Record _txtRecord(const Service& service, const uint32_t ttl) const
+    {
+        Record record(service.name, TYPE_TXT, ttl, true);
+        for (const auto& i : TXTRecord::chunk(service.data))
+        {
+            const std::string entry = i.first + "=" + i.second;
+            record.txt.push_back(entry.substr(0, 255));
+        }
+        return record;
+    }
+
+    Record _ptrRecord(const Service& service, const uint32_t ttl) const
+    {
+        Record record(_type, TYPE_PTR, ttl, false);
+        record.target = service.name;
+        return record;
+    }
+
+    void _addAddressRecords(Records& records) const
+    {
+        for (const uint32_t address : _connection->getAddresses())
+        {
+            Record record(_host, TYPE_A, HOST_TTL, true);
+            record.address = address;
+            _addUnique(records, record);
+        }
+    }
+
+    // All records of a service, with the given TTL factor of 0 or 1
+    void _addRecords(const Service& service, Records& records,
+                     const uint32_t ttl) const
+    {
+        records.push_back(_ptrRecord(service, ttl * OTHER_TTL));
+        records.push_back(_srvRecord(service, ttl * HOST_TTL));
+        records.push_back(_txtRecord(service, ttl * OTHER_TTL));
+    }
+
+    static void _addUnique(Records& records, const Record& record)
+    {
+        for (const Record& existing : records)
+            if (existing.isSame(record))
+                return;
+        records.push_back(record);
+    }
+
+    // Timers, called by Connection::dispatch()
+    Clock::time_point processTimers(const Clock::time_point now) final
+    {
+        Clock::time_point next = Clock::time_point::max();
+        if (_probing)
+        {
+            if (now >= _nextProbe)
+            {
+                if (_nProbes < NUM_PROBES)
+                {
+                    _sendProbe();
+                    ++_nProbes;
+                    _nextProbe = now + PROBE_INTERVAL;
+                }
+                else
+                    _probed(now);
+            }
+            if (_probing)
+                next = std::min(next, _nextProbe);
+        }
+
+        if (_hasAnnouncements())
+        {
+            if (now >= _nextAnnouncement)
+                _sendAnnouncements(now);
+            if (_hasAnnouncements())
+                next = std::min(next, _nextAnnouncement);
+        }
+
+        if (_browsing)
+            next = std::min(next, _processBrowseTimers(now));
+        return next;
+    }
+
+    // RFC 6762 8.1: query for the names, with the proposed records in the
+    // authority section
+    void _sendProbe()
+    {
+        Message probe;
+        for (const Service& service : _services)
+        {
+            if (service.state != STATE_PROBING)
+                continue;
+            probe.questions.push_back(
+                Question{service.name, TYPE_ANY, _nProbes == 0});
+            probe.authorities.push_back(_srvRecord(service, HOST_TTL));
+            probe.authorities.push_back(_txtRecord(service, OTHER_TTL));
+        }
+        _connection->send(probe);
+    }
+
+    void _probed(const Clock::time_point now)
+    {
+        for (Service& service : _services)
+        {
+            if (service.state != STATE_PROBING)
+                continue;
+            service.state = STATE_ANNOUNCED;
+            service.nAnnouncements = NUM_ANNOUNCEMENTS;
+        }
+        _probing = false;
+        _nextAnnouncement = now;
+        _sendAnnouncements(now);
+
+        _result = servus::Servus::Result::SUCCESS;
+        _completeAnnounce(_result);
+        _condition.notify_all();
+    }
+
+    bool _hasAnnouncements() const
+    {
+        for (const Service& service : _services)
+            if (service.nAnnouncements > 0)
+                return true;
+        return false;
+    }
+
+    void _sendAnnouncements(const Clock::time_point now)
+    {
+        Message message;
+        message.flags = FLAG_RESPONSE | FLAG_AUTHORITATIVE;
+        for (Service& service : _services)
+        {
+            if (service.nAnnouncements == 0)
+                continue;
+            _addRecords(service, message.answers, 1);
+            --service.nAnnouncements;
+        }
+        if (message.answers.empty())
+            return;
+
+        _addAddressRecords(message.additionals);
+        _connection->send(message);
+        _nextAnnouncement = now + ANNOUNCEMENT_INTERVAL;
+    }
+
+    void messageReceived(const Message& message, const sockaddr_in& from,
+                         const bool local) final
+    {
+        if (!message.isResponse())
+        {
+            _answer(message, from);
+            return;
+        }
+
+        // RFC 6762 6: responses have to come from the mDNS port
+        if (ntohs(from.sin_port) != MDNS_PORT)
+            return;
+
+        if (_probing)
+            _detectConflicts(message);
+        if (_browsing)
+            _cacheRecords(message, local);
+    }
+
+    // Respond to a query with the matching announced records
+    void _answer(const Message& query, const sockaddr_in& from)
+    {
+        const bool legacy = ntohs(from.sin_port) != MDNS_PORT;
+        bool unicast = legacy;
+
+        Message response;
+        response.flags = FLAG_RESPONSE | FLAG_AUTHORITATIVE;
+        for (const Question& question : query.questions)
+        {
+            const size_t nAnswers = response.answers.size();
+            _addAnswers(question, response.answers);
+            if (question.unicast && response.answers.size() > nAnswers)
+                unicast = true;
+        }
+
+        // RFC 6762 7.1: known-answer suppression
+        for (auto i = response.answers.begin(); i != response.answers.end();)
+        {
+            bool known = false;
+            for (const Record& record : query.answers)
+                if (record.isSame(*i) && record.ttl >= i->ttl / 2)
+                    known = true;
+            if (known)
+                i = response.answers.erase(i);
+            else
+                ++i;
+        }
+        if (response.answers.empty())
+            return;
+
+        // RFC 6763 12: additional records for the answers
+        for (const Record& answer : response.answers)
+        {
+            for (const Service& service : _services)
+            {
+                if (service.state != STATE_ANNOUNCED)
+                    continue;
+                const std::string name = toLower(service.name);
+                if (answer.type == TYPE_PTR && toLower(answer.target) == name)
+                {
+                    _addUnique(response.additionals,
+                               _srvRecord(service, HOST_TTL));
+                    _addUnique(response.additionals,
+                               _txtRecord(service, OTHER_TTL));
+                }
+            }
+        }
+        _addAddressRecords(response.additionals);
+        for (auto i = response.additionals.begin();
+             i != response.additionals.end();)
+        {
+            bool answered = false;
+            for (const Record& answer : response.answers)
+                if (answer.isSame(*i))
+                    answered = true;
+            if (answered)
+                i = response.additionals.erase(i);
+            else
+                ++i;
+        }
+
+        if (legacy) // RFC 6762 6.7
+        {
+            response.id = query.id;
+            response.questions = query.questions;
+            for (Records* records : {&response.answers, &response.additionals})
+            {
+                for (Record& record : *records)
+                {
+                    record.ttl = std::min(record.ttl, LEGACY_TTL);
+                    record.cacheFlush = false;
+                }
+            }
+        }
+        _connection->send(response, unicast ? &from : 0);
+    }
+
+    void _addAnswers(const Question& question, Records& answers) const
+    {
+        const std::string name = toLower(question.name);
+        const bool any = question.type == TYPE_ANY;
+        if ((any || question.type == TYPE_PTR) && name == SERVICES_NAME &&
+            _hasState(STATE_ANNOUNCED))
+        {
+            Record record(SERVICES_NAME, TYPE_PTR, OTHER_TTL, false);
+            record.target = _type;
+            _addUnique(answers, record);
+        }
+
+        for (const Service& service : _services)
+        {
+            if (service.state != STATE_ANNOUNCED)
+                continue;
+
+            if ((any || question.type == TYPE_PTR) && name == _typeKey)
+                answers.push_back(_ptrRecord(service, OTHER_TTL));
+            if (name != toLower(service.name))
+                continue;
+            if (any || question.type == TYPE_SRV)
+                answers.push_back(_srvRecord(service, HOST_TTL));
+            if (any || question.type == TYPE_TXT)
+                answers.push_back(_txtRecord(service, OTHER_TTL));
+        }
+
+        if ((any || question.type == TYPE_A) && name == toLower(_host) &&
+            _hasState(STATE_ANNOUNCED))
+        {
+            _addAddressRecords(answers);
+        }
+    }
+
+    // RFC 6762 9: another host responds with different data for a name we
+    // are probing. Only SRV records are compared, since our own TXT records
+    // may be looped back after an update.
+    void _detectConflicts(const Message& message)
+    {
+        for (const Records* records : {&message.answers, &message.additionals})
+        {
+            for (const Record& record : *records)
+            {
+                if (record.type != TYPE_SRV || record.ttl == 0)
+                    continue;
+
+                const std::string name = toLower(record.name);
+                for (const Service& service : _services)
+                {
+                    if (service.state != STATE_PROBING ||
+                        toLower(service.name) != name ||
+                        record.hasSameData(_srvRecord(service, HOST_TTL)))
+                    {
+                        continue;
+                    }
+                    WARN << "Instance name " << service.name
+                         << " is used on the network" << std::endl;
+                    _conflict();
+                    return;
+                }
+            }
+        }
+    }
+
+    // Fail the probing of all new services
+    void _conflict()
+    {
+        for (auto i = _services.begin(); i != _services.end();)
+        {
+            if (i->state != STATE_PROBING)
+            {
+                ++i;
+                continue;
+            }
+            _connection->release(i->name, this);
+            i = _services.erase(i);
+        }
+        _probing = false;
+        _result = EEXIST;
+        _completeAnnounce(_result);
+        _condition.notify_all();
+    }
+
+    // Browsing
+    void _sendQuery(const Clock::time_point now)
+    {
+        Message query;
+        query.questions.push_back(Question{_type, TYPE_PTR, false});
+
+        // RFC 6762 7.1: known answers with more than half their TTL left
+        const auto i = _cache.find(CacheKey(_typeKey, TYPE_PTR));
+        if (i != _cache.end())
+        {
+            for (const CachedRecord& cached : i->second)
+            {
+                if (cached.goodbye)
+                    continue;
+                const auto left =
+                    std::chrono::duration_cast<seconds>(cached.expires - now);
+                if (left.count() <= 0 || uint32_t(left.count()) <
+                                             cached.record.ttl / 2)
+                {
+                    continue;
+                }
+                Record known = cached.record;
+                known.ttl = uint32_t(left.count());
+                query.answers.push_back(known);
+            }
+        }
+        _connection->send(query);
+    }
+
+    bool _isInstanceName(const std::string& name) const
+    {
+        return name.size() > _typeKey.size() + 1 &&
+               name.compare(name.size() - _typeKey.size(), _typeKey.size(),
+                            _typeKey) == 0 &&
+               name[name.size() - _typeKey.size() - 1] == '.';
+    }
+
+    void _cacheRecords(const Message& message, const bool local)
+    {
+        const Clock::time_point now = Clock::now();
+        std::set<std::string> changed;
+        for (const Records* records : {&message.answers, &message.additionals})
+        {
+            for (const Record& record : *records)
+            {
+                const std::string name = toLower(record.name);
+                if (record.type == TYPE_PTR && name == _typeKey)
+                    changed.insert(toLower(record.target));
+                else if ((record.type == TYPE_SRV ||
+                          record.type == TYPE_TXT) &&
+                         _isInstanceName(name))
+                {
+                    changed.insert(name);
+                }
+                else
+                    continue;
+
+                _cacheRecord(CacheKey(name, record.type), record, local, now);
+            }
+        }
+
+        for (const std::string& name : changed)
+            _evaluate(name, now);
+    }
+
+    void _cacheRecord(const CacheKey& key, const Record& record,
+                      const bool local, const Clock::time_point now)
+    {
+        CachedRecords& records = _cache[key];
+
+        // RFC 6762 10.2: a unique record replaces all data received more
+        // than one second ago
+        if (record.cacheFlush && record.ttl > 0)
+        {
+            for (CachedRecord& cached : records)
+            {
+                if (cached.received + seconds(1) >= now ||
+                    cached.record.hasSameData(record))
+                {
+                    continue;
+                }
+                cached.goodbye = true;
+                cached.expires = std::min(cached.expires, now + seconds(1));
+            }
+        }
+
+        for (CachedRecord& cached : records)
+        {
+            if (!cached.record.hasSameData(record))
+                continue;
+
+            if (record.ttl == 0) // RFC 6762 10.1: goodbye
+            {
+                cached.goodbye = true;
+                cached.expires = now + seconds(1);
+                return;
+            }
+            cached.record.ttl = record.ttl;
+            cached.received = now;
+            cached.expires = now + seconds(record.ttl);
+            cached.nRefreshes = 0;
+            cached.refresh = _refreshTime(cached);
+            cached.local = cached.local || local;
+            cached.goodbye = false;
+            return;
+        }
+
+        if (record.ttl == 0)
+            return;
+        CachedRecord cached{record, now, now + seconds(record.ttl),
+                            Clock::time_point(), 0, local, false};
+        cached.refresh = _refreshTime(cached);
+        records.push_back(cached);
+        _connection->schedule(cached.refresh);
+    }
+
+    // RFC 6762 5.2: refresh queries at 80%, 85%, 90% and 95% of the TTL
+    static Clock::time_point _refreshTime(const CachedRecord& cached)
+    {
+        if (cached.nRefreshes >= 4)
+            return Clock::time_point::max();
+        const auto ttl = std::chrono::duration_cast<milliseconds>(
+            seconds(cached.record.ttl));
+        return cached.received + ttl * (80 + 5 * cached.nRefreshes) / 100;
+    }
+
+    const CachedRecord* _findNewest(const std::string& name,
+                                    const uint16_t type) const
+    {
+        const auto i = _cache.find(CacheKey(name, type));
+        if (i == _cache.end())
+            return nullptr;
+
+        const CachedRecord* newest = nullptr;
+        for (const CachedRecord& cached : i->second)
+            if (!cached.goodbye &&
+                (!newest || cached.received >= newest->received))
+            {
+                newest = &cached;
+            }
+        return newest;
+    }
+
+    // Publish, update or remove the instance of the given lower case name
+    void _evaluate(const std::string& name, const Clock::time_point now)
+    {
+        const CachedRecord* pointer = nullptr;
+        const auto i = _cache.find(CacheKey(_typeKey, TYPE_PTR));
+        if (i != _cache.end())
+        {
+            for (const CachedRecord& cached : i->second)
+            {
+                if (cached.goodbye || toLower(cached.record.target) != name)
+                    continue;
+                // If browsing the local interface, consider local instances
+                if (_scope == servus::Servus::IF_LOCAL && !cached.local)
+                    continue;
+                pointer = &cached;
+            }
+        }
+
+        if (!pointer)
+        {
+            _unresolved.erase(name);
+            const auto discovered = _discovered.find(name);
+            if (discovered != _discovered.end())
+            {
+                _removeInstance(discovered->second);
+                _discovered.erase(discovered);
+            }
+            return;
+        }
+
+        const CachedRecord* srv = _findNewest(name, TYPE_SRV);
+        const CachedRecord* txt = _findNewest(name, TYPE_TXT);
+        if (!srv || !txt)
+        {
+            if (!_discovered.count(name) && !_unresolved.count(name))
+            {
+                _unresolved[name] = Resolve{now, now, false};
+                count(Metrics::RESOLVES_STARTED);
+                _connection->schedule(now);
+            }
+            return;
+        }
+
+        if (_unresolved.erase(name))
+            count(Metrics::RESOLVES_COMPLETED);
+        ValueMap values;
+        for (const std::string& entry : txt->record.txt)
+        {
+            const size_t pos = entry.find('=');
+            if (pos == std::string::npos)
+                values[entry] = std::string();
+            else
+                values[entry.substr(0, pos)] = entry.substr(pos + 1);
+        }
+        values["servus_host"] = srv->record.target;
+
+        const std::string instance = splitName(pointer->record.target).front();
+        _discovered[name] = instance;
+        _updateInstance(instance, std::move(values));
+    }
+
+    Clock::time_point _processBrowseTimers(const Clock::time_point now)
+    {
+        Message query;
+        if (now >= _nextQuery)
+        {
+            _sendQuery(now);
+            _queryInterval = std::min(Clock::duration(_queryInterval * 2),
+                                      Clock::duration(MAX_QUERY_INTERVAL));
+            _nextQuery = now + _queryInterval;
+        }
+        Clock::time_point next = _nextQuery;
+
+        // expire and refresh cached records
+        std::set<std::string> changed;
+        for (auto i = _cache.begin(); i != _cache.end();)
+        {
+            CachedRecords& records = i->second;
+            for (auto j = records.begin(); j != records.end();)
+            {
+                if (j->expires <= now)
+                {
+                    changed.insert(i->first.second == TYPE_PTR
+                                       ? toLower(j->record.target)
+                                       : i->first.first);
+                    j = records.erase(j);
+                    continue;
+                }
+                if (!j->goodbye && j->refresh <= now)
+                {
+                    _addQuestion(query, i->first.first, j->record.type);
+                    ++j->nRefreshes;
+                    j->refresh = _refreshTime(*j);
+                }
+                next = std::min(next, std::min(j->expires, j->refresh));
+                ++j;
+            }
+            if (records.empty())
+                i = _cache.erase(i);
+            else
+                ++i;
+        }
+
+        // query the records of unresolved instances
+        for (auto& i : _unresolved)
+        {
+            Resolve& resolve = i.second;
+            if (now - resolve.started > RESOLVE_TIMEOUT)
+            {
+                if (!resolve.failed)
+                    count(Metrics::RESOLVES_FAILED);
+                resolve.failed = true;
+                continue;
+            }
+            if (now >= resolve.next)
+            {
+                _addQuestion(query, i.first, TYPE_SRV);
+                _addQuestion(query, i.first, TYPE_TXT);
+                resolve.next = now + ANNOUNCEMENT_INTERVAL;
+            }
+            next = std::min(next, resolve.next);
+        }
+
+        if (!query.questions.empty())
+            _connection->send(query);
+        for (const std::string& name : changed)
+            _evaluate(name, now);
+        return next;
+    }
+
+    static void _addQuestion(Message& query, const std::string& name,
+                             const uint16_t type)
+    {
+        for (const Question& question : query.questions)
+            if (question.type == type && toLower(question.name) == name)
+                return;
+        query.questions.push_back(Question{name, type, false});
+    }
+
+    bool _isDiscoveryComplete() const final
+    {
+        ScopedLock lock(_mutex);
+        if (!_browsing)
+            return false;
+
+        const Clock::time_point now = Clock::now();
+        if (now < _browseStart + ALL_FOR_NOW_TIME)
+            return false;
+        for (const auto& i : _unresolved)
+            if (now - i.second.started <= RESOLVE_TIMEOUT)
+                return false;
+        return true;
+    }
+
+    servus::Servus::Result _processEvents(const int32_t timeout) final
+    {
+        ScopedLock lock(_mutex);
+        const Clock::time_point end = Clock::now() + milliseconds(timeout);
+        do
+        {
+            const Clock::time_point now = Clock::now();
+            const int remaining =
+                timeout < 0 ? -1 : int(std::chrono::duration_cast<milliseconds>(
+                                           std::max(end, now) - now)
+                                           .count());
+
+            // Do not block other threads while waiting
+            lock.unlock();
+            const int nEvents = _connection->wait(remaining, _wakeupFD);
+            lock.lock();
+            if (nEvents < 0)
+            {
+                count(Metrics::POLL_ERRORS);
+                return servus::Servus::Result(
+                    servus::Servus::Result::POLL_ERROR);
+            }
+            _connection->dispatch();
+
+            // like avahi::Poll, return once woken up
+            uint64_t value;
+            if (::read(_wakeupFD, &value, sizeof(value)) > 0)
+                break;
+        } while (Clock::now() < end && !_isBrowseInterrupted());
+
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    // Not the shared eventfd of the connection, which the dispatch() of any
+    // instance drains
+    void _wakeup() final
+    {
+        const uint64_t one = 1;
+        // EAGAIN on counter overflow is fine, a wakeup is pending anyway
+        const ssize_t written = ::write(_wakeupFD, &one, sizeof(one));
+        (void)written;
+    }
+};
+}
+}
@@ -0,0 +1,158 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_METRICS_H
+#define SERVUS_METRICS_H
+
+#include "servus.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace servus
+{
+/**
+ * Lock-free accumulation of the Servus::Statistics of one Servus, or of the
+ * whole process. Counters are relaxed atomics, a snapshot of the statistics is
+ * not necessarily consistent between counters.
+ */
+class Metrics
+{
+public:
+    enum Counter
+    {
+        RESOLVES_STARTED,
+        RESOLVES_COMPLETED,
+        RESOLVES_FAILED,
+        INSTANCES_ADDED,
+        INSTANCES_REMOVED,
+        INSTANCES_UPDATED,
+        UPDATES_SENT,
+        POLL_ERRORS,
+        EVENTS_DROPPED,
+        NUM_COUNTERS
+    };
+
+    enum Latency
+    {
+        ANNOUNCE_TIME,
+        BROWSE_TIME,
+        LISTENER_TIME,
+        NUM_LATENCIES
+    };
+
+    Metrics()
+    {
+        for (auto& counter : _counters)
+            counter = 0;
+        for (auto& histogram : _histograms)
+        {
+            for (auto& bucket : histogram.buckets)
+                bucket = 0;
+            histogram.count = histogram.total = histogram.max = 0;
+        }
+    }
+
+    /** @return the metrics of all Servus of this process. */
+    static Metrics& getGlobal()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void count(const Counter counter)
+    {
+        _counters[counter].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record(const Latency latency,
+                const std::chrono::steady_clock::duration& time)
+    {
+        const int64_t signedUs =
+            std::chrono::duration_cast<std::chrono::microseconds>(time)
+                .count();
+        const uint64_t us = signedUs > 0 ? uint64_t(signedUs) : 0;
+
+        size_t bucket = 0;
+        while (bucket < Histogram::NUM_BUCKETS - 1 && (us >> bucket) != 0)
+            ++bucket;
+
+        AtomicHistogram& histogram = _histograms[latency];
+        histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        histogram.count.fetch_add(1, std::memory_order_relaxed);
+        histogram.total.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = histogram.max.load(std::memory_order_relaxed);
+        while (us > max &&
+               !histogram.max.compare_exchange_weak(max, us,
+                                                    std::memory_order_relaxed))
+        {
+        }
+    }
+
+    Servus::Statistics get() const
+    {
+        Servus::Statistics statistics;
+        statistics.resolvesStarted = _get(RESOLVES_STARTED);
+        statistics.resolvesCompleted = _get(RESOLVES_COMPLETED);
+        statistics.resolvesFailed = _get(RESOLVES_FAILED);
+        statistics.instancesAdded = _get(INSTANCES_ADDED);
+        statistics.instancesRemoved = _get(INSTANCES_REMOVED);
+        statistics.instancesUpdated = _get(INSTANCES_UPDATED);
+        statistics.updatesSent = _get(UPDATES_SENT);
+        statistics.pollErrors = _get(POLL_ERRORS);
+        statistics.eventsDropped = _get(EVENTS_DROPPED);
+        _get(ANNOUNCE_TIME, statistics.announceTime);
+        _get(BROWSE_TIME, statistics.browseTime);
+        _get(LISTENER_TIME, statistics.listenerTime);
+        return statistics;
+    }
+
+private:
+    typedef Servus::Histogram Histogram;
+
+    struct AtomicHistogram
+    {
+        std::atomic<uint64_t> buckets[Histogram::NUM_BUCKETS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> max;
+    };
+
+    std::atomic<uint64_t> _counters[NUM_COUNTERS];
+    AtomicHistogram _histograms[NUM_LATENCIES];
+
+    uint64_t _get(const Counter counter) const
+    {
+        return _counters[counter].load(std::memory_order_relaxed);
+    }
+
+    void _get(const Latency latency, Histogram& histogram) const
+    {
+        const AtomicHistogram& source = _histograms[latency];
+        for (size_t i = 0; i < Histogram::NUM_BUCKETS; ++i)
+            histogram.buckets[i] =
+                source.buckets[i].load(std::memory_order_relaxed);
+        histogram.count = source.count.load(std::memory_order_relaxed);
+        histogram.total = source.total.load(std::memory_order_relaxed);
+        histogram.max = source.max.load(std::memory_order_relaxed);
+    }
+};
+}
+
+#endif
@@ -35,6 +35,11 @@ public:
         return servus::Servus::Result(servus::Servus::Result::NOT_SUPPORTED);
     }
 
+    servus::Servus::Result announce(const servus::Servus::Announcements&) final
+    {
+        return servus::Servus::Result(servus::Servus::Result::NOT_SUPPORTED);
+    }
+
     void withdraw() final {}
     bool isAnnounced() const final { return false; }
     servus::Servus::Result beginBrowsing(const servus::Servus::Interface) final
@@ -42,14 +47,18 @@ public:
         return servus::Servus::Result(servus::Servus::Result::NOT_SUPPORTED);
     }
 
-    servus::Servus::Result browse(const int32_t) final
+    void endBrowsing() final {}
+    bool isBrowsing() const final { return false; }
+    servus::Servus::Result startEventThread() final
     {
         return servus::Servus::Result(servus::Servus::Result::NOT_SUPPORTED);
     }
 
-    void endBrowsing() final {}
-    bool isBrowsing() const final { return false; }
     void _updateRecord() final {}
+    servus::Servus::Result _processEvents(const int32_t) final
+    {
+        return servus::Servus::Result(servus::Servus::Result::NOT_SUPPORTED);
+    }
 };
 }
 }
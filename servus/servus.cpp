@@ -19,11 +19,24 @@
 
 #include "servus.h"
 
+#include "dispatcher.h"
+#include "instanceMap.h"
 #include "listener.h"
+#include "serializable.h"
+#include "testDriver.h"
+#include "txtRecord.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <map>
-#include <unordered_set>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
 
 // for NI_MAXHOST
 #ifdef _WIN32
@@ -35,16 +48,52 @@
 
 namespace servus
 {
-#define ANNOUNCE_TIMEOUT 1000 /*ms*/
+#define ANNOUNCE_TIMEOUT 1000   /*ms*/
+#define EVENT_LOOP_TIMEOUT 100 /*ms*/
+#define DISCOVER_INTERVAL 10   /*ms*/
 
 namespace
 {
 static const std::string _empty;
 typedef std::map<std::string, std::string> ValueMap;
-typedef std::map<std::string, ValueMap> InstanceMap;
+typedef std::shared_ptr<const InstanceMap> InstanceMapPtr;
 typedef ValueMap::const_iterator ValueMapCIter;
-typedef InstanceMap::const_iterator InstanceMapCIter;
-typedef std::unordered_set<Listener*> Listeners;
+
+// format bytes of announced Serializable objects
+const char OBJECT_BINARY = 'B';
+const char OBJECT_JSON = 'J';
+
+std::string _getObjectKey(const uint128_t& type)
+{
+    return type.getString();
+}
+
+std::string _encodeObject(const Serializable& object,
+                          const servus::Servus::SerializableFormat format)
+{
+    if (format == servus::Servus::FORMAT_JSON)
+        return OBJECT_JSON + object.toJSON();
+
+    const Serializable::Data data = object.toBinary();
+    std::string value(1, OBJECT_BINARY);
+    value.append(static_cast<const char*>(data.ptr.get()), data.size);
+    return value;
+}
+
+bool _decodeObject(const std::string& value, Serializable& object)
+{
+    if (value.empty())
+        return false;
+    switch (value[0])
+    {
+    case OBJECT_BINARY:
+        return object.fromBinary(value.data() + 1, value.size() - 1);
+    case OBJECT_JSON:
+        return object.fromJSON(value.substr(1));
+    default:
+        return false;
+    }
+}
 }
 
 class Servus::Impl
@@ -52,16 +101,72 @@ class Servus::Impl
 public:
     explicit Impl(const std::string& name)
         : _name(name)
+        , _instanceMap(std::make_shared<InstanceMap>())
+        , _eventThreadRunning(false)
+        , _dispatcher(std::make_shared<Dispatcher>(_metrics))
     {
     }
-    virtual ~Impl() {}
+    virtual ~Impl() { _dispatcher->stop(); }
     virtual std::string getClassName() const = 0;
 
     const std::string& getName() const { return _name; }
     void set(const std::string& key, const std::string& value)
     {
-        _data[key] = value;
-        _updateRecord();
+        set(ValueMap{{key, value}});
+    }
+
+    void set(const ValueMap& values)
+    {
+        std::lock_guard<std::mutex> lock(_updateMutex);
+
+        // check the size change of the modified pairs, then update in place
+        // to keep the references returned by get() valid
+        size_t size = _dataSize;
+        for (const auto& i : values)
+        {
+            if (TXTRecord::isChunkKey(i.first))
+                throw std::invalid_argument("Key " + i.first +
+                                            " uses the reserved chunk suffix");
+
+            const size_t newSize = TXTRecord::getSize(i.first, i.second);
+            if (newSize > TXTRecord::MAX_SIZE)
+                _throwTooLarge();
+
+            const ValueMapCIter old = _data.find(i.first);
+            if (old != _data.end())
+                size -= TXTRecord::getSize(old->first, old->second);
+            size += newSize;
+        }
+        if (size > TXTRecord::MAX_SIZE)
+            _throwTooLarge();
+
+        for (const auto& i : values)
+            _data[i.first] = i.second;
+        _dataSize = size;
+        _requestUpdate();
+    }
+
+    void beginUpdate()
+    {
+        std::lock_guard<std::mutex> lock(_updateMutex);
+        ++_updateDepth;
+    }
+
+    void commitUpdate()
+    {
+        std::lock_guard<std::mutex> lock(_updateMutex);
+        if (_updateDepth == 0 || --_updateDepth > 0 || !_updatePending)
+            return;
+
+        // an explicit commit is not debounced
+        _updatePending = false;
+        _sendUpdate();
+    }
+
+    void setUpdateDelay(const uint32_t milliseconds)
+    {
+        std::lock_guard<std::mutex> lock(_updateMutex);
+        _updateDelay = std::chrono::milliseconds(milliseconds);
     }
 
     Strings getKeys() const
@@ -82,97 +187,806 @@ public:
 
     virtual servus::Servus::Result announce(const unsigned short port,
                                             const std::string& instance) = 0;
+
+    std::future<servus::Servus::Result> announceAsync(
+        const unsigned short port, const std::string& instance)
+    {
+        std::promise<servus::Servus::Result> promise;
+        std::future<servus::Servus::Result> future = promise.get_future();
+        {
+            std::lock_guard<std::mutex> lock(_announceMutex);
+            if (_announcePromises.empty())
+                _announceStart = Clock::now();
+            _announcePromises.push_back(std::move(promise));
+        }
+
+        const servus::Servus::Result result = _startAnnounce(port, instance);
+        if (result != servus::Servus::Result::PENDING)
+        {
+            std::lock_guard<std::mutex> lock(_announceMutex);
+            _announced(result);
+        }
+        return future;
+    }
+
+    virtual servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) = 0;
     virtual void withdraw() = 0;
     virtual bool isAnnounced() const = 0;
 
     virtual servus::Servus::Result beginBrowsing(
         const servus::Servus::Interface interface_) = 0;
-    virtual servus::Servus::Result browse(const int32_t timeout) = 0;
+
+    servus::Servus::Result browse(const int32_t timeout)
+    {
+        if (!hasEventThread())
+        {
+            const Clock::time_point start = Clock::now();
+            _flushUpdate();
+            const servus::Servus::Result result(_processChanges(timeout));
+            _dispatcher->flush();
+            _flushUpdate();
+            record(Metrics::BROWSE_TIME, Clock::now() - start);
+            return result;
+        }
+
+        // events are processed by the event thread, only spend the time
+        if (timeout > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
 
     virtual void endBrowsing() = 0;
     virtual bool isBrowsing() const = 0;
 
+    virtual servus::Servus::Result startEventThread()
+    {
+        if (_eventThreadRunning)
+            return servus::Servus::Result(servus::Servus::Result::PENDING);
+        if (_eventThread.joinable()) // previous event loop stopped on error
+            _eventThread.join();
+
+        _eventThreadRunning = true;
+        _eventThread = std::thread([this] { _runEventLoop(); });
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void stopEventThread()
+    {
+        _eventThreadRunning = false;
+        if (!_eventThread.joinable())
+            return;
+
+        _wakeup();
+        _eventThread.join();
+    }
+
+    bool hasEventThread() const { return _eventThreadRunning; }
+
+    virtual int getEventFD() { return -1; }
+    servus::Servus::Result processEvents()
+    {
+        if (hasEventThread())
+            return servus::Servus::Result(servus::Servus::Result::PENDING);
+        _flushUpdate();
+        const servus::Servus::Result result = _processChanges(0);
+        _dispatcher->flush();
+        return result;
+    }
+
     Strings discover(const ::servus::Servus::Interface addr,
-                     const unsigned browseTime)
+                     const unsigned browseTime,
+                     const servus::Servus::DiscoverMode mode)
     {
         const auto& res = beginBrowsing(addr);
         if (res == Servus::Result::SUCCESS || res == Servus::Result::PENDING)
         {
-            browse(browseTime);
+            if (mode == servus::Servus::DISCOVER_ALL_FOR_NOW)
+                _browseUntilComplete(browseTime);
+            else
+                browse(browseTime);
             if (res == Servus::Result::SUCCESS)
                 endBrowsing();
         }
         return getInstances();
     }
 
+    std::string waitFor(const servus::Servus::InstancePredicate& predicate,
+                        const int32_t timeout)
+    {
+        Waiter waiter(predicate);
+        {
+            std::lock_guard<std::mutex> lock(_waitersMutex);
+            _waiters.push_back(&waiter);
+            ++_numWaiters;
+        }
+
+        // Already discovered instances, after registration to not miss any
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        for (const auto& i : *instanceMap)
+        {
+            if (!predicate(i->name))
+                continue;
+
+            std::lock_guard<std::mutex> lock(_waitersMutex);
+            if (!waiter.matched)
+            {
+                waiter.instance = i->name;
+                waiter.matched = true;
+            }
+            break;
+        }
+
+        const auto& res = beginBrowsing(servus::Servus::IF_ALL);
+        const Clock::time_point end =
+            timeout < 0 ? Clock::time_point::max()
+                        : Clock::now() + std::chrono::milliseconds(timeout);
+        if (hasEventThread())
+        {
+            std::unique_lock<std::mutex> lock(_waitersMutex);
+            if (timeout < 0)
+                waiter.condition.wait(lock, [&] { return waiter.matched; });
+            else
+                waiter.condition.wait_until(lock, end,
+                                            [&] { return waiter.matched; });
+        }
+        else if (res == Servus::Result::SUCCESS ||
+                 res == Servus::Result::PENDING)
+        {
+            while (!_isMatched(waiter))
+            {
+                const Clock::time_point now = Clock::now();
+                if (now >= end)
+                    break;
+
+                int32_t remaining = -1;
+                if (timeout >= 0)
+                    remaining = int32_t(std::chrono::duration_cast<
+                                            std::chrono::milliseconds>(end - now)
+                                            .count()) +
+                                1; // round up
+                if (!browse(remaining))
+                    break;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_waitersMutex);
+            _waiters.erase(
+                std::find(_waiters.begin(), _waiters.end(), &waiter));
+            --_numWaiters;
+            _browseInterrupted = false;
+        }
+        if (res == Servus::Result::SUCCESS)
+            endBrowsing();
+        return waiter.instance;
+    }
+
     Strings getInstances() const
     {
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
         Strings instances;
-        for (auto i : _instanceMap)
-            instances.push_back(i.first);
+        instances.reserve(instanceMap->size());
+        for (const auto& i : *instanceMap)
+            instances.push_back(i->name);
 
         return instances;
     }
 
     Strings getKeys(const std::string& instance) const
     {
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
         Strings keys;
-        InstanceMapCIter i = _instanceMap.find(instance);
-        if (i == _instanceMap.end())
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        if (!i)
             return keys;
 
-        for (auto j : i->second)
-            keys.push_back(j.first);
+        keys.reserve(i->entries.size());
+        for (const auto& j : i->entries)
+            keys.push_back(*j.key);
         return keys;
     }
 
     bool containsKey(const std::string& instance, const std::string& key) const
     {
-        InstanceMapCIter i = _instanceMap.find(instance);
-        if (i == _instanceMap.end())
-            return false;
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        return i && i->find(key);
+    }
 
-        const ValueMap& values = i->second;
-        ValueMapCIter j = values.find(key);
-        if (j == values.end())
-            return false;
-        return true;
+    std::string get(const std::string& instance, const std::string& key) const
+    {
+        // copied, the snapshot may be replaced as soon as it is released
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        const std::string* value = i ? i->find(key) : nullptr;
+        return value ? *value : std::string();
+    }
+
+    bool get(const std::string& instance, Serializable& object) const
+    {
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        const std::string* value =
+            i ? i->find(_getObjectKey(object.getTypeIdentifier())) : nullptr;
+        return value && _decodeObject(*value, object);
     }
 
-    const std::string& get(const std::string& instance,
-                           const std::string& key) const
+    std::shared_ptr<const Serializable> getObject(
+        const std::string& instance, const uint128_t& type,
+        const servus::Servus::ObjectFactory& factory) const
     {
-        InstanceMapCIter i = _instanceMap.find(instance);
-        if (i == _instanceMap.end())
-            return _empty;
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        const std::string key = _getObjectKey(type);
+        const std::string* value = i ? i->find(key) : nullptr;
+        if (!value)
+            return nullptr;
+
+        InstanceMap::Instance::Objects& objects = i->getObjects();
+        std::lock_guard<std::mutex> lock(objects.mutex);
+        const auto cached = objects.map.find(key);
+        if (cached != objects.map.end())
+            return cached->second;
 
-        const ValueMap& values = i->second;
-        ValueMapCIter j = values.find(key);
-        if (j == values.end())
-            return _empty;
-        return j->second;
+        // failures are cached as well, until the instance changes
+        std::shared_ptr<Serializable> object = factory();
+        if (object && !_decodeObject(*value, *object))
+            object.reset();
+        objects.map[key] = object;
+        return object;
+    }
+
+    Value getValue(const std::string& instance, const std::string& key) const
+    {
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        const InstanceMap::Entry* entry = i ? i->findEntry(key) : nullptr;
+        return entry ? entry->typed : Value();
     }
 
     void addListener(Listener* listener)
     {
         if (listener)
-            _listeners.insert(listener);
+            _dispatcher->addListener(listener);
     }
 
     void removeListener(Listener* listener)
     {
         if (listener)
-            _listeners.erase(listener);
+            _dispatcher->removeListener(listener);
+    }
+
+    void addListener(BatchListener* listener, const uint32_t window)
+    {
+        if (listener)
+            _dispatcher->addListener(listener, window);
+    }
+
+    void removeListener(BatchListener* listener)
+    {
+        if (listener)
+            _dispatcher->removeListener(listener);
+    }
+
+    void setDispatch(const servus::Servus::DispatchPolicy policy,
+                     const size_t queueSize,
+                     const servus::Servus::Executor& executor)
+    {
+        _dispatcher->configure(policy, queueSize, executor);
+    }
+
+    void forEachInstance(const servus::Servus::InstanceVisitor& visitor) const
+    {
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        for (const auto& i : *instanceMap)
+            visitor(i->name);
+    }
+
+    bool forEachValue(const std::string& instance,
+                      const servus::Servus::ValueVisitor& visitor) const
+    {
+        const InstanceMapPtr instanceMap = _loadInstanceMap();
+        const InstanceMap::Instance* i = instanceMap->find(instance);
+        if (!i)
+            return false;
+
+        for (const auto& j : i->entries)
+            visitor(*j.key, j.value);
+        return true;
+    }
+
+    std::shared_ptr<const servus::Servus::Data> getData() const
+    {
+        return _loadInstanceMap()->getData();
+    }
+
+    servus::Servus::Statistics getStatistics() const { return _metrics.get(); }
+
+    /** Count an event in the statistics of this object and the process. */
+    void count(const Metrics::Counter counter)
+    {
+        _metrics.count(counter);
+        Metrics::getGlobal().count(counter);
+    }
+
+    /** Record a duration in the statistics of this object and the process. */
+    void record(const Metrics::Latency latency,
+                const std::chrono::steady_clock::duration& time)
+    {
+        _metrics.record(latency, time);
+        Metrics::getGlobal().record(latency, time);
     }
 
-    void getData(servus::Servus::Data& data) const { data = _instanceMap; }
 protected:
     const std::string _name;
-    InstanceMap _instanceMap; //!< last discovered data
-    ValueMap _data;           //!< self data to announce
-    Listeners _listeners;
+    ValueMap _data; //!< self data to announce, see _copyData()
 
+    /**
+     * Announce the modified _data. Called with the lock of _data held, see
+     * _copyData().
+     */
     virtual void _updateRecord() = 0;
+
+    /**
+     * @return a copy of _data, for backends using it outside of announce()
+     *         and _updateRecord(). Not to be called from _updateRecord().
+     */
+    ValueMap _copyData()
+    {
+        std::lock_guard<std::mutex> lock(_updateMutex);
+        return _data;
+    }
+
+    /**
+     * @return the last published snapshot of the discovered data. Snapshots
+     *         are immutable, readers do not need any locking.
+     */
+    InstanceMapPtr _loadInstanceMap() const
+    {
+        return std::atomic_load(&_instanceMap);
+    }
+
+    /** Forget all discovered instances, without notifying the listeners. */
+    void _clearInstances()
+    {
+        std::lock_guard<std::mutex> lock(_changesMutex);
+        _changes.reset();
+        _changeEvents.clear();
+        std::atomic_store(&_instanceMap,
+                          InstanceMapPtr(std::make_shared<InstanceMap>()));
+    }
+
+    /**
+     * Collects all instance changes made during its lifetime into one new
+     * snapshot, published with their listener notifications on destruction
+     * of the outermost batch. Without a batch, each change is published
+     * immediately.
+     */
+    class ChangeBatch
+    {
+    public:
+        explicit ChangeBatch(Impl& impl)
+            : _impl(impl)
+        {
+            std::lock_guard<std::mutex> lock(_impl._changesMutex);
+            ++_impl._changeDepth;
+        }
+
+        ~ChangeBatch()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_impl._changesMutex);
+                if (--_impl._changeDepth > 0)
+                    return;
+            }
+            _impl._commitChanges();
+        }
+
+    private:
+        Impl& _impl;
+        ChangeBatch(const ChangeBatch&) = delete;
+        ChangeBatch& operator=(const ChangeBatch&) = delete;
+    };
+
+    /**
+     * Set the data of a discovered instance and notify the listeners:
+     * instanceAdded() for a new instance, or instanceUpdated() with the
+     * modified keys for a known one.
+     */
+    void _updateInstance(const std::string& instance, ValueMap&& values)
+    {
+        TXTRecord::join(values);
+        std::unique_lock<std::mutex> lock(_changesMutex);
+        InstanceMap& changes = _getChanges();
+        const InstanceMap::Instance* i = changes.find(instance);
+        if (!i)
+        {
+            _setInstance(changes, instance, std::move(values));
+            count(Metrics::INSTANCES_ADDED);
+            _changeEvents.push_back({ChangeEvent::ADDED, instance, {}, {}});
+            _endChange(lock);
+            return;
+        }
+
+        // both are sorted by key, diff them in one pass
+        const InstanceMap::Entries& oldValues = i->entries;
+        Strings changedKeys;
+        Strings removedKeys;
+        InstanceMap::Entries::const_iterator oldValue = oldValues.begin();
+        ValueMapCIter newValue = values.begin();
+        while (oldValue != oldValues.end() || newValue != values.end())
+        {
+            if (newValue == values.end() ||
+                (oldValue != oldValues.end() &&
+                 *oldValue->key < newValue->first))
+            {
+                removedKeys.push_back(*oldValue->key);
+                ++oldValue;
+            }
+            else if (oldValue == oldValues.end() ||
+                     newValue->first < *oldValue->key)
+            {
+                changedKeys.push_back(newValue->first);
+                ++newValue;
+            }
+            else
+            {
+                if (oldValue->value != newValue->second)
+                    changedKeys.push_back(newValue->first);
+                ++oldValue;
+                ++newValue;
+            }
+        }
+
+        if (changedKeys.empty() && removedKeys.empty())
+            return;
+
+        _setInstance(changes, instance, std::move(values));
+        count(Metrics::INSTANCES_UPDATED);
+        _changeEvents.push_back({ChangeEvent::UPDATED, instance,
+                                 std::move(changedKeys),
+                                 std::move(removedKeys)});
+        _endChange(lock);
+    }
+
+    /** Remove a discovered instance and notify the listeners. */
+    void _removeInstance(const std::string& instance)
+    {
+        std::unique_lock<std::mutex> lock(_changesMutex);
+        InstanceMap& changes = _getChanges();
+        if (!changes.find(instance))
+            return;
+
+        changes.erase(instance);
+        count(Metrics::INSTANCES_REMOVED);
+        _changeEvents.push_back({ChangeEvent::REMOVED, instance, {}, {}});
+        _endChange(lock);
+    }
+
+    /**
+     * Wait at most timeout milliseconds for events and dispatch them. Called
+     * by browse(), or continuously by the event thread.
+     */
+    virtual servus::Servus::Result _processEvents(const int32_t timeout) = 0;
+
+    /** Interrupt a _processEvents() running in the event thread. */
+    virtual void _wakeup() {}
+
+    /**
+     * Start an announcement without waiting for its completion.
+     *
+     * @return PENDING if the backend called _beginAnnounce(), or the final
+     *         result. The default implementation performs a blocking
+     *         announce().
+     */
+    virtual servus::Servus::Result _startAnnounce(const unsigned short port,
+                                                  const std::string& instance)
+    {
+        return announce(port, instance);
+    }
+
+    /**
+     * Mark the announcement started by _startAnnounce() as pending, to be
+     * completed by _completeAnnounce() from the event processing.
+     */
+    void _beginAnnounce()
+    {
+        std::lock_guard<std::mutex> lock(_announceMutex);
+        _announcing = true;
+    }
+
+    /**
+     * Complete all pending announceAsync() calls, if an announcement is
+     * pending.
+     * @return true if an announcement was pending.
+     */
+    bool _completeAnnounce(const int32_t result)
+    {
+        std::lock_guard<std::mutex> lock(_announceMutex);
+        if (!_announcing)
+            return false;
+        _announcing = false;
+        _announced(servus::Servus::Result(result));
+        return true;
+    }
+
+    /**
+     * @return true if the browsing has seen all instances currently known to
+     *         the network, and all of them are resolved. Thread safe.
+     */
+    virtual bool _isDiscoveryComplete() const { return false; }
+
+    /**
+     * @return true if a waitFor() was satisfied, in which case the backend
+     *         should return from the current _processEvents() early.
+     */
+    bool _isBrowseInterrupted() const { return _browseInterrupted; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Waiter
+    {
+        explicit Waiter(const servus::Servus::InstancePredicate& predicate_)
+            : predicate(predicate_)
+            , matched(false)
+        {
+        }
+        const servus::Servus::InstancePredicate& predicate;
+        std::string instance;
+        bool matched;
+        std::condition_variable condition;
+    };
+    std::mutex _announceMutex;
+    std::vector<std::promise<servus::Servus::Result>> _announcePromises;
+    Clock::time_point _announceStart; //!< of the first pending promise
+    bool _announcing{false}; //!< see _beginAnnounce()
+
+    struct ChangeEvent
+    {
+        enum Type
+        {
+            ADDED,
+            UPDATED,
+            REMOVED
+        };
+        Type type;
+        std::string instance;
+        Strings changedKeys;
+        Strings removedKeys;
+    };
+
+    std::mutex _waitersMutex;
+    std::vector<Waiter*> _waiters;
+    std::atomic<size_t> _numWaiters{0};
+    std::atomic<bool> _browseInterrupted{false};
+
+    // Coalescing of _updateRecord() calls, see beginUpdate()/setUpdateDelay()
+    std::mutex _updateMutex; //!< also serializes modifications of _data
+    size_t _dataSize{0};     //!< of the TXT record of _data
+    size_t _updateDepth{0};
+    bool _updatePending{false};
+    std::chrono::milliseconds _updateDelay{0};
+    Clock::time_point _updateDue;
+
+    // Read-copy-update: only the browsing path, serialized by the backend,
+    // replaces the snapshot.
+    InstanceMapPtr _instanceMap; //!< last discovered data
+
+    // Changes not yet published, see ChangeBatch
+    std::mutex _changesMutex;
+    size_t _changeDepth{0};
+    std::shared_ptr<InstanceMap> _changes; //!< next snapshot, or nullptr
+    std::vector<ChangeEvent> _changeEvents;
+    std::thread _eventThread;
+    std::atomic<bool> _eventThreadRunning;
+    Metrics _metrics;
+    const std::shared_ptr<Dispatcher> _dispatcher; //!< of the listeners
+
+    static void _throwTooLarge()
+    {
+        throw std::length_error("Announced data exceeds the TXT record size "
+                                "of 65535 bytes");
+    }
+
+    // Complete all pending announceAsync() calls, _announceMutex needs to be
+    // locked
+    void _announced(const servus::Servus::Result& result)
+    {
+        if (result && !_announcePromises.empty())
+            record(Metrics::ANNOUNCE_TIME, Clock::now() - _announceStart);
+        for (auto& promise : _announcePromises)
+            promise.set_value(result);
+        _announcePromises.clear();
+    }
+
+    // _updateMutex needs to be locked
+    void _sendUpdate()
+    {
+        if (isAnnounced())
+            count(Metrics::UPDATES_SENT);
+        _updateRecord();
+    }
+
+    servus::Servus::Result _processChanges(const int32_t timeout)
+    {
+        const ChangeBatch batch(*this);
+        return _processEvents(timeout);
+    }
+
+    // _changesMutex needs to be locked
+    InstanceMap& _getChanges()
+    {
+        if (!_changes)
+            _changes = _loadInstanceMap()->clone();
+        return *_changes;
+    }
+
+    static void _setInstance(InstanceMap& changes, const std::string& instance,
+                             ValueMap&& values)
+    {
+        changes.set(instance, std::move(values));
+    }
+
+    // Publish the change outside of a batch, or right away for a pending
+    // waitFor() to return early from the current _processEvents()
+    void _endChange(std::unique_lock<std::mutex>& lock)
+    {
+        if (_changeDepth > 0 && _numWaiters == 0)
+            return;
+        lock.unlock();
+        _commitChanges();
+    }
+
+    // Publish the pending changes, then notify the listeners and waiters
+    void _commitChanges()
+    {
+        std::vector<ChangeEvent> events;
+        {
+            std::lock_guard<std::mutex> lock(_changesMutex);
+            if (!_changes)
+                return;
+            std::atomic_store(&_instanceMap, InstanceMapPtr(_changes));
+            _changes.reset();
+            events.swap(_changeEvents);
+        }
+
+        for (const ChangeEvent& event : events)
+        {
+            switch (event.type)
+            {
+            case ChangeEvent::ADDED:
+                _dispatcher->instanceAdded(event.instance);
+                _notifyWaiters(event.instance);
+                break;
+            case ChangeEvent::UPDATED:
+                _dispatcher->instanceUpdated(event.instance, event.changedKeys,
+                                             event.removedKeys);
+                _notifyWaiters(event.instance);
+                break;
+            case ChangeEvent::REMOVED:
+                _dispatcher->instanceRemoved(event.instance);
+                break;
+            }
+        }
+    }
+
+    bool _isMatched(const Waiter& waiter)
+    {
+        std::lock_guard<std::mutex> lock(_waitersMutex);
+        return waiter.matched;
+    }
+
+    // Evaluate the pending waitFor() predicates on an added or updated instance
+    void _notifyWaiters(const std::string& instance)
+    {
+        std::lock_guard<std::mutex> lock(_waitersMutex);
+        for (Waiter* waiter : _waiters)
+        {
+            if (waiter->matched || !waiter->predicate(instance))
+                continue;
+
+            waiter->instance = instance;
+            waiter->matched = true;
+            waiter->condition.notify_all();
+            _browseInterrupted = true;
+        }
+    }
+
+    void _browseUntilComplete(const unsigned browseTime)
+    {
+        const Clock::time_point end =
+            Clock::now() + std::chrono::milliseconds(browseTime);
+        while (!_isDiscoveryComplete())
+        {
+            const Clock::time_point now = Clock::now();
+            if (now >= end)
+                return;
+
+            const auto remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(end - now);
+            if (!browse(std::min(int32_t(remaining.count()) + 1,
+                                 int32_t(DISCOVER_INTERVAL))))
+            {
+                return;
+            }
+        }
+    }
+
+    // _updateMutex needs to be locked
+    void _requestUpdate()
+    {
+        if (_updateDepth > 0)
+        {
+            _updatePending = true;
+            return;
+        }
+        if (_updateDelay.count() == 0)
+        {
+            _sendUpdate();
+            return;
+        }
+        if (_updatePending) // coalesce into the scheduled update
+            return;
+
+        _updatePending = true;
+        _updateDue = Clock::now() + _updateDelay;
+        if (hasEventThread())
+            _wakeup(); // adapt the event loop timeout
+    }
+
+    /**
+     * Apply a debounced record update if it is due.
+     * @return the time in milliseconds until the pending update is due, or
+     *         EVENT_LOOP_TIMEOUT if none is pending.
+     */
+    int32_t _flushUpdate()
+    {
+        std::lock_guard<std::mutex> lock(_updateMutex);
+        if (!_updatePending || _updateDepth > 0)
+            return EVENT_LOOP_TIMEOUT;
+
+        const Clock::time_point now = Clock::now();
+        if (now < _updateDue)
+        {
+            const auto remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    _updateDue - now);
+            return int32_t(remaining.count()) + 1; // round up
+        }
+
+        _updatePending = false;
+        _sendUpdate();
+        return EVENT_LOOP_TIMEOUT;
+    }
+
+    void _runEventLoop()
+    {
+        try
+        {
+            while (_eventThreadRunning)
+            {
+                const int32_t timeout =
+                    std::min(int32_t(EVENT_LOOP_TIMEOUT), _flushUpdate());
+                const servus::Servus::Result& result =
+                    _processChanges(timeout);
+                _dispatcher->flush();
+                if (!result)
+                {
+                    std::cerr << "Servus event thread stopped: " << result
+                              << std::endl;
+                    break;
+                }
+            }
+        }
+        catch (const std::exception& error)
+        {
+            std::cerr << "Servus event thread stopped: " << error.what()
+                      << std::endl;
+        }
+        _eventThreadRunning = false;
+    }
 };
 }
 
@@ -182,6 +996,13 @@ protected:
 #elif defined(SERVUS_USE_AVAHI_CLIENT)
 #include "avahi/servus.h"
 #endif
+#ifdef SERVUS_USE_MDNS
+#include "mdns/servus.h"
+#endif
+#ifndef _WIN32
+#include "broker/servus.h"
+#include "shm/servus.h"
+#endif
 #include "none/servus.h"
 #include "test/servus.h"
 
@@ -193,12 +1014,38 @@ std::unique_ptr<Servus::Impl> _chooseImplementation(const std::string& name)
 {
     if (name == TEST_DRIVER)
         return std::unique_ptr<Servus::Impl>(new test::Servus);
+#ifndef _WIN32
+    // Explicitly selected same-host backends never fall back to multicast,
+    // which would publish the data beyond the host
+    try
+    {
+        // SERVUS_BROKER selects the same-host registry broker on its socket
+        if (::getenv("SERVUS_BROKER"))
+            return std::unique_ptr<Servus::Impl>(new broker::Servus(name));
+        // SERVUS_SHM selects the same-host shared memory registry
+        if (::getenv("SERVUS_SHM"))
+            return std::unique_ptr<Servus::Impl>(new shm::Servus(name));
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << "Error starting Servus client: " << error.what()
+                  << std::endl;
+        return std::unique_ptr<Servus::Impl>(new servus::none::Servus(name));
+    }
+#endif
     try
     {
+#ifdef SERVUS_USE_MDNS
+        // SERVUS_MDNS selects the native implementation over the daemon
+        if (::getenv("SERVUS_MDNS"))
+            return std::unique_ptr<Servus::Impl>(new mdns::Servus(name));
+#endif
 #ifdef SERVUS_USE_DNSSD
         return std::unique_ptr<Servus::Impl>(new dnssd::Servus(name));
 #elif defined(SERVUS_USE_AVAHI_CLIENT)
         return std::unique_ptr<Servus::Impl>(new avahi::Servus(name));
+#elif defined(SERVUS_USE_MDNS)
+        return std::unique_ptr<Servus::Impl>(new mdns::Servus(name));
 #endif
         return std::unique_ptr<Servus::Impl>(new none::Servus(name));
     }
@@ -206,9 +1053,61 @@ std::unique_ptr<Servus::Impl> _chooseImplementation(const std::string& name)
     {
         std::cerr << "Error starting Servus client: " << error.what()
                   << std::endl;
-        return std::unique_ptr<Servus::Impl>(new servus::none::Servus(name));
     }
+#ifdef SERVUS_USE_MDNS
+    try
+    {
+        // without a daemon, e.g. in containers
+        return std::unique_ptr<Servus::Impl>(new mdns::Servus(name));
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << "Error starting Servus mDNS: " << error.what()
+                  << std::endl;
+    }
+#endif
+    return std::unique_ptr<Servus::Impl>(new servus::none::Servus(name));
+}
 }
+
+void TestDriver::setConditions(const Conditions& conditions)
+{
+    test::Servus::setConditions(nullptr, conditions);
+}
+
+void TestDriver::setConditions(const Servus& announcer,
+                               const Conditions& conditions)
+{
+    const auto impl = dynamic_cast<const test::Servus*>(announcer._impl.get());
+    if (impl)
+        test::Servus::setConditions(impl, conditions);
+}
+
+void TestDriver::setPartition(const Servus& servus, const unsigned partition)
+{
+    const auto impl = dynamic_cast<const test::Servus*>(servus._impl.get());
+    if (impl)
+        test::Servus::setPartition(*impl, partition);
+}
+
+void TestDriver::setSeed(const uint64_t seed)
+{
+    test::Servus::setSeed(seed);
+}
+
+void TestDriver::setVirtualClock(const bool enable)
+{
+    test::Servus::setVirtualClock(enable);
+}
+
+void TestDriver::advanceClock(const std::chrono::milliseconds time)
+{
+    test::Servus::advanceClock(time);
+}
+
+void TestDriver::reset()
+{
+    test::Servus::reset();
 }
 
 Servus::Servus(const std::string& name)
@@ -222,7 +1121,12 @@ Servus::~Servus()
 
 bool Servus::isAvailable()
 {
-#if defined(SERVUS_USE_DNSSD) || defined(SERVUS_USE_AVAHI_CLIENT)
+#ifndef _WIN32
+    if (::getenv("SERVUS_BROKER") || ::getenv("SERVUS_SHM"))
+        return true;
+#endif
+#if defined(SERVUS_USE_DNSSD) || defined(SERVUS_USE_AVAHI_CLIENT) || \
+    defined(SERVUS_USE_MDNS)
     return true;
 #endif
     return false;
@@ -303,6 +1207,32 @@ void Servus::set(const std::string& key, const std::string& value)
     _impl->set(key, value);
 }
 
+void Servus::set(const std::map<std::string, std::string>& values)
+{
+    _impl->set(values);
+}
+
+void Servus::set(const Serializable& object, const SerializableFormat format)
+{
+    _impl->set(_getObjectKey(object.getTypeIdentifier()),
+               _encodeObject(object, format));
+}
+
+void Servus::beginUpdate()
+{
+    _impl->beginUpdate();
+}
+
+void Servus::commitUpdate()
+{
+    _impl->commitUpdate();
+}
+
+void Servus::setUpdateDelay(const uint32_t milliseconds)
+{
+    _impl->setUpdateDelay(milliseconds);
+}
+
 Strings Servus::getKeys() const
 {
     return _impl->getKeys();
@@ -316,7 +1246,37 @@ const std::string& Servus::get(const std::string& key) const
 Servus::Result Servus::announce(const unsigned short port,
                                 const std::string& instance)
 {
-    return _impl->announce(port, instance);
+    const auto start = std::chrono::steady_clock::now();
+    const Result result = _impl->announce(port, instance);
+    if (result)
+        _impl->record(Metrics::ANNOUNCE_TIME,
+                      std::chrono::steady_clock::now() - start);
+    return result;
+}
+
+std::future<Servus::Result> Servus::announceAsync(const unsigned short port,
+                                                  const std::string& instance)
+{
+    return _impl->announceAsync(port, instance);
+}
+
+Servus::Result Servus::announce(const Announcements& announcements)
+{
+    for (const auto& announcement : announcements)
+    {
+        for (const auto& i : announcement.data)
+            if (TXTRecord::isChunkKey(i.first))
+                return Result(EINVAL);
+        if (TXTRecord::getSize(announcement.data) > TXTRecord::MAX_SIZE)
+            return Result(EMSGSIZE);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const Result result = _impl->announce(announcements);
+    if (result)
+        _impl->record(Metrics::ANNOUNCE_TIME,
+                      std::chrono::steady_clock::now() - start);
+    return result;
 }
 
 void Servus::withdraw()
@@ -331,7 +1291,13 @@ bool Servus::isAnnounced() const
 
 Strings Servus::discover(const Interface addr, const unsigned browseTime)
 {
-    return _impl->discover(addr, browseTime);
+    return _impl->discover(addr, browseTime, DISCOVER_FULL_TIME);
+}
+
+Strings Servus::discover(const Interface addr, const unsigned browseTime,
+                         const DiscoverMode mode)
+{
+    return _impl->discover(addr, browseTime, mode);
 }
 
 Servus::Result Servus::beginBrowsing(const servus::Servus::Interface addr)
@@ -354,6 +1320,37 @@ bool Servus::isBrowsing() const
     return _impl->isBrowsing();
 }
 
+Servus::Result Servus::startEventThread()
+{
+    return _impl->startEventThread();
+}
+
+void Servus::stopEventThread()
+{
+    _impl->stopEventThread();
+}
+
+bool Servus::hasEventThread() const
+{
+    return _impl->hasEventThread();
+}
+
+int Servus::getEventFD() const
+{
+    return _impl->getEventFD();
+}
+
+Servus::Result Servus::processEvents()
+{
+    return _impl->processEvents();
+}
+
+std::string Servus::waitFor(const InstancePredicate& predicate,
+                            const int32_t timeout)
+{
+    return _impl->waitFor(predicate, timeout);
+}
+
 Strings Servus::getInstances() const
 {
     return _impl->getInstances();
@@ -364,7 +1361,7 @@ Strings Servus::getKeys(const std::string& instance) const
     return _impl->getKeys(instance);
 }
 
-const std::string& Servus::getHost(const std::string& instance) const
+std::string Servus::getHost(const std::string& instance) const
 {
     return get(instance, "servus_host");
 }
@@ -375,12 +1372,41 @@ bool Servus::containsKey(const std::string& instance,
     return _impl->containsKey(instance, key);
 }
 
-const std::string& Servus::get(const std::string& instance,
-                               const std::string& key) const
+std::string Servus::get(const std::string& instance,
+                        const std::string& key) const
 {
     return _impl->get(instance, key);
 }
 
+bool Servus::get(const std::string& instance, Serializable& object) const
+{
+    return _impl->get(instance, object);
+}
+
+std::shared_ptr<const Serializable> Servus::getObject(
+    const std::string& instance, const uint128_t& type,
+    const ObjectFactory& factory) const
+{
+    return _impl->getObject(instance, type, factory);
+}
+
+Value Servus::getValue(const std::string& instance,
+                       const std::string& key) const
+{
+    return _impl->getValue(instance, key);
+}
+
+void Servus::forEachInstance(const InstanceVisitor& visitor) const
+{
+    _impl->forEachInstance(visitor);
+}
+
+bool Servus::forEachValue(const std::string& instance,
+                          const ValueVisitor& visitor) const
+{
+    return _impl->forEachValue(instance, visitor);
+}
+
 void Servus::addListener(Listener* listener)
 {
     _impl->addListener(listener);
@@ -391,9 +1417,40 @@ void Servus::removeListener(Listener* listener)
     _impl->removeListener(listener);
 }
 
+void Servus::addListener(BatchListener* listener, const uint32_t window)
+{
+    _impl->addListener(listener, window);
+}
+
+void Servus::removeListener(BatchListener* listener)
+{
+    _impl->removeListener(listener);
+}
+
+void Servus::setDispatch(const DispatchPolicy policy, const size_t queueSize,
+                         const Executor& executor)
+{
+    _impl->setDispatch(policy, queueSize, executor);
+}
+
 void Servus::getData(Data& data)
 {
-    _impl->getData(data);
+    data = *_impl->getData();
+}
+
+std::shared_ptr<const Servus::Data> Servus::getData() const
+{
+    return _impl->getData();
+}
+
+Servus::Statistics Servus::getStatistics() const
+{
+    return _impl->getStatistics();
+}
+
+Servus::Statistics Servus::getGlobalStatistics()
+{
+    return Metrics::getGlobal().get();
 }
 
 std::string getHostname()
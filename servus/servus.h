@@ -23,9 +23,13 @@
 #include <servus/api.h>
 #include <servus/result.h> // nested base class
 #include <servus/types.h>
+#include <servus/value.h> // set<T>(), get<T>()
 
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
+#include <vector>
 
 namespace servus
 {
@@ -54,6 +58,25 @@ public:
         IF_LOCAL = (unsigned)(-1) //!< only local interfaces
     };
 
+    /** Termination criterion of discover(). @version 1.6 */
+    enum DiscoverMode
+    {
+        DISCOVER_FULL_TIME,   //!< browse for the full browse time
+        DISCOVER_ALL_FOR_NOW, //!< return once the known instances are resolved
+    };
+
+    /** Delivery of the listener notifications. @version 1.6 */
+    enum DispatchPolicy
+    {
+        DISPATCH_INLINE,      //!< during the event processing, the default
+        DISPATCH_BLOCK,       //!< queued, the event processing waits if full
+        DISPATCH_DROP_OLDEST, //!< queued, the oldest event is dropped if full
+        DISPATCH_COALESCE     //!< queued, events of an instance merge if full
+    };
+
+    /** Runs a delivery task of queued notifications. @version 1.6 */
+    typedef std::function<void(const std::function<void()>& task)> Executor;
+
     /**
      * The ZeroConf operation result code.
      *
@@ -78,6 +101,47 @@ public:
         static const int32_t POLL_ERROR = -3;
     };
 
+    /** An instance published by announce(const Announcements&). @version 1.6 */
+    struct Announcement
+    {
+        std::string instance; //!< host-unique name, hostname is used if empty
+        unsigned short port;  //!< IP port in host byte order
+        std::map<std::string, std::string> data; //!< announced key/value pairs
+    };
+    typedef std::vector<Announcement> Announcements;
+
+    /**
+     * Distribution of durations in logarithmic buckets: bucket 0 counts the
+     * durations below one microsecond, bucket i those below 2^i microseconds,
+     * and the last bucket all longer durations.
+     * @version 1.6
+     */
+    struct Histogram
+    {
+        static const size_t NUM_BUCKETS = 32;
+        uint64_t buckets[NUM_BUCKETS]; //!< number of durations per bucket
+        uint64_t count;                //!< number of durations
+        uint64_t total;                //!< sum of all durations in us
+        uint64_t max;                  //!< longest duration in us
+    };
+
+    /** Counters and latencies of discovery operations. @version 1.6 */
+    struct Statistics
+    {
+        uint64_t resolvesStarted;   //!< resolves of discovered instances
+        uint64_t resolvesCompleted; //!< resolves which delivered data
+        uint64_t resolvesFailed;    //!< resolves failed or timed out
+        uint64_t instancesAdded;    //!< instanceAdded() notifications
+        uint64_t instancesRemoved;  //!< instanceRemoved() notifications
+        uint64_t instancesUpdated;  //!< instanceUpdated() notifications
+        uint64_t updatesSent;       //!< announced data updates
+        uint64_t pollErrors;        //!< errors from the backend or daemon
+        uint64_t eventsDropped;     //!< by DISPATCH_DROP_OLDEST
+        Histogram announceTime;     //!< from announce to established
+        Histogram browseTime;       //!< wall time of browse()
+        Histogram listenerTime;     //!< time spent in listener callbacks
+    };
+
     /** @return true if a usable implementation is available. */
     SERVUS_API static bool isAvailable();
 
@@ -98,23 +162,121 @@ public:
     /**
      * Set a key/value pair to be announced.
      *
-     * Keys should be at most eight characters, and values are truncated to 255
-     * characters. The total length of all keys and values cannot exceed 65535
-     * characters. Setting a value on an announced service causes an update
-     * which needs some time to propagate after this function returns, that is,
-     * calling discover() immediately afterwards will very likely not contain
-     * the new key/value pair.
+     * Keys should be at most eight characters. Values which do not fit into
+     * one 255 byte TXT record string together with their key are announced in
+     * the numbered chunk keys "key#0", "key#1", ... and joined transparently
+     * by the browsing Servus, keys ending in '#' and a number are therefore
+     * reserved. Setting a value on an announced service causes an update
+     * which needs some time to propagate after this function returns, that
+     * is, calling discover() immediately afterwards will very likely not
+     * contain the new key/value pair.
      *
+     * @throw std::length_error if the announced data would exceed the 65535
+     *        bytes of a TXT record, the data is unchanged in this case.
+     * @throw std::invalid_argument for a reserved key, the data is unchanged
+     *        in this case.
      * @version 1.1
      */
     SERVUS_API void set(const std::string& key, const std::string& value);
 
+    /**
+     * Set multiple key/value pairs to be announced with a single update.
+     *
+     * @sa set(const std::string&, const std::string&)
+     * @throw std::length_error if the announced data would exceed the 65535
+     *        bytes of a TXT record, the data is unchanged in this case.
+     * @throw std::invalid_argument for a reserved key, the data is unchanged
+     *        in this case.
+     * @version 1.6
+     */
+    SERVUS_API void set(const std::map<std::string, std::string>& values);
+
+    /** Representation of announced Serializable objects. @version 1.6 */
+    enum SerializableFormat
+    {
+        FORMAT_BINARY, //!< Serializable::toBinary()
+        FORMAT_JSON    //!< Serializable::toJSON()
+    };
+
+    /**
+     * Announce a Serializable object as the value of the key of its type.
+     *
+     * The key is the string of the type identifier of the object, its value is
+     * a format byte followed by the serialized object, chunked if needed. An
+     * instance announces at most one object of each type.
+     *
+     * @param object the object to announce.
+     * @param format the representation of the object.
+     * @throw std::length_error if the announced data would exceed the 65535
+     *        bytes of a TXT record.
+     * @sa getObject()
+     * @version 1.6
+     */
+    SERVUS_API void set(const Serializable& object,
+                        SerializableFormat format = FORMAT_BINARY);
+
+    /**
+     * Set a typed key/value pair to be announced in a compact binary form.
+     *
+     * Supports arithmetic types and uint128_t, see servus::Value for the
+     * encoding.
+     *
+     * @sa set(const std::string&, const std::string&), get<T>()
+     * @version 1.6
+     */
+    template <class T>
+    typename std::enable_if<Value::isTyped<T>::value>::type set(
+        const std::string& key, const T& value)
+    {
+        set(key, Value(value).encode());
+    }
+
+    /**
+     * Start a batch of set() calls which are announced as a single update.
+     *
+     * Batches can be nested, the update is announced by the outermost
+     * commitUpdate().
+     * @version 1.6
+     */
+    SERVUS_API void beginUpdate();
+
+    /**
+     * Finish a batch of set() calls and announce the changes, if any.
+     * @version 1.6
+     */
+    SERVUS_API void commitUpdate();
+
+    /**
+     * Set the time to delay and coalesce updates caused by set().
+     *
+     * With a non-zero delay, a burst of set() calls results in a single update
+     * announced once the delay has passed since the first call. Delayed
+     * updates are announced by the event thread, browse() or processEvents().
+     * The default delay is zero, announcing each set() immediately.
+     *
+     * @param milliseconds the delay of updates.
+     * @version 1.6
+     */
+    SERVUS_API void setUpdateDelay(uint32_t milliseconds);
+
     /** @return all (to be) announced keys. @version 1.1 */
     SERVUS_API Strings getKeys() const;
 
     /** @return the value to the given (to be) announced key. @version 1.1 */
     SERVUS_API const std::string& get(const std::string& key) const;
 
+    /**
+     * @return the typed value of the given (to be) announced key, or a
+     *         default-constructed T if it is not set or not a number.
+     * @version 1.6
+     */
+    template <class T>
+    typename std::enable_if<Value::isTyped<T>::value, T>::type get(
+        const std::string& key) const
+    {
+        return Value::decode(get(key)).get<T>();
+    }
+
     /**
      * Start announcing the registered key/value pairs.
      *
@@ -126,7 +288,40 @@ public:
     SERVUS_API Result announce(const unsigned short port,
                                const std::string& instance);
 
-    /** Stop announcing the registered key/value pairs. @version 1.1 */
+    /**
+     * Start announcing the registered key/value pairs without blocking.
+     *
+     * The returned future becomes ready once the announcement is established
+     * or has failed. Establishing the announcement needs event processing by
+     * the event thread, browse() or processEvents(); waiting on the future
+     * does not process events.
+     *
+     * @param port the service IP port in host byte order.
+     * @param instance a host-unique instance name, hostname is used if empty.
+     * @return the future success status of the operation.
+     * @version 1.6
+     */
+    SERVUS_API std::future<Result> announceAsync(const unsigned short port,
+                                                 const std::string& instance);
+
+    /**
+     * Announce multiple instances, each with its own port and key/value pairs.
+     *
+     * All instances are published in one batch, through a single entry group
+     * (avahi) or registrations on the shared daemon connection (dnssd), and
+     * replace the instances of a previous call. They are announced in addition
+     * to the instance of announce(port, instance) and do not use the key/value
+     * pairs of set(). withdraw() withdraws all instances.
+     *
+     * @param announcements the instances to announce.
+     * @return the success status of the operation, EMSGSIZE if the key/value
+     *         pairs of an instance exceed the 65535 bytes of a TXT record,
+     *         EINVAL if they use a reserved key, see set().
+     * @version 1.6
+     */
+    SERVUS_API Result announce(const Announcements& announcements);
+
+    /** Stop announcing all instances. @version 1.1 */
     SERVUS_API void withdraw();
 
     /** @return true if the local data is announced. @version 1.1 */
@@ -145,6 +340,25 @@ public:
     SERVUS_API Strings discover(const Interface addr,
                                 const unsigned browseTime);
 
+    /**
+     * Discover all announced key/value pairs, possibly completing early.
+     *
+     * With DISCOVER_ALL_FOR_NOW, the discovery returns as soon as the
+     * implementation reports that its cache is exhausted and all instances
+     * found so far are resolved. The browse time is then an upper bound. If
+     * the implementation cannot detect completion, it behaves like
+     * DISCOVER_FULL_TIME.
+     *
+     * @param addr the scope of the discovery
+     * @param browseTime the maximum time, in milliseconds, to wait for new
+     *                   records.
+     * @param mode the termination criterion of the discovery.
+     * @return all instance names found during discovery.
+     * @version 1.6
+     */
+    SERVUS_API Strings discover(const Interface addr, const unsigned browseTime,
+                                const DiscoverMode mode);
+
     /**
      * Begin the discovery of announced key/value pairs.
      *
@@ -157,6 +371,9 @@ public:
     /**
      * Browse and process discovered key/value pairs.
      *
+     * If an event thread is running, events are processed by it and this
+     * function only waits for the given time.
+     *
      * @param timeout The time to spend browsing.
      * @return the success status of the operation.
      * @version 1.1
@@ -169,6 +386,73 @@ public:
     /** @return true if the local data is browsing. @version 1.1 */
     SERVUS_API bool isBrowsing() const;
 
+    /**
+     * Start a thread processing all events of this service in the background.
+     *
+     * While the event thread is running, discovered instances are updated and
+     * listeners are invoked from the event thread as soon as the events arrive,
+     * without the need to call browse(). The event thread is independent of
+     * the browsing state, that is, beginBrowsing() and endBrowsing() are still
+     * used to control the discovery.
+     *
+     * @return the success status of the operation, PENDING if the event thread
+     *         is already running.
+     * @version 1.6
+     */
+    SERVUS_API Result startEventThread();
+
+    /** Stop the event thread, if running. @version 1.6 */
+    SERVUS_API void stopEventThread();
+
+    /** @return true if an event thread is running. @version 1.6 */
+    SERVUS_API bool hasEventThread() const;
+
+    /**
+     * Get a file descriptor to integrate this service into an external event
+     * loop.
+     *
+     * The file descriptor becomes readable when events are pending, which are
+     * then processed by calling processEvents(). It is owned by the service,
+     * stays valid for its lifetime and must not be read from or closed.
+     *
+     * @return the file descriptor, or -1 if not supported by the
+     *         implementation.
+     * @version 1.6
+     */
+    SERVUS_API int getEventFD() const;
+
+    /**
+     * Process all pending events without blocking.
+     *
+     * @return the success status of the operation, PENDING if an event thread
+     *         is processing the events.
+     * @sa getEventFD()
+     * @version 1.6
+     */
+    SERVUS_API Result processEvents();
+
+    /** Predicate for waitFor(). @version 1.6 */
+    typedef std::function<bool(const std::string& instance)> InstancePredicate;
+
+    /**
+     * Wait for an instance matching the given predicate.
+     *
+     * The predicate is evaluated on all discovered instances, and then on each
+     * instance as soon as it is added or updated. Its values can be queried
+     * using get(). The predicate is invoked from the thread processing the
+     * events. Browsing on all interfaces is started if needed, and stopped
+     * again before returning.
+     *
+     * @param predicate returns true for the instance to wait for.
+     * @param timeout the maximum time to wait in milliseconds, -1 to wait
+     *                forever.
+     * @return the name of the first matching instance, or an empty string on
+     *         timeout.
+     * @version 1.6
+     */
+    SERVUS_API std::string waitFor(const InstancePredicate& predicate,
+                                   int32_t timeout);
+
     /** @return all instances found during the last discovery. @version 1.1 */
     SERVUS_API Strings getInstances() const;
 
@@ -176,15 +460,119 @@ public:
     SERVUS_API Strings getKeys(const std::string& instance) const;
 
     /** @return the host corresponding to the given instance. @version 1.3 */
-    SERVUS_API const std::string& getHost(const std::string& instance) const;
+    SERVUS_API std::string getHost(const std::string& instance) const;
 
     /** @return true if the given key was discovered. @version 1.1 */
     SERVUS_API bool containsKey(const std::string& instance,
                                 const std::string& key) const;
 
-    /** @return the value of the given key and instance. @version 1.1 */
-    SERVUS_API const std::string& get(const std::string& instance,
-                                      const std::string& key) const;
+    /**
+     * The discovered data is queried from an immutable snapshot. Queries are
+     * lock-free and may be issued from any number of threads concurrently with
+     * browsing.
+     *
+     * @return a copy of the value of the given key and instance.
+     * @version 1.1
+     */
+    SERVUS_API std::string get(const std::string& instance,
+                               const std::string& key) const;
+
+    /**
+     * The binary or textual value is decoded once when the instance is
+     * discovered or updated, queries only convert the cached value.
+     *
+     * @return the typed value of the given key and instance, invalid if it is
+     *         unknown or not a number.
+     * @sa set<T>()
+     * @version 1.6
+     */
+    SERVUS_API Value getValue(const std::string& instance,
+                              const std::string& key) const;
+
+    /**
+     * @return the typed value of the given key and instance, or a
+     *         default-constructed T if it is unknown or not a number.
+     * @sa getValue()
+     * @version 1.6
+     */
+    template <class T>
+    typename std::enable_if<Value::isTyped<T>::value, T>::type get(
+        const std::string& instance, const std::string& key) const
+    {
+        return getValue(instance, key).get<T>();
+    }
+
+    /**
+     * Update an object from the announced object of its type.
+     *
+     * @return true if the instance announced an object of the type of the
+     *         given object and it was deserialized successfully.
+     * @sa set(const Serializable&, SerializableFormat)
+     * @version 1.6
+     */
+    SERVUS_API bool get(const std::string& instance,
+                        Serializable& object) const;
+
+    /** Factory of the objects deserialized by getObject(). @version 1.6 */
+    typedef std::function<std::shared_ptr<Serializable>()> ObjectFactory;
+
+    /**
+     * Get the deserialized object of the given type announced by an instance.
+     *
+     * The object is deserialized on first use and cached with the discovered
+     * data of the instance, until the instance announces new data.
+     *
+     * @param instance the discovered instance.
+     * @param type the type identifier of the object.
+     * @param factory creates an empty object of the given type.
+     * @return the object, or nullptr if it was not announced or can't be
+     *         deserialized.
+     * @version 1.6
+     */
+    SERVUS_API std::shared_ptr<const Serializable> getObject(
+        const std::string& instance, const uint128_t& type,
+        const ObjectFactory& factory) const;
+
+    /**
+     * @return the cached, deserialized object of the default-constructible
+     *         Serializable T announced by the given instance, or nullptr.
+     * @sa getObject(const std::string&, const uint128_t&, const ObjectFactory&)
+     * @version 1.6
+     */
+    template <class T>
+    std::shared_ptr<const T> getObject(const std::string& instance) const
+    {
+        static const uint128_t type = T().getTypeIdentifier();
+        return std::dynamic_pointer_cast<const T>(getObject(
+            instance, type, [] { return std::make_shared<T>(); }));
+    }
+
+    /** Visitor for forEachInstance(). @version 1.6 */
+    typedef std::function<void(const std::string& instance)> InstanceVisitor;
+
+    /** Visitor for forEachValue(). @version 1.6 */
+    typedef std::function<void(const std::string& key,
+                               const std::string& value)>
+        ValueVisitor;
+
+    /**
+     * Visit all discovered instances in sorted order, without copying them.
+     *
+     * The visited names are only valid during the invocation of the visitor.
+     * @version 1.6
+     */
+    SERVUS_API void forEachInstance(const InstanceVisitor& visitor) const;
+
+    /**
+     * Visit all key/value pairs of the given instance in sorted key order,
+     * without copying them.
+     *
+     * The visited strings are only valid during the invocation of the visitor.
+     * @return false if the instance is unknown, true otherwise.
+     * @version 1.6
+     */
+    SERVUS_API bool forEachValue(const std::string& instance,
+                                 const ValueVisitor& visitor) const;
 
     /**
      * Add a listener which is invoked according to its supported callbacks.
@@ -202,12 +590,83 @@ public:
      */
     SERVUS_API void removeListener(Listener* listener);
 
-    /** @internal */
+    /**
+     * Add a listener which is notified of the changed instances in batches.
+     *
+     * The collected changes are delivered at the end of the event processing
+     * iteration, in browse() or the event thread, once the given time window
+     * passed since the first collected change.
+     *
+     * @param listener the listener to be added, must not be nullptr
+     * @param window the time in milliseconds to collect changes, 0 to notify
+     *               after each event processing iteration with changes
+     * @version 1.6
+     */
+    SERVUS_API void addListener(BatchListener* listener, uint32_t window = 0);
+
+    /**
+     * Remove a batch listener, dropping its undelivered changes.
+     *
+     * @param listener the listener to be removed, must not be nullptr
+     * @version 1.6
+     */
+    SERVUS_API void removeListener(BatchListener* listener);
+
+    /**
+     * Set how the listeners are notified.
+     *
+     * By default, listeners are invoked by the event processing in browse()
+     * or the event thread, and a slow listener delays the processing of all
+     * further events. A queued policy decouples them: events are queued, and
+     * delivered in order by a worker thread of this object, or by the tasks
+     * passed to the given executor, e.g., posting them to a GUI event loop.
+     * The policy decides what happens if queueSize events are pending. Waiting
+     * with DISPATCH_BLOCK deadlocks if the executor runs the tasks on the
+     * thread processing the events. DISPATCH_COALESCE merges the event with a
+     * pending event of the same instance if possible, and waits otherwise.
+     *
+     * Queued events are delivered before the policy changes. Listeners are
+     * not invoked after removeListener() returned, and queued events are
+     * dropped when this object is destroyed.
+     *
+     * @param policy the delivery of the listener notifications
+     * @param queueSize the maximum number of pending events for queued
+     *                  policies
+     * @param executor runs the delivery tasks, a worker thread is used if
+     *                 empty
+     * @version 1.6
+     */
+    SERVUS_API void setDispatch(DispatchPolicy policy, size_t queueSize = 1024,
+                                const Executor& executor = Executor());
+
+    /** All discovered data, indexed by instance name and key. */
     typedef std::map<std::string, std::map<std::string, std::string> > Data;
 
     /** @internal */
     SERVUS_API void getData(Data& data);
 
+    /**
+     * @return an immutable snapshot of all discovered data. The snapshot is
+     *         created once per change of the discovered data and shared by all
+     *         callers until the next change.
+     * @version 1.6
+     */
+    SERVUS_API std::shared_ptr<const Data> getData() const;
+
+    /**
+     * @return the statistics of the discovery operations of this object.
+     *         Thread safe.
+     * @version 1.6
+     */
+    SERVUS_API Statistics getStatistics() const;
+
+    /**
+     * @return the statistics of all Servus objects of this process, including
+     *         destroyed ones. Thread safe.
+     * @version 1.6
+     */
+    SERVUS_API static Statistics getGlobalStatistics();
+
     class Impl; //!< @internal
 
 private:
@@ -217,6 +676,7 @@ private:
     std::unique_ptr<Impl> _impl;
 
     friend SERVUS_API std::ostream& operator<<(std::ostream&, const Servus&);
+    friend class TestDriver;
 };
 
 /** @return the local hostname. */
@@ -0,0 +1,394 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace servus
+{
+namespace shm
+{
+static const uint32_t MAGIC = 0x53727632; // 'Srv2', layout version 2
+static const size_t NUM_SLOTS = 1024;
+static const size_t SLOT_SIZE = 4096;
+static const size_t SLOT_WORDS = SLOT_SIZE / 8 - 2;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory needs address-free atomics");
+
+/**
+ * One announced instance. The payload words are written by the owning process
+ * only, under the seqlock of the sequence counter which is odd while the slot
+ * is written. Readers copy the payload and retry if the sequence changed.
+ */
+struct Slot
+{
+    std::atomic<uint32_t> sequence;
+    std::atomic<int32_t> owner; //!< pid, 0 if free, -1 while reclaimed
+    std::atomic<uint32_t> state; //!< of the announcement, see State
+    uint32_t reserved;
+    std::atomic<uint64_t> words[SLOT_WORDS];
+};
+static_assert(sizeof(Slot) == SLOT_SIZE, "unexpected slot padding");
+
+/** The shared memory segment. All zeroes is a valid, empty registry. */
+struct Segment
+{
+    std::atomic<uint32_t> magic;
+    std::atomic<uint32_t> nSlots;
+    std::atomic<uint64_t> generation; //!< incremented after each change
+    Slot slots[NUM_SLOTS];
+};
+
+/**
+ * The state of an announcement. A name is announced in three steps, checking
+ * the other slots for the same name after each one, see shm::Servus::_add().
+ */
+enum State
+{
+    STATE_FREE,
+    STATE_CLAIMING,  //!< written, defers to lower and announced slots
+    STATE_CHECKING,  //!< defers to lower slots
+    STATE_ANNOUNCED  //!< visible to the browsers
+};
+
+/** The content of a slot. */
+struct Entry
+{
+    std::string service;
+    std::string instance;
+    std::string host;
+    std::map<std::string, std::string> data;
+    State state;
+};
+
+/** @return the segment name, from SERVUS_SHM or of the effective user. */
+inline std::string getSegmentName()
+{
+    const char* name = ::getenv("SERVUS_SHM");
+    if (name && *name)
+        return name;
+    return "/servus." + std::to_string(::geteuid());
+}
+
+/**
+ * The process-wide mapping of the shared memory registry.
+ *
+ * Lookups are plain memory reads of the mapped segment: a reader compares the
+ * generation counter to detect changes, and the sequence of each slot to find
+ * the changed slots. Writers claim free slots with a compare-and-swap of the
+ * owner pid. Slots of crashed processes are reclaimed by reclaim().
+ */
+class Registry
+{
+public:
+    /** @return the shared registry of the given segment, created if needed */
+    static std::shared_ptr<Registry> get(const std::string& name)
+    {
+        static std::mutex mutex;
+        static std::map<std::string, std::weak_ptr<Registry>> instances;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::shared_ptr<Registry> registry = instances[name].lock();
+        if (!registry)
+        {
+            registry.reset(new Registry(name));
+            instances[name] = registry;
+        }
+        return registry;
+    }
+
+    ~Registry() { ::munmap(_segment, sizeof(Segment)); }
+
+    /** Serializes the users of the registry in this process. */
+    std::mutex mutex;
+
+    /** @return the generation, which changes after each change. */
+    uint64_t getGeneration() const
+    {
+        return _segment->generation.load(std::memory_order_acquire);
+    }
+
+    /** @return the sequence of the given slot, odd while it is written. */
+    uint32_t getSequence(const size_t slot) const
+    {
+        return _segment->slots[slot].sequence.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Read the given slot consistently.
+     * @return false if the slot is free, or written concurrently, in which
+     *         case the returned sequence is odd.
+     */
+    bool read(const size_t slot, Entry& entry, uint32_t& sequence) const
+    {
+        const Slot& source = _segment->slots[slot];
+        uint64_t words[SLOT_WORDS];
+        for (size_t retries = 0; retries < 16; ++retries)
+        {
+            sequence = source.sequence.load(std::memory_order_acquire);
+            if (sequence & 1)
+                continue;
+            for (size_t i = 0; i < SLOT_WORDS; ++i)
+                words[i] = source.words[i].load(std::memory_order_relaxed);
+            const uint32_t state = source.state.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (source.sequence.load(std::memory_order_relaxed) != sequence)
+                continue;
+
+            entry.state = State(state);
+
+            if (source.owner.load(std::memory_order_relaxed) <= 0)
+                return false;
+            return _decode((const char*)words, entry);
+        }
+        sequence |= 1; // not read consistently
+        return false;
+    }
+
+    /** @return a free slot claimed by this process, or -1 if full. */
+    int claim()
+    {
+        const int32_t pid = int32_t(::getpid());
+        for (size_t i = 0; i < NUM_SLOTS; ++i)
+        {
+            int32_t free = 0;
+            if (_segment->slots[i].owner.compare_exchange_strong(free, pid))
+                return int(i);
+        }
+        return -1;
+    }
+
+    /**
+     * Write an entry to a slot claimed by this process.
+     * @return false if the entry does not fit into a slot.
+     */
+    bool write(const size_t slot, const Entry& entry)
+    {
+        uint64_t words[SLOT_WORDS];
+        if (!_encode(entry, (char*)words))
+            return false;
+        _write(_segment->slots[slot], words, entry.state);
+        return true;
+    }
+
+    /** Clear and free a slot claimed by this process. */
+    void release(const size_t slot)
+    {
+        Slot& target = _segment->slots[slot];
+        const uint64_t words[SLOT_WORDS] = {0};
+        _write(target, words, STATE_FREE);
+        target.owner.store(0, std::memory_order_release);
+    }
+
+    /** Free the slots of processes which no longer exist. */
+    void reclaim()
+    {
+        for (size_t i = 0; i < NUM_SLOTS; ++i)
+        {
+            Slot& slot = _segment->slots[i];
+            int32_t owner = slot.owner.load(std::memory_order_relaxed);
+            if (owner <= 0 || ::kill(owner, 0) == 0 || errno != ESRCH ||
+                !slot.owner.compare_exchange_strong(owner, -1))
+            {
+                continue;
+            }
+            release(i);
+        }
+    }
+
+    /**
+     * Claim an instance name of a service for the given owner within this
+     * process, the shared slots detect conflicts with other processes.
+     * @return false if the name is owned by another owner.
+     */
+    bool claim(const std::string& service, const std::string& instance,
+               const void* owner)
+    {
+        const auto i = _names.insert(std::make_pair(Name(service, instance),
+                                                    owner));
+        return i.first->second == owner;
+    }
+
+    /** Release a name claimed by the given owner. */
+    void release(const std::string& service, const std::string& instance,
+                 const void* owner)
+    {
+        const auto i = _names.find(Name(service, instance));
+        if (i != _names.end() && i->second == owner)
+            _names.erase(i);
+    }
+
+private:
+    typedef std::pair<std::string, std::string> Name; //!< service, instance
+
+    Segment* _segment;
+    std::map<Name, const void*> _names; //!< claimed instances
+
+    explicit Registry(const std::string& name)
+        : _segment(nullptr)
+    {
+        // private to the user, any writer can modify all announcements
+        const int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+        if (fd < 0)
+            _throw("Can't open shared memory " + name);
+
+        struct stat status;
+        if (::fstat(fd, &status) != 0)
+        {
+            ::close(fd);
+            _throw("Can't open shared memory " + name);
+        }
+        if (status.st_uid != ::geteuid() ||
+            (status.st_mode & (S_IWGRP | S_IWOTH)))
+        {
+            ::close(fd);
+            errno = EPERM;
+            _throw("Untrusted shared memory " + name);
+        }
+
+        // concurrent creators truncate to the same size, which is harmless
+        if (status.st_size == 0 &&
+            ::ftruncate(fd, off_t(sizeof(Segment))) != 0)
+        {
+            ::close(fd);
+            _throw("Can't size shared memory " + name);
+        }
+        if (status.st_size != 0 && size_t(status.st_size) != sizeof(Segment))
+        {
+            ::close(fd);
+            errno = EINVAL;
+            _throw("Incompatible shared memory " + name);
+        }
+
+        void* address = ::mmap(0, sizeof(Segment), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            _throw("Can't map shared memory " + name);
+        _segment = (Segment*)address;
+
+        uint32_t magic = 0;
+        if (!_segment->magic.compare_exchange_strong(magic, MAGIC) &&
+            magic != MAGIC)
+        {
+            ::munmap(_segment, sizeof(Segment));
+            errno = EINVAL;
+            _throw("Incompatible shared memory " + name);
+        }
+        _segment->nSlots.store(NUM_SLOTS);
+    }
+
+    void _throw(const std::string& what)
+    {
+        throw std::runtime_error(what + ": " + ::strerror(errno));
+    }
+
+    void _write(Slot& target, const uint64_t* words, const State state)
+    {
+        // odd if the previous writer crashed, which reclaim() recovers
+        const uint32_t sequence =
+            target.sequence.load(std::memory_order_relaxed) & ~1u;
+        target.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < SLOT_WORDS; ++i)
+            target.words[i].store(words[i], std::memory_order_relaxed);
+        target.state.store(state, std::memory_order_relaxed);
+        target.sequence.store(sequence + 2, std::memory_order_release);
+        _segment->generation.fetch_add(1, std::memory_order_release);
+    }
+
+    // Payload: a 16 bit size and the bytes of each string, service, instance,
+    // host, then key and value of each pair, terminated by an empty key.
+    static bool _encode(const Entry& entry, char* payload)
+    {
+        const size_t capacity = SLOT_WORDS * 8;
+        size_t pos = 0;
+        const auto append = [&](const std::string& string) {
+            if (string.size() > 0xffff || pos + 2 + string.size() > capacity)
+                return false;
+            payload[pos++] = char(string.size() >> 8);
+            payload[pos++] = char(string.size() & 0xff);
+            ::memcpy(payload + pos, string.data(), string.size());
+            pos += string.size();
+            return true;
+        };
+
+        ::memset(payload, 0, capacity);
+        if (entry.service.empty() || !append(entry.service) ||
+            !append(entry.instance) || !append(entry.host))
+        {
+            return false;
+        }
+        for (const auto& i : entry.data)
+            if (i.first.empty() || !append(i.first) || !append(i.second))
+                return false;
+        return append(std::string());
+    }
+
+    static bool _decode(const char* payload, Entry& entry)
+    {
+        const size_t capacity = SLOT_WORDS * 8;
+        size_t pos = 0;
+        const auto next = [&](std::string& string) {
+            if (pos + 2 > capacity)
+                return false;
+            const size_t size = (size_t(uint8_t(payload[pos])) << 8) |
+                                uint8_t(payload[pos + 1]);
+            pos += 2;
+            if (pos + size > capacity)
+                return false;
+            string.assign(payload + pos, size);
+            pos += size;
+            return true;
+        };
+
+        entry.data.clear();
+        if (!next(entry.service) || entry.service.empty() ||
+            !next(entry.instance) || !next(entry.host))
+        {
+            return false;
+        }
+        for (;;)
+        {
+            std::string key, value;
+            if (!next(key))
+                return false;
+            if (key.empty())
+                return true;
+            if (!next(value))
+                return false;
+            entry.data[key] = value;
+        }
+    }
+};
+}
+}
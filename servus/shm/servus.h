@@ -0,0 +1,406 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "registry.h"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+namespace servus
+{
+namespace shm
+{
+using ScopedLock = std::unique_lock<std::mutex>;
+using std::chrono::milliseconds;
+
+static const milliseconds POLL_INTERVAL(1);
+static const milliseconds RECLAIM_INTERVAL(1000);
+static const milliseconds CLAIM_TIMEOUT(100); //!< of a concurrent announce
+
+/**
+ * Same-host discovery through a shared memory registry.
+ *
+ * Generalizes the in-process directory of test::Servus to all processes of a
+ * host: each announced instance is a slot of the shared shm::Registry. Browsing
+ * compares the generation counter of the registry, and reads only the slots
+ * whose sequence changed, without any system call. Without a notification
+ * mechanism, the event processing polls the generation every POLL_INTERVAL.
+ */
+class Servus : public servus::Servus::Impl
+{
+    typedef std::chrono::steady_clock Clock; // Impl's is private
+
+public:
+    explicit Servus(const std::string& name)
+        : servus::Servus::Impl(name)
+        , _registry(Registry::get(getSegmentName()))
+        , _mutex(_registry->mutex)
+        , _host(getHostname())
+        , _browsing(false)
+        , _generation(0)
+        , _sequences(NUM_SLOTS, 0)
+        , _instances(NUM_SLOTS)
+        , _wakeupPending(false)
+    {
+    }
+
+    virtual ~Servus()
+    {
+        stopEventThread();
+        withdraw();
+        endBrowsing();
+    }
+
+    std::string getClassName() const { return "shm"; }
+    servus::Servus::Result announce(const unsigned short,
+                                    const std::string& instance) final
+    {
+        ScopedLock lock(_mutex);
+        const std::string& name = instance.empty() ? _host : instance;
+        if (_primary.instance != name)
+            _withdraw(_primary);
+        return _add(_primary, name, _data);
+    }
+
+    servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) final
+    {
+        ScopedLock lock(_mutex);
+        for (Announced& announced : _announced)
+            _withdraw(announced);
+        _announced.clear();
+
+        _announced.resize(announcements.size());
+        for (size_t i = 0; i < announcements.size(); ++i)
+        {
+            const std::string& instance = announcements[i].instance;
+            const servus::Servus::Result result =
+                _add(_announced[i], instance.empty() ? _host : instance,
+                     announcements[i].data);
+            if (result)
+                continue;
+
+            for (Announced& announced : _announced)
+                _withdraw(announced);
+            _announced.clear();
+            return result;
+        }
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void withdraw() final
+    {
+        ScopedLock lock(_mutex);
+        _withdraw(_primary);
+        for (Announced& announced : _announced)
+            _withdraw(announced);
+        _announced.clear();
+    }
+
+    bool isAnnounced() const final
+    {
+        ScopedLock lock(_mutex);
+        return _primary.slot >= 0 || !_announced.empty();
+    }
+
+    servus::Servus::Result beginBrowsing(
+        const ::servus::Servus::Interface) final
+    {
+        ScopedLock lock(_mutex);
+        if (_browsing)
+            return servus::Servus::Result(servus::Servus::Result::PENDING);
+
+        _clearInstances();
+        std::fill(_sequences.begin(), _sequences.end(), 0);
+        std::fill(_instances.begin(), _instances.end(), std::string());
+        _browsing = true;
+        _reclaim();
+        _scan(true);
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void endBrowsing() final
+    {
+        ScopedLock lock(_mutex);
+        _browsing = false;
+    }
+
+    bool isBrowsing() const final
+    {
+        ScopedLock lock(_mutex);
+        return _browsing;
+    }
+
+private:
+    struct Announced
+    {
+        Announced()
+            : slot(-1)
+        {
+        }
+        std::string instance;
+        int slot;
+    };
+
+    const std::shared_ptr<Registry> _registry;
+    std::mutex& _mutex; //!< of the shared registry
+    const std::string _host;
+
+    // announce
+    Announced _primary;
+    std::vector<Announced> _announced;
+
+    // browse
+    bool _browsing;
+    uint64_t _generation;            //!< of the last scan
+    std::vector<uint32_t> _sequences; //!< of each slot at the last scan
+    std::vector<std::string> _instances; //!< of this service in each slot
+    Clock::time_point _nextReclaim;
+
+    std::condition_variable _condition; //!< signaled by _wakeup()
+    bool _wakeupPending;
+
+    servus::Servus::Result _add(Announced& announced,
+                                const std::string& instance,
+                                const ValueMap& data)
+    {
+        if (!_registry->claim(_name, instance, this))
+            return servus::Servus::Result(EEXIST);
+        if (announced.slot >= 0 && announced.instance == instance)
+        {
+            // already announced, only update the data
+            if (!_registry->write(size_t(announced.slot),
+                                  Entry{_name, instance, _host, data,
+                                        STATE_ANNOUNCED}))
+            {
+                _withdraw(announced);
+                return servus::Servus::Result(EMSGSIZE);
+            }
+            return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+        }
+
+        announced.instance = instance;
+        announced.slot = _registry->claim();
+        if (announced.slot < 0)
+        {
+            _withdraw(announced);
+            return servus::Servus::Result(ENOSPC);
+        }
+
+        // Processes announcing the same name concurrently check the other
+        // slots after each write. Of two claimers, the second to write sees
+        // the first one, which proceeds only if it is in the lower slot; in
+        // turn, the second to reach the check sees the other one in its check,
+        // where the lower slot wins. Announced slots always win.
+        for (const State state : {STATE_CLAIMING, STATE_CHECKING})
+        {
+            if (!_registry->write(size_t(announced.slot),
+                                  Entry{_name, instance, _host, data, state}))
+            {
+                _withdraw(announced);
+                return servus::Servus::Result(EMSGSIZE);
+            }
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (_isClaimed(instance, announced.slot, state))
+            {
+                _withdraw(announced);
+                return servus::Servus::Result(EEXIST);
+            }
+        }
+        _registry->write(size_t(announced.slot),
+                         Entry{_name, instance, _host, data, STATE_ANNOUNCED});
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    // @return true if another slot has the given instance of this service and
+    //         the given slot in the given state defers to it. Waits for the
+    //         outcome of the check of a higher slot while claiming.
+    bool _isClaimed(const std::string& instance, const int slot,
+                    const State state) const
+    {
+        const Clock::time_point end = Clock::now() + CLAIM_TIMEOUT;
+        Entry entry;
+        uint32_t sequence;
+        for (size_t i = 0; i < NUM_SLOTS; ++i)
+        {
+            if (int(i) == slot)
+                continue;
+            for (;;)
+            {
+                if (!_registry->read(i, entry, sequence))
+                {
+                    if (!(sequence & 1)) // free
+                        break;
+                }
+                else if (entry.service != _name || entry.instance != instance)
+                    break;
+                else if (entry.state == STATE_ANNOUNCED || int(i) < slot)
+                    return true;
+                else if (state == STATE_CHECKING ||
+                         entry.state != STATE_CHECKING)
+                {
+                    break; // a higher slot which defers to this one
+                }
+
+                // written concurrently, or checking: wait for the outcome
+                if (Clock::now() >= end)
+                    return true;
+                std::this_thread::yield();
+            }
+        }
+        return false;
+    }
+
+    void _withdraw(Announced& announced)
+    {
+        if (announced.slot >= 0)
+            _registry->release(size_t(announced.slot));
+        if (!announced.instance.empty())
+            _registry->release(_name, announced.instance, this);
+        announced = Announced();
+    }
+
+    void _updateRecord() final
+    {
+        ScopedLock lock(_mutex);
+        if (_primary.slot >= 0)
+            _registry->write(size_t(_primary.slot),
+                             Entry{_name, _primary.instance, _host, _data,
+                                   STATE_ANNOUNCED});
+    }
+
+    void _reclaim()
+    {
+        _registry->reclaim();
+        _nextReclaim = Clock::now() + RECLAIM_INTERVAL;
+    }
+
+    // Update the discovered instances from the changed slots
+    // @return true if a slot of this service changed
+    bool _scan(const bool force)
+    {
+        const uint64_t generation = _registry->getGeneration();
+        if (!force && generation == _generation)
+            return false;
+        _generation = generation;
+
+        Strings removed; //!< previous instances of the changed slots
+        std::vector<std::pair<std::string, ValueMap>> updated;
+        Entry entry;
+        for (size_t i = 0; i < NUM_SLOTS; ++i)
+        {
+            uint32_t sequence = _registry->getSequence(i);
+            if (!force && sequence == _sequences[i])
+                continue;
+
+            const bool used = _registry->read(i, entry, sequence) &&
+                              entry.service == _name &&
+                              entry.state == STATE_ANNOUNCED;
+            if (sequence & 1)
+            {
+                // written concurrently, or by a crashed process, retry later
+                _generation = 0;
+                continue;
+            }
+            _sequences[i] = sequence;
+
+            std::string& instance = _instances[i];
+            if (!instance.empty() && (!used || instance != entry.instance))
+                removed.push_back(instance);
+            if (!used)
+            {
+                instance.clear();
+                continue;
+            }
+
+            instance = entry.instance;
+            ValueMap values = std::move(entry.data);
+            values["servus_host"] = entry.host;
+            updated.emplace_back(instance, std::move(values));
+        }
+
+        // An instance may move to another slot, e.g. when re-announced in a
+        // different order: remove only those no longer in any slot
+        if (!removed.empty())
+        {
+            const std::set<std::string> instances(_instances.begin(),
+                                                  _instances.end());
+            for (const std::string& instance : removed)
+                if (!instances.count(instance))
+                    _removeInstance(instance);
+        }
+        for (auto& i : updated)
+            _updateInstance(i.first, std::move(i.second));
+        return !removed.empty() || !updated.empty();
+    }
+
+    bool _isDiscoveryComplete() const final
+    {
+        ScopedLock lock(_mutex);
+        return _browsing; // the registry is read completely on each scan
+    }
+
+    servus::Servus::Result _processEvents(const int32_t timeout) final
+    {
+        ScopedLock lock(_mutex);
+        const Clock::time_point end = Clock::now() + milliseconds(timeout);
+        for (;;)
+        {
+            bool changed = false;
+            if (_browsing)
+            {
+                if (Clock::now() >= _nextReclaim)
+                    _reclaim();
+                changed = _scan(false);
+            }
+
+            // without a timeout, return once changes were applied
+            const Clock::time_point now = Clock::now();
+            if ((timeout >= 0 && now >= end) || (timeout < 0 && changed) ||
+                _isBrowseInterrupted())
+            {
+                break;
+            }
+            if (_wakeupPending)
+            {
+                _wakeupPending = false;
+                break;
+            }
+
+            const Clock::time_point next = now + POLL_INTERVAL;
+            _condition.wait_until(lock, timeout < 0 ? next
+                                                    : std::min(next, end));
+        }
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
+
+    void _wakeup() final
+    {
+        ScopedLock lock(_mutex);
+        _wakeupPending = true;
+        _condition.notify_all();
+    }
+};
+}
+}
@@ -16,9 +16,22 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <queue>
 #include <set>
+#include <utility>
+#include <vector>
 
 namespace servus
 {
@@ -28,25 +41,144 @@ class Servus;
 
 namespace
 {
+typedef std::shared_ptr<const ValueMap> ValueMapPtr;
+typedef std::chrono::steady_clock Clock;
+
+/** A change of the announced data of an instance, null data if removed. */
+struct Change
+{
+    std::string instance;
+    ValueMapPtr data;
+    const Servus* source; //!< the owner of the data, or the withdrawing Servus
+    unsigned partition;   //!< of the source when logged
+    TestDriver::Conditions conditions; //!< of the source when logged
+    Clock::time_point time;
+    size_t version;
+};
+
+/** Maximum number of changes kept for browsers catching up. */
+static const size_t MAX_CHANGES = 65536;
+
 struct
 {
     std::mutex mutex;
-    std::set<Servus*> instances;
+    std::condition_variable condition; //!< signaled on version changes
+    std::set<int> eventFDs; //!< write ends of the getEventFD() pipes
+
+    /** The announced data of all owners, keyed by Servus and announcement. */
+    std::map<std::string, std::map<std::pair<const Servus*, size_t>,
+                                   ValueMapPtr>> owners;
+    std::map<std::string, Change> instances; //!< last change with data
+
+    /**
+     * The log of all changes of instances, the last one having version.
+     * Browsers apply the changes since their last version, or read all
+     * instances if they fell behind the start of the log.
+     */
+    std::deque<Change> changes;
+    size_t version{1}; //!< incremented on each change of announced data
+
+    // simulated network, see servus::TestDriver
+    TestDriver::Conditions defaultConditions;
+    std::map<const Servus*, TestDriver::Conditions> conditions;
+    std::map<const Servus*, unsigned> partitions; //!< non-default only
+    size_t partitionVersion{0}; //!< incremented on each partition change
+    uint64_t seed{0};
+    bool virtualClock{false};
+    Clock::time_point virtualTime;
+    size_t nBrowsers{0}; //!< to derive the random decisions of each browser
 } _directory;
 }
 
 class Servus : public servus::Servus::Impl
 {
+    typedef std::chrono::steady_clock Clock; // Impl's is private
+
 public:
     Servus()
         : servus::Servus::Impl(servus::TEST_DRIVER)
+        , _id(_nextId())
     {
     }
 
     virtual ~Servus()
     {
+        stopEventThread();
         withdraw();
         endBrowsing();
+
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        _directory.conditions.erase(this);
+        _directory.partitions.erase(this);
+#ifndef _WIN32
+        if (_pipe[0] >= 0)
+        {
+            _directory.eventFDs.erase(_pipe[1]);
+            ::close(_pipe[0]);
+            ::close(_pipe[1]);
+        }
+#endif
+    }
+
+    /** @sa servus::TestDriver */
+    static void setConditions(const Servus* servus,
+                              const TestDriver::Conditions& conditions)
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        if (servus)
+            _directory.conditions[servus] = conditions;
+        else
+            _directory.defaultConditions = conditions;
+    }
+
+    static void setPartition(const Servus& servus, const unsigned partition)
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        if (partition == _getPartition(&servus))
+            return;
+        if (partition == 0)
+            _directory.partitions.erase(&servus);
+        else
+            _directory.partitions[&servus] = partition;
+        ++_directory.partitionVersion;
+        _notifyChange();
+    }
+
+    static void setSeed(const uint64_t seed)
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        _directory.seed = seed;
+    }
+
+    static void setVirtualClock(const bool enable)
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        if (enable && !_directory.virtualClock)
+            _directory.virtualTime = Clock::now();
+        _directory.virtualClock = enable;
+        _notifyChange();
+    }
+
+    static void advanceClock(const std::chrono::milliseconds time)
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        _directory.virtualTime += time;
+        _notifyChange();
+    }
+
+    static void reset()
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        _directory.defaultConditions = TestDriver::Conditions();
+        _directory.conditions.clear();
+        if (!_directory.partitions.empty())
+        {
+            _directory.partitions.clear();
+            ++_directory.partitionVersion;
+        }
+        _directory.seed = 0;
+        _directory.virtualClock = false;
+        _notifyChange();
     }
 
     std::string getClassName() const { return "test"; }
@@ -55,13 +187,35 @@ public:
     {
         std::lock_guard<std::mutex> lock(_directory.mutex);
 
+        if (_announced)
+            _unset(_instance, 0);
         _port = port;
         if (instance.empty())
             _instance = getHostname();
         else
             _instance = instance;
-        _directory.instances.insert(this);
         _announced = true;
+        _set(_instance, 0, _data);
+        _notifyChange();
+        return servus::Servus::Result(servus::Result::SUCCESS);
+    }
+
+    servus::Servus::Result announce(
+        const servus::Servus::Announcements& announcements) final
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+
+        for (size_t i = 0; i < _announcements.size(); ++i)
+            _unset(_announcements[i].instance, i + 1);
+        _announcements = announcements;
+        for (size_t i = 0; i < _announcements.size(); ++i)
+        {
+            servus::Servus::Announcement& announcement = _announcements[i];
+            if (announcement.instance.empty())
+                announcement.instance = getHostname();
+            _set(announcement.instance, i + 1, announcement.data);
+        }
+        _notifyChange();
         return servus::Servus::Result(servus::Result::SUCCESS);
     }
 
@@ -69,79 +223,409 @@ public:
     {
         std::lock_guard<std::mutex> lock(_directory.mutex);
 
+        if (_announced)
+            _unset(_instance, 0);
+        for (size_t i = 0; i < _announcements.size(); ++i)
+            _unset(_announcements[i].instance, i + 1);
+        if (_isListed())
+            _notifyChange();
         _announced = false;
-        _directory.instances.erase(this);
+        _announcements.clear();
         _port = 0;
         _instance.clear();
     }
 
-    bool isAnnounced() const final { return _announced; }
+    bool isAnnounced() const final
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        return _isListed();
+    }
     servus::Servus::Result beginBrowsing(
         const ::servus::Servus::Interface) final
     {
+        std::lock_guard<std::mutex> browseLock(_browseMutex);
+        std::lock_guard<std::mutex> lock(_directory.mutex);
         if (_browsing)
             return servus::Servus::Result(servus::Servus::Result::PENDING);
 
         _instances.clear();
+        _clearInstances();
+        _resetDeliveries();
+        _version = 0;
+        _partitionVersion = _directory.partitionVersion;
         _browsing = true;
         return servus::Servus::Result(servus::Servus::Result::SUCCESS);
     }
 
-    servus::Servus::Result browse(const int32_t) final
+    void endBrowsing() final
     {
+        std::lock_guard<std::mutex> browseLock(_browseMutex);
         std::lock_guard<std::mutex> lock(_directory.mutex);
+        _browsing = false;
+        _instances.clear();
+        _resetDeliveries();
+    }
 
-        std::vector<Servus*> diff;
-        std::set_symmetric_difference(_directory.instances.begin(),
-                                      _directory.instances.end(),
-                                      _instances.begin(), _instances.end(),
-                                      back_inserter(diff));
+    bool isBrowsing() const final { return _browsing; }
+    int getEventFD() final
+    {
+#ifdef _WIN32
+        return -1;
+#else
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        if (_pipe[0] >= 0)
+            return _pipe[0];
 
-        _instanceMap.clear();
-        for (auto i : _directory.instances)
+        if (::pipe(_pipe) != 0)
         {
-            ValueMap& values = _instanceMap[i->_instance];
-            values.clear();
-            values["servus_host"] = "localhost";
+            _pipe[0] = _pipe[1] = -1;
+            return -1;
+        }
+        for (const int fd : _pipe)
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        _directory.eventFDs.insert(_pipe[1]);
+        if (_isReady())
+            _signal(_pipe[1]); // changes pending already
+        return _pipe[0];
+#endif
+    }
+
+private:
+    /** A change scheduled for delivery to this browser. */
+    struct Delivery
+    {
+        Clock::time_point due;
+        size_t version;
+        std::string instance;
+        ValueMapPtr data;
+    };
+
+    struct Later
+    {
+        bool operator()(const Delivery& a, const Delivery& b) const
+        {
+            return a.due > b.due || (a.due == b.due && a.version > b.version);
+        }
+    };
+
+    const size_t _id; //!< unique browser id for the random decisions
+    std::string _instance;
+    unsigned short _port{0};
+    bool _announced{false};
+    servus::Servus::Announcements _announcements;
+    bool _browsing{false};
+    size_t _version{0}; //!< last processed directory version
+    int _pipe[2]{-1, -1}; //!< lazily created by getEventFD()
+
+    std::mutex _browseMutex; //!< serializes the processing of changes
+    std::set<std::string> _instances; //!< names of the seen instances
+
+    // simulated network, guarded by _directory.mutex
+    std::priority_queue<Delivery, std::vector<Delivery>, Later> _pending;
+    Clock::time_point _nextDelivery{Clock::time_point::max()};
+    std::map<std::string, size_t> _delivered; //!< version per instance
+    size_t _partitionVersion{0}; //!< last processed partition version
+
+    static size_t _nextId()
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        return ++_directory.nBrowsers;
+    }
+
+    void _updateRecord() final
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        if (!_announced)
+            return;
+        _set(_instance, 0, _data);
+        _notifyChange();
+    }
+
+    // _directory.mutex needs to be locked for the functions below
+
+    // Set the data announced by this Servus, for the primary announcement
+    // (0) or the given bulk announcement (1..n), chunked like a TXT record
+    void _set(const std::string& instance, const size_t index,
+              const ValueMap& data)
+    {
+        _directory.owners[instance][std::make_pair(this, index)] =
+            std::make_shared<const ValueMap>(TXTRecord::chunk(data));
+        _logChange(instance, this);
+    }
+
+    void _unset(const std::string& instance, const size_t index)
+    {
+        const auto i = _directory.owners.find(instance);
+        if (i == _directory.owners.end())
+            return;
+        i->second.erase(std::make_pair(this, index));
+        if (i->second.empty())
+            _directory.owners.erase(i);
+        _logChange(instance, this);
+    }
+
+    // Log a change of the data of the first owner of the instance, a removal
+    // is sent by the given withdrawing Servus
+    static void _logChange(const std::string& instance, const Servus* servus)
+    {
+        const auto owners = _directory.owners.find(instance);
+        ValueMapPtr data;
+        const Servus* source = servus;
+        if (owners != _directory.owners.end())
+        {
+            data = owners->second.begin()->second;
+            source = owners->second.begin()->first.first;
+        }
+
+        const auto i = _directory.instances.find(instance);
+        const ValueMapPtr old =
+            i == _directory.instances.end() ? ValueMapPtr() : i->second.data;
+        if (data == old || (data && old && *data == *old))
+            return;
+
+        ++_directory.version;
+        const Change change{instance,
+                            data,
+                            source,
+                            _getPartition(source),
+                            _getConditions(source),
+                            _now(),
+                            _directory.version};
+        if (data)
+            _directory.instances[instance] = change;
+        else
+            _directory.instances.erase(i);
+
+        _directory.changes.push_back(change);
+        if (_directory.changes.size() > MAX_CHANGES)
+            _directory.changes.pop_front();
+    }
+
+    static unsigned _getPartition(const Servus* servus)
+    {
+        const auto i = _directory.partitions.find(servus);
+        return i == _directory.partitions.end() ? 0 : i->second;
+    }
+
+    static TestDriver::Conditions _getConditions(const Servus* servus)
+    {
+        const auto i = _directory.conditions.find(servus);
+        return i == _directory.conditions.end() ? _directory.defaultConditions
+                                                : i->second;
+    }
+
+    static Clock::time_point _now()
+    {
+        return _directory.virtualClock ? _directory.virtualTime
+                                       : Clock::now();
+    }
+
+    // @return a deterministic random number in [0, 1) for the given change,
+    //         this browser and the given purpose, using splitmix64
+    double _random(const size_t version, const uint64_t purpose) const
+    {
+        const auto mix = [](uint64_t x) {
+            x += 0x9e3779b97f4a7c15ull;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+            return x ^ (x >> 31);
+        };
+        const uint64_t hash =
+            mix(_directory.seed ^ mix(version ^ mix(_id * 2 + purpose)));
+        return double(hash >> 11) / double(uint64_t(1) << 53);
+    }
 
-            for (const auto& j : i->_data)
-                values[j.first] = j.second;
+    bool _isReady() const
+    {
+        return _version != _directory.version ||
+               _partitionVersion != _directory.partitionVersion ||
+               _nextDelivery <= _now();
+    }
+
+    void _resetDeliveries()
+    {
+        _pending = decltype(_pending)();
+        _nextDelivery = Clock::time_point::max();
+        _delivered.clear();
+    }
+
+    void _schedule(const Change& change, const Clock::time_point& time,
+                   const size_t version, const bool lossy)
+    {
+        const TestDriver::Conditions& conditions = change.conditions;
+        if (lossy && conditions.loss > 0.f &&
+            _random(change.version, 0) < conditions.loss)
+        {
+            return;
         }
 
-        for (auto i : diff)
+        Clock::time_point due = time + conditions.delay;
+        if (conditions.jitter.count() > 0)
+            due += std::chrono::duration_cast<Clock::duration>(
+                conditions.jitter * _random(change.version, 1));
+        _pending.push(Delivery{due, version, change.instance, change.data});
+    }
+
+    // Schedule the changes since the last version visible in the partition of
+    // this browser, or all instances after falling behind the log or a
+    // partition change
+    void _receive()
+    {
+        const unsigned partition = _getPartition(this);
+        const size_t nChanges = _directory.version - _version;
+        if (_version == 0 || nChanges > _directory.changes.size() ||
+            _partitionVersion != _directory.partitionVersion)
         {
-            if (_instances.count(i) == 0)
+            // in-flight changes are superseded by the current state
+            _pending = decltype(_pending)();
+            const Clock::time_point now = _now();
+            std::set<std::string> invisible = _instances;
+            for (const auto& i : _directory.instances)
             {
-                _instances.insert(i);
-                for (Listener* listener : _listeners)
-                    listener->instanceAdded(i->_instance);
+                if (_getPartition(i.second.source) != partition)
+                    continue;
+                invisible.erase(i.first);
+                _schedule(i.second, now, _directory.version, false);
             }
-            else
+            for (const std::string& instance : invisible)
+                _pending.push(
+                    Delivery{now, _directory.version, instance, ValueMapPtr()});
+        }
+        else
+        {
+            for (auto i = _directory.changes.end() - nChanges;
+                 i != _directory.changes.end(); ++i)
             {
-                for (Listener* listener : _listeners)
-                    listener->instanceRemoved(i->_instance);
-                _instances.erase(i);
+                if (i->partition == partition)
+                    _schedule(*i, i->time, i->version, true);
             }
         }
-        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+        _version = _directory.version;
+        _partitionVersion = _directory.partitionVersion;
     }
 
-    void endBrowsing() final
+    // Pop the due deliveries into the latest change of each instance
+    void _deliver(std::map<std::string, ValueMapPtr>& changes)
     {
-        _browsing = false;
-        _instances.clear();
+        const Clock::time_point now = _now();
+        while (!_pending.empty() && _pending.top().due <= now)
+        {
+            const Delivery& delivery = _pending.top();
+            size_t& delivered = _delivered[delivery.instance];
+            if (delivery.version >= delivered) // else overtaken by a newer one
+            {
+                delivered = delivery.version;
+                changes[delivery.instance] = delivery.data;
+            }
+            _pending.pop();
+        }
+        _nextDelivery =
+            _pending.empty() ? Clock::time_point::max() : _pending.top().due;
     }
 
-    bool isBrowsing() const final { return _browsing; }
-private:
-    std::string _instance;
-    unsigned short _port{0};
-    bool _announced{false};
-    bool _browsing{false};
+    bool _isListed() const { return _announced || !_announcements.empty(); }
+
+    static void _notifyChange()
+    {
+        _directory.condition.notify_all();
+        for (const int fd : _directory.eventFDs)
+            _signal(fd);
+    }
+
+    static void _signal(const int fd)
+    {
+#ifdef _WIN32
+        (void)fd;
+#else
+        const char byte = 0;
+        // EAGAIN if the pipe is full, a wakeup is pending anyway
+        const ssize_t written = ::write(fd, &byte, 1);
+        (void)written;
+#endif
+    }
+
+    void _drain()
+    {
+#ifndef _WIN32
+        if (_pipe[0] < 0)
+            return;
+        char buffer[64];
+        while (::read(_pipe[0], buffer, sizeof(buffer)) > 0)
+            ;
+#endif
+    }
+
+    servus::Servus::Result _processEvents(const int32_t timeout) final
+    {
+        {
+            std::unique_lock<std::mutex> lock(_directory.mutex);
+            if (!_isReady())
+            {
+                // wait for the next delivery on the steady clock, the virtual
+                // clock notifies when it advances
+                Clock::time_point until = Clock::time_point::max();
+                if (!_directory.virtualClock)
+                    until = _nextDelivery;
+                if (timeout >= 0)
+                    until = std::min(until, Clock::now() +
+                                                std::chrono::milliseconds(
+                                                    timeout));
+                if (until == Clock::time_point::max())
+                    _directory.condition.wait(lock);
+                else
+                    _directory.condition.wait_until(lock, until);
+            }
+            _drain();
+        }
+
+        // Collect the latest due change of each instance since the last
+        // version, and apply them to the discovered instances without
+        // blocking the directory
+        std::lock_guard<std::mutex> browseLock(_browseMutex);
+        std::map<std::string, ValueMapPtr> changes;
+        {
+            std::lock_guard<std::mutex> lock(_directory.mutex);
+            if (!_browsing || !_isReady())
+                return servus::Servus::Result(
+                    servus::Servus::Result::SUCCESS);
+
+            _receive();
+            _deliver(changes);
+        }
+
+        // publish all changes in one snapshot, also when called outside of
+        // browse() or the event thread
+        const ChangeBatch batch(*this);
+        for (const auto& i : changes)
+        {
+            if (!i.second)
+            {
+                _removeInstance(i.first);
+                _instances.erase(i.first);
+                continue;
+            }
 
-    std::set<Servus*> _instances;
+            ValueMap values(*i.second);
+            values["servus_host"] = "localhost";
+            _instances.insert(i.first);
+            _updateInstance(i.first, std::move(values));
+        }
+        return servus::Servus::Result(servus::Servus::Result::SUCCESS);
+    }
 
-    void _updateRecord() final { /*nop*/}
+    bool _isDiscoveryComplete() const final
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        return _browsing && _version == _directory.version &&
+               _partitionVersion == _directory.partitionVersion &&
+               _pending.empty();
+    }
+
+    void _wakeup() final
+    {
+        std::lock_guard<std::mutex> lock(_directory.mutex);
+        _directory.condition.notify_all();
+    }
 };
 }
 }
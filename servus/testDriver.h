@@ -0,0 +1,92 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_TESTDRIVER_H
+#define SERVUS_TESTDRIVER_H
+
+#include <servus/api.h>
+#include <servus/types.h>
+
+#include <chrono>
+
+namespace servus
+{
+/**
+ * Simulated network conditions of the TEST_DRIVER.
+ *
+ * By default, the test driver delivers each change of the announced data to
+ * all browsers on their next browse(). The network conditions delay, jitter or
+ * drop the delivery of changes, and partition the Servus instances into groups
+ * which do not see each other. All random decisions are derived from the seed,
+ * the change and the browser, and together with the virtual clock give
+ * deterministic results.
+ *
+ * Conditions apply to the changes announced after they are set. A dropped
+ * change is never delivered, like a lost packet without retransmission, until
+ * the instance changes again. Changing a partition resynchronizes the
+ * browsers with the instances visible to them.
+ *
+ * The settings are process-wide and have no effect on other Servus
+ * implementations. Not thread safe with ongoing announcements.
+ *
+ * @version 1.6
+ */
+class TestDriver
+{
+public:
+    /** Conditions of the changes announced by a Servus. */
+    struct Conditions
+    {
+        std::chrono::milliseconds delay{0};  //!< propagation delay
+        std::chrono::milliseconds jitter{0}; //!< maximum additional delay
+        float loss{0.f}; //!< probability to drop a change for each browser
+    };
+
+    /** Set the conditions of all Servus without their own conditions. */
+    SERVUS_API static void setConditions(const Conditions& conditions);
+
+    /** Set the conditions of the changes announced by the given Servus. */
+    SERVUS_API static void setConditions(const Servus& announcer,
+                                         const Conditions& conditions);
+
+    /**
+     * Move a Servus into a network partition. Instances are only delivered
+     * between Servus of the same partition, the default partition is 0.
+     */
+    SERVUS_API static void setPartition(const Servus& servus,
+                                        unsigned partition);
+
+    /** Set the seed of the random jitter and loss, 0 by default. */
+    SERVUS_API static void setSeed(uint64_t seed);
+
+    /**
+     * Use a virtual clock for the delivery of changes, which only advances
+     * with advanceClock(), instead of the steady clock.
+     */
+    SERVUS_API static void setVirtualClock(bool enable);
+
+    /** Advance the virtual clock and wake up all browsers. */
+    SERVUS_API static void advanceClock(std::chrono::milliseconds time);
+
+    /** Restore instant and lossless delivery, one partition, seed 0 and the
+     *  steady clock. */
+    SERVUS_API static void reset();
+};
+}
+
+#endif
@@ -0,0 +1,173 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_TXTRECORD_H
+#define SERVUS_TXTRECORD_H
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <string>
+
+namespace servus
+{
+/**
+ * The limits of DNS TXT records and the chunking of values exceeding them.
+ *
+ * Each key=value pair of a TXT record is a string of at most 255 bytes, and
+ * the record is at most 65535 bytes. Longer values are split into the chunk
+ * keys "key#0", "key#1", ..., which are joined again on reception. Keys ending
+ * in '#' and a number are reserved for the chunks, see isChunkKey().
+ */
+class TXTRecord
+{
+public:
+    typedef std::map<std::string, std::string> Values;
+
+    static const size_t MAX_STRING = 255;
+    static const size_t MAX_SIZE = 65535;
+
+    /**
+     * @return the size of the record of the given values after chunking, or
+     *         the maximum size_t if a key is too long to be chunked.
+     */
+    static size_t getSize(const Values& values)
+    {
+        size_t size = 0;
+        for (const auto& i : values)
+        {
+            const size_t pairSize = getSize(i.first, i.second);
+            if (pairSize == std::numeric_limits<size_t>::max())
+                return pairSize;
+            size += pairSize;
+        }
+        return size;
+    }
+
+    /**
+     * @return the size of one key/value pair in a record after chunking, or
+     *         the maximum size_t if the key is too long to be chunked.
+     */
+    static size_t getSize(const std::string& key, const std::string& value)
+    {
+        if (_fits(key, value))
+            return 1 + key.size() + 1 + value.size();
+        if (key.size() + 1 >= MAX_STRING)
+            return std::numeric_limits<size_t>::max();
+
+        size_t size = 0;
+        for (size_t pos = 0, n = 0; pos < value.size(); ++n)
+        {
+            const size_t capacity = _getCapacity(key, n);
+            if (capacity == 0)
+                return std::numeric_limits<size_t>::max();
+            size += 1 + _getChunkKey(key, n).size() + 1 +
+                    std::min(capacity, value.size() - pos);
+            pos += capacity;
+        }
+        return size;
+    }
+
+    /** @return true if the key has the reserved "#<number>" chunk suffix. */
+    static bool isChunkKey(const std::string& key)
+    {
+        const size_t hash = key.find_last_not_of("0123456789");
+        return hash != std::string::npos && hash + 1 < key.size() &&
+               key[hash] == '#';
+    }
+
+    /** @return the values with long values split into chunk keys. */
+    static Values chunk(const Values& values)
+    {
+        Values chunked;
+        for (const auto& i : values)
+        {
+            const std::string& key = i.first;
+            const std::string& value = i.second;
+            if (_fits(key, value))
+            {
+                chunked.insert(chunked.end(), i);
+                continue;
+            }
+
+            for (size_t pos = 0, n = 0; pos < value.size(); ++n)
+            {
+                const size_t capacity = _getCapacity(key, n);
+                if (capacity == 0)
+                    break; // rejected by getSize()
+                chunked[_getChunkKey(key, n)] = value.substr(pos, capacity);
+                pos += capacity;
+            }
+        }
+        return chunked;
+    }
+
+    /** Join the chunk keys of received values into their original value. */
+    static void join(Values& values)
+    {
+        for (auto i = values.begin(); i != values.end();)
+        {
+            const std::string& key = i->first;
+            if (key.size() < 2 || key.compare(key.size() - 2, 2, "#0") != 0)
+            {
+                ++i;
+                continue;
+            }
+
+            // a chunked value has at least two chunks and no plain value
+            const std::string base = key.substr(0, key.size() - 2);
+            if (values.count(base) || !values.count(_getChunkKey(base, 1)))
+            {
+                ++i;
+                continue;
+            }
+
+            std::string value;
+            for (size_t n = 0;; ++n)
+            {
+                const auto chunk = values.find(_getChunkKey(base, n));
+                if (chunk == values.end())
+                    break;
+                value += chunk->second;
+                values.erase(chunk);
+            }
+            i = values.emplace(base, std::move(value)).first;
+            ++i;
+        }
+    }
+
+private:
+    static bool _fits(const std::string& key, const std::string& value)
+    {
+        return key.size() + 1 + value.size() <= MAX_STRING;
+    }
+
+    static std::string _getChunkKey(const std::string& key, const size_t n)
+    {
+        return key + "#" + std::to_string(n);
+    }
+
+    static size_t _getCapacity(const std::string& key, const size_t n)
+    {
+        const size_t used = _getChunkKey(key, n).size() + 1;
+        return used < MAX_STRING ? MAX_STRING - used : 0;
+    }
+};
+}
+
+#endif
@@ -49,10 +49,13 @@ typedef SSIZE_T ssize_t;
 
 namespace servus
 {
+class BatchListener;
 class Listener;
 class Serializable;
 class Servus;
+class TestDriver;
 class URI;
+class Value;
 class uint128_t;
 
 typedef unsigned long long ull_t;
@@ -0,0 +1,225 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "value.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+
+namespace servus
+{
+namespace
+{
+const char BINARY_MARKER = '\0';
+
+// Append the value in little endian byte order, without leading zero bytes
+void _write(std::string& data, uint64_t value)
+{
+    for (; value != 0; value >>= 8)
+        data.push_back(char(value & 0xff));
+}
+
+// @return the little endian value of up to eight bytes from pos
+uint64_t _read(const std::string& data, size_t pos)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < 8 && pos + i < data.size(); ++i)
+        value |= uint64_t(uint8_t(data[pos + i])) << (i * 8);
+    return value;
+}
+
+uint64_t _zigzag(const int64_t value)
+{
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+int64_t _unzigzag(const uint64_t value)
+{
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// Parse the whole string with the given function
+template <class T, class F>
+bool _parse(const std::string& text, const F& function, T& value)
+{
+    if (text.empty() || std::isspace(uint8_t(text[0])))
+        return false;
+
+    char* end = nullptr;
+    errno = 0;
+    value = function(text.c_str(), &end);
+    return errno == 0 && end == text.c_str() + text.size();
+}
+
+Value _parseText(const std::string& text)
+{
+    const auto toSigned = [](const char* s, char** e) {
+        return std::strtoll(s, e, 10);
+    };
+    const auto toUnsigned = [](const char* s, char** e) {
+        return std::strtoull(s, e, 10);
+    };
+    const auto toHex = [](const char* s, char** e) {
+        return std::strtoull(s, e, 16);
+    };
+
+    if (text[0] == '-')
+    {
+        long long value;
+        if (_parse(text, toSigned, value))
+            return Value(int64_t(value));
+    }
+    else
+    {
+        unsigned long long value;
+        if (text[0] != '+' && _parse(text, toUnsigned, value))
+            return Value(uint64_t(value));
+    }
+
+    double value;
+    if (_parse(text, [](const char* s, char** e) { return std::strtod(s, e); },
+               value) &&
+        std::isfinite(value)) // not a "nan" or "inf" text
+    {
+        return Value(value);
+    }
+
+    const size_t colon = text.find(':');
+    unsigned long long high, low;
+    if (colon != std::string::npos && text[0] != '-' && text[0] != '+' &&
+        colon + 1 < text.size() && text[colon + 1] != '-' &&
+        text[colon + 1] != '+' &&
+        _parse(text.substr(0, colon), toHex, high) &&
+        _parse(text.substr(colon + 1), toHex, low))
+    {
+        return Value(uint128_t(high, low));
+    }
+    return Value();
+}
+}
+
+Value Value::decode(const std::string& data)
+{
+    if (data.empty())
+        return Value();
+    if (data[0] != BINARY_MARKER)
+        return _parseText(data);
+    if (data.size() < 2)
+        return Value();
+
+    const size_t size = data.size() - 2;
+    const uint64_t low = _read(data, 2);
+    Value value;
+    switch (Type(data[1]))
+    {
+    case TYPE_BOOL:
+        if (size > 1 || low > 1)
+            return Value();
+        value._set(low == 1);
+        return value;
+
+    case TYPE_SIGNED:
+        if (size > 8)
+            return Value();
+        value._set(_unzigzag(low));
+        return value;
+
+    case TYPE_UNSIGNED:
+        if (size > 8)
+            return Value();
+        value._set(low);
+        return value;
+
+    case TYPE_FLOAT:
+    {
+        if (size != sizeof(float))
+            return Value();
+        const uint32_t bits = uint32_t(low);
+        float number;
+        std::memcpy(&number, &bits, sizeof(number));
+        value._set(number);
+        return value;
+    }
+
+    case TYPE_DOUBLE:
+        if (size != sizeof(double))
+            return Value();
+        value._type = TYPE_DOUBLE;
+        value._low = low;
+        return value;
+
+    case TYPE_UINT128:
+        if (size > 16)
+            return Value();
+        value._set(uint128_t(_read(data, 2 + 8), low));
+        return value;
+
+    default:
+        return Value();
+    }
+}
+
+std::string Value::encode() const
+{
+    std::string data;
+    if (_type == TYPE_NONE)
+        return data;
+
+    data.push_back(BINARY_MARKER);
+    data.push_back(char(_type));
+    switch (_type)
+    {
+    case TYPE_SIGNED:
+        _write(data, _zigzag(int64_t(_low)));
+        break;
+
+    case TYPE_FLOAT:
+    {
+        const float number = float(_getDouble());
+        uint32_t bits;
+        std::memcpy(&bits, &number, sizeof(bits));
+        for (size_t i = 0; i < sizeof(bits); ++i, bits >>= 8)
+            data.push_back(char(bits & 0xff));
+        break;
+    }
+
+    case TYPE_DOUBLE:
+        for (size_t i = 0; i < sizeof(double); ++i)
+            data.push_back(char((_low >> (i * 8)) & 0xff));
+        break;
+
+    case TYPE_UINT128:
+        if (_high == 0)
+        {
+            _write(data, _low);
+            break;
+        }
+        for (size_t i = 0; i < 8; ++i)
+            data.push_back(char((_low >> (i * 8)) & 0xff));
+        _write(data, _high);
+        break;
+
+    default: // bool, unsigned
+        _write(data, _low);
+        break;
+    }
+    return data;
+}
+}
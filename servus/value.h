@@ -0,0 +1,253 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SERVUS_VALUE_H
+#define SERVUS_VALUE_H
+
+#include <servus/api.h>
+#include <servus/types.h>
+#include <servus/uint128_t.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+
+namespace servus
+{
+/**
+ * A typed value announced in binary form, see Servus::set<T>() and
+ * Servus::get<T>().
+ *
+ * The binary form starts with a zero byte, followed by the type and the value
+ * in little endian byte order without its leading zero bytes. Signed integers
+ * are zigzag-encoded, floating point values use their IEEE 754 representation.
+ * Values not starting with a zero byte are parsed as text: decimal integers,
+ * floating point numbers and uint128_t in their "high:low" hexadecimal form.
+ *
+ * @version 1.6
+ */
+class Value
+{
+public:
+    enum Type
+    {
+        TYPE_NONE,     //!< not a typed value
+        TYPE_BOOL,     //!< a bool
+        TYPE_SIGNED,   //!< a signed integer of up to 64 bits
+        TYPE_UNSIGNED, //!< an unsigned integer of up to 64 bits
+        TYPE_FLOAT,    //!< a single precision floating point value
+        TYPE_DOUBLE,   //!< a double precision floating point value
+        TYPE_UINT128   //!< a servus::uint128_t
+    };
+
+    /** @return true if T can be used as a typed value. */
+    template <class T>
+    struct isTyped
+        : std::integral_constant<bool, std::is_arithmetic<T>::value ||
+                                           std::is_same<T, uint128_t>::value>
+    {
+    };
+
+    /** Construct an invalid value. */
+    Value() {}
+
+    /** Construct a value of the given arithmetic type or uint128_t. */
+    template <class T>
+    explicit Value(const T& value,
+                   typename std::enable_if<isTyped<T>::value>::type* = nullptr)
+    {
+        _set(value);
+    }
+
+    /** @return the decoded binary form or the parsed text of a value. */
+    SERVUS_API static Value decode(const std::string& data);
+
+    /** @return the binary form of this value. */
+    SERVUS_API std::string encode() const;
+
+    /** @return the type of this value. */
+    Type getType() const { return _type; }
+
+    /** @return true if this is a typed value. */
+    bool isValid() const { return _type != TYPE_NONE; }
+
+    /**
+     * @return this value converted to T, or a default-constructed T if this
+     *         value is invalid, or a number out of the range of an integral
+     *         T.
+     */
+    template <class T>
+    typename std::enable_if<std::is_arithmetic<T>::value, T>::type get() const
+    {
+        switch (_type)
+        {
+        case TYPE_BOOL:
+        case TYPE_UNSIGNED:
+            return _convert<T>(_low);
+        case TYPE_SIGNED:
+            return _convert<T>(int64_t(_low));
+        case TYPE_FLOAT:
+        case TYPE_DOUBLE:
+            return _convert<T>(_getDouble());
+        case TYPE_UINT128:
+            return _high == 0 ? _convert<T>(_low) : T();
+        default:
+            return T();
+        }
+    }
+
+    /** @return this value as a uint128_t, zero if it is not an integer. */
+    template <class T>
+    typename std::enable_if<std::is_same<T, uint128_t>::value, T>::type get()
+        const
+    {
+        switch (_type)
+        {
+        case TYPE_BOOL:
+        case TYPE_UNSIGNED:
+        case TYPE_UINT128:
+            return uint128_t(_high, _low);
+        case TYPE_SIGNED:
+            return int64_t(_low) < 0 ? uint128_t() : uint128_t(0, _low);
+        default:
+            return uint128_t();
+        }
+    }
+
+    bool operator==(const Value& rhs) const
+    {
+        return _type == rhs._type && _high == rhs._high && _low == rhs._low;
+    }
+
+    bool operator!=(const Value& rhs) const { return !(*this == rhs); }
+
+private:
+    uint64_t _high{0};
+    uint64_t _low{0}; //!< or the bits of a double
+    Type _type{TYPE_NONE};
+
+    void _set(const bool value)
+    {
+        _type = TYPE_BOOL;
+        _low = value ? 1 : 0;
+    }
+
+    void _set(const float value)
+    {
+        _setDouble(value);
+        _type = TYPE_FLOAT;
+    }
+
+    void _set(const double value) { _setDouble(value); }
+    void _set(const long double value) { _setDouble(double(value)); }
+    void _set(const uint128_t& value)
+    {
+        _type = TYPE_UINT128;
+        _high = value.high();
+        _low = value.low();
+    }
+
+    template <class T>
+    void _set(const T value,
+              typename std::enable_if<std::is_integral<T>::value>::type* =
+                  nullptr)
+    {
+        _type = std::is_signed<T>::value ? TYPE_SIGNED : TYPE_UNSIGNED;
+        _low = uint64_t(value); // sign-extended
+    }
+
+    void _setDouble(const double value)
+    {
+        _type = TYPE_DOUBLE;
+        std::memcpy(&_low, &value, sizeof(value));
+    }
+
+    double _getDouble() const
+    {
+        double value;
+        std::memcpy(&value, &_low, sizeof(value));
+        return value;
+    }
+
+    template <class T>
+    static typename std::enable_if<std::is_floating_point<T>::value, T>::type
+        _convert(const double value)
+    {
+        return T(value);
+    }
+
+    // The conversion of a double out of the range of T is undefined
+    template <class T>
+    static typename std::enable_if<std::is_integral<T>::value, T>::type
+        _convert(const double value)
+    {
+        if (std::is_same<T, bool>::value)
+            return value != 0;
+
+        // min() and max() + 1 are zero or powers of two, represented exactly
+        const double min = double(std::numeric_limits<T>::min());
+        const double end = double(std::numeric_limits<T>::max() / 2 + 1) * 2;
+        const double integer = std::trunc(value);
+        if (!(integer >= min && integer < end)) // also false for NaN
+            return T();
+        return T(integer);
+    }
+
+    template <class T>
+    static typename std::enable_if<std::is_floating_point<T>::value, T>::type
+        _convert(const uint64_t value)
+    {
+        return T(value);
+    }
+
+    template <class T>
+    static typename std::enable_if<std::is_floating_point<T>::value, T>::type
+        _convert(const int64_t value)
+    {
+        return T(value);
+    }
+
+    // The conversion of an integer out of the range of T wraps or truncates
+    template <class T>
+    static typename std::enable_if<std::is_integral<T>::value, T>::type
+        _convert(const uint64_t value)
+    {
+        if (std::is_same<T, bool>::value)
+            return value != 0;
+        return value <= uint64_t(std::numeric_limits<T>::max()) ? T(value)
+                                                                 : T();
+    }
+
+    template <class T>
+    static typename std::enable_if<std::is_integral<T>::value, T>::type
+        _convert(const int64_t value)
+    {
+        if (value >= 0)
+            return _convert<T>(uint64_t(value));
+        if (std::is_same<T, bool>::value)
+            return true;
+        // zero for an unsigned T
+        return value >= int64_t(std::numeric_limits<T>::min()) ? T(value)
+                                                                : T();
+    }
+};
+}
+
+#endif
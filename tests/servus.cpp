@@ -19,10 +19,21 @@
 #define BOOST_TEST_MODULE servus_servus
 #include <boost/test/unit_test.hpp>
 
+#include <servus/listener.h>
+#include <servus/serializable.h>
 #include <servus/servus.h>
+#include <servus/testDriver.h>
 #include <servus/uint128_t.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <future>
+#include <mutex>
 #include <random>
+#include <sstream>
+#include <thread>
 
 #ifdef SERVUS_USE_DNSSD
 #include <dns_sd.h>
@@ -32,6 +43,12 @@
 #include <windows.h>
 #define _sleep Sleep
 #else
+#include <poll.h>
+#include <fcntl.h>
+#include <servus/broker/broker.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #define _sleep ::sleep
 #endif
 
@@ -48,6 +65,70 @@ uint16_t getRandomPort()
     return generator(engine);
 }
 
+/** Records listener invocations, which may happen on the event thread. */
+class EventListener : public servus::Listener
+{
+public:
+    void instanceAdded(const std::string& instance) final
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        added.push_back(instance);
+        _condition.notify_all();
+    }
+
+    void instanceRemoved(const std::string& instance) final
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        removed.push_back(instance);
+        _condition.notify_all();
+    }
+
+    void instanceUpdated(const std::string& instance,
+                         const servus::Strings& changedKeys,
+                         const servus::Strings& removedKeys) final
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        updated.push_back(instance);
+        changed = changedKeys;
+        removedValues = removedKeys;
+        _condition.notify_all();
+    }
+
+    /** @return true if nAdded instances were added in the given time. */
+    bool waitAdded(const size_t nAdded, const int timeout)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _condition.wait_for(lock, std::chrono::milliseconds(timeout),
+                                   [&] { return added.size() >= nAdded; });
+    }
+
+    /** @return true if nUpdated updates were received in the given time. */
+    bool waitUpdated(const size_t nUpdated, const int timeout)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _condition.wait_for(lock, std::chrono::milliseconds(timeout),
+                                   [&] { return updated.size() >= nUpdated; });
+    }
+
+    /** @return true if nRemoved instances were removed in the given time. */
+    bool waitRemoved(const size_t nRemoved, const int timeout)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _condition.wait_for(lock, std::chrono::milliseconds(timeout),
+                                   [&] { return removed.size() >= nRemoved; });
+    }
+
+    servus::Strings added;
+    servus::Strings removed;
+    servus::Strings updated;
+    servus::Strings changed;       //!< changed keys of the last update
+    servus::Strings removedValues; //!< removed keys of the last update
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+};
+
 void test(const std::string& serviceName)
 {
     const uint32_t port = getRandomPort();
@@ -140,6 +221,7 @@ void test(const std::string& serviceName)
 
         BOOST_REQUIRE_EQUAL(hosts.size(), 1);
         BOOST_CHECK_EQUAL(service.get(hosts.front(), "foobar"), "42");
+        BOOST_CHECK_EQUAL(service.get<int>(hosts.front(), "foobar"), 42);
         BOOST_CHECK_EQUAL(service.getKeys().size(), 2);
         break;
     }
@@ -197,6 +279,39 @@ void test(const std::string& serviceName)
     BOOST_CHECK_EQUAL(service.get(hosts.front(), "foo"), "bar");
     BOOST_CHECK_EQUAL(service.getKeys().size(), 2);
 }
+
+void testAnnounceAsync(const std::string& serviceName)
+{
+    servus::Servus service(serviceName);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    servus::Servus announcer(serviceName);
+    announcer.set("foo", "bar");
+    std::future<servus::Servus::Result> announced =
+        announcer.announceAsync(getRandomPort(), "announcer");
+    BOOST_REQUIRE(announced.valid());
+
+    // completed by the event processing of the announcer
+    const auto end = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(5 * _propagationTime);
+    while (announced.wait_for(std::chrono::milliseconds(1)) !=
+               std::future_status::ready &&
+           std::chrono::steady_clock::now() < end)
+    {
+        announcer.processEvents();
+    }
+    BOOST_REQUIRE(announced.wait_for(std::chrono::seconds(0)) ==
+                  std::future_status::ready);
+    BOOST_CHECK(announced.get());
+    BOOST_CHECK(announcer.isAnnounced());
+
+    const servus::Servus::InstancePredicate isAnnouncer =
+        [](const std::string& instance) { return instance == "announcer"; };
+    BOOST_CHECK_EQUAL(service.waitFor(isAnnouncer, 5 * _propagationTime),
+                      "announcer");
+    BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "bar");
+    service.endBrowsing();
+}
 }
 
 BOOST_AUTO_TEST_CASE(test_servus)
@@ -210,3 +325,1174 @@ BOOST_AUTO_TEST_CASE(test_driver)
 {
     test(servus::TEST_DRIVER);
 }
+
+#ifdef SERVUS_USE_MDNS
+BOOST_AUTO_TEST_CASE(test_mdns)
+{
+    // the native implementation needs no daemon, only a multicast interface
+    ::setenv("SERVUS_MDNS", "1", 1);
+    const std::string serviceName =
+        "_servustest_" + std::to_string(servus::make_UUID()) + "._tcp";
+    test(serviceName);
+    testAnnounceAsync(serviceName);
+    ::unsetenv("SERVUS_MDNS");
+}
+#endif
+
+#ifndef _MSC_VER
+BOOST_AUTO_TEST_CASE(test_broker)
+{
+    const std::string uuid = std::to_string(servus::make_UUID());
+    servus::broker::Broker broker("/tmp/servustest_" + uuid);
+    std::thread thread([&broker] { broker.run(); });
+    ::setenv("SERVUS_BROKER", broker.getPath().c_str(), 1);
+
+    const std::string serviceName = "_servustest_" + uuid + "._tcp";
+    test(serviceName);
+    testAnnounceAsync(serviceName);
+    {
+        servus::Servus service(serviceName);
+        EventListener listener;
+        service.addListener(&listener);
+        BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_LOCAL));
+        BOOST_CHECK(service.startEventThread());
+
+        servus::Servus announcer(serviceName);
+        announcer.set("foo", "bar");
+        BOOST_CHECK(announcer.announce(4242, "announcer"));
+        BOOST_CHECK(listener.waitAdded(1, _propagationTime));
+        BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "bar");
+        BOOST_CHECK_EQUAL(service.getHost("announcer"), servus::getHostname());
+
+        announcer.set("foo", "baz");
+        BOOST_CHECK(listener.waitUpdated(1, _propagationTime));
+        BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "baz");
+
+        // the broker owns the registry, names are unique on the host
+        servus::Servus other(serviceName);
+        BOOST_CHECK_EQUAL(other.announce(4243, "announcer").getCode(), EEXIST);
+        BOOST_CHECK(!other.isAnnounced());
+
+        announcer.withdraw();
+        BOOST_CHECK(listener.waitRemoved(1, _propagationTime));
+        BOOST_CHECK(service.getInstances().empty());
+    }
+    {
+        // an explicitly selected broker does not fall back to multicast
+        ::setenv("SERVUS_BROKER", (broker.getPath() + ".missing").c_str(), 1);
+        servus::Servus service(serviceName);
+        std::ostringstream description;
+        description << service;
+        BOOST_CHECK(description.str().find("implementationnone") !=
+                    std::string::npos);
+    }
+
+    ::unsetenv("SERVUS_BROKER");
+    broker.stop();
+    thread.join();
+}
+#endif
+
+#ifndef _MSC_VER
+BOOST_AUTO_TEST_CASE(test_shm)
+{
+    const std::string uuid = std::to_string(servus::make_UUID());
+    const std::string segment = "/servustest_" + uuid;
+    ::setenv("SERVUS_SHM", segment.c_str(), 1);
+
+    const std::string serviceName = "_servustest_" + uuid + "._tcp";
+    test(serviceName);
+    {
+        servus::Servus service(serviceName);
+        BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_LOCAL));
+        BOOST_CHECK(service.getInstances().empty());
+
+        servus::Servus announcer(serviceName);
+        announcer.set("foo", "bar");
+        BOOST_CHECK(announcer.announce(4242, "announcer"));
+        BOOST_CHECK(service.browse(-1)); // returns after the change
+        BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "bar");
+
+        // the registry is private to the user
+        const int fd = ::shm_open(segment.c_str(), O_RDONLY, 0);
+        struct stat segmentStatus;
+        BOOST_REQUIRE(fd >= 0);
+        BOOST_CHECK_EQUAL(::fstat(fd, &segmentStatus), 0);
+        BOOST_CHECK_EQUAL(segmentStatus.st_mode & 0777, 0600);
+        ::close(fd);
+
+        servus::Servus other(serviceName);
+        BOOST_CHECK_EQUAL(other.announce(4243, "announcer").getCode(), EEXIST);
+
+        // the slots of a crashed process are reclaimed
+        const pid_t child = ::fork();
+        if (child == 0)
+        {
+            servus::Servus crashed(serviceName);
+            ::_exit(crashed.announce(4244, "crashed") ? 0 : 1);
+        }
+        int status = -1;
+        BOOST_CHECK_EQUAL(::waitpid(child, &status, 0), child);
+        BOOST_CHECK_EQUAL(status, 0);
+        BOOST_CHECK(service.browse(0));
+        BOOST_CHECK_EQUAL(service.getInstances().size(), 2);
+        BOOST_CHECK(service.browse(2 * _propagationTime));
+        BOOST_CHECK_EQUAL(service.getInstances().size(), 1);
+        announcer.withdraw();
+
+        // instances swapping their slots remain discovered
+        servus::Servus::Announcements announcements(2);
+        announcements[0].instance = "a";
+        announcements[0].port = 4246;
+        announcements[1].instance = "b";
+        announcements[1].port = 4247;
+        BOOST_CHECK(announcer.announce(announcements));
+        BOOST_CHECK(service.browse(0));
+        BOOST_CHECK_EQUAL(service.getInstances().size(), 2);
+
+        std::swap(announcements[0], announcements[1]);
+        BOOST_CHECK(announcer.announce(announcements));
+        BOOST_CHECK(service.browse(0));
+        const servus::Strings instances = service.getInstances();
+        BOOST_REQUIRE_EQUAL(instances.size(), 2);
+        BOOST_CHECK_EQUAL(instances[0], "a");
+        BOOST_CHECK_EQUAL(instances[1], "b");
+    }
+    {
+        // one of the processes announcing a name concurrently wins
+        struct Shared
+        {
+            std::atomic<size_t> ready;
+            std::atomic<bool> start;
+            std::atomic<size_t> announced;
+            std::atomic<bool> done;
+        };
+        Shared* shared = (Shared*)::mmap(0, sizeof(Shared),
+                                         PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        BOOST_REQUIRE(shared != MAP_FAILED);
+
+        const size_t nProcesses = 4;
+        for (size_t round = 0; round < 10; ++round)
+        {
+            shared->ready = 0;
+            shared->start = false;
+            shared->announced = 0;
+            shared->done = false;
+            std::vector<pid_t> children;
+            for (size_t i = 0; i < nProcesses; ++i)
+            {
+                const pid_t child = ::fork();
+                if (child == 0)
+                {
+                    servus::Servus racer(serviceName);
+                    ++shared->ready;
+                    while (!shared->start)
+                        ;
+                    if (racer.announce(4245, "race"))
+                        ++shared->announced;
+                    while (!shared->done)
+                        std::this_thread::yield();
+                    racer.withdraw();
+                    ::_exit(0);
+                }
+                children.push_back(child);
+            }
+            while (shared->ready < nProcesses)
+                std::this_thread::yield();
+            shared->start = true;
+
+            const auto end = std::chrono::steady_clock::now() +
+                             std::chrono::milliseconds(_propagationTime);
+            while (shared->announced == 0 &&
+                   std::chrono::steady_clock::now() < end)
+            {
+                std::this_thread::yield();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            BOOST_CHECK_EQUAL(shared->announced, 1);
+
+            shared->done = true;
+            for (const pid_t child : children)
+                BOOST_CHECK_EQUAL(::waitpid(child, nullptr, 0), child);
+        }
+        ::munmap(shared, sizeof(Shared));
+    }
+
+    ::unsetenv("SERVUS_SHM");
+    ::shm_unlink(segment.c_str());
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_event_thread)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+
+    BOOST_CHECK(!service.hasEventThread());
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    BOOST_CHECK(service.startEventThread());
+    BOOST_CHECK(service.hasEventThread());
+    // BOOST_CHECK_EQUAL gives a link error for Result::PENDING
+    BOOST_CHECK(service.startEventThread() == servus::Servus::Result::PENDING);
+
+    {
+        servus::Servus announcer(servus::TEST_DRIVER);
+        announcer.set("foo", "bar");
+        BOOST_CHECK(announcer.announce(4242, "announcer"));
+
+        // no browse(), events are delivered by the event thread
+        BOOST_REQUIRE(listener.waitAdded(1, _propagationTime));
+        BOOST_CHECK_EQUAL(listener.added.front(), "announcer");
+    }
+    BOOST_REQUIRE(listener.waitRemoved(1, _propagationTime));
+
+    service.stopEventThread();
+    BOOST_CHECK(!service.hasEventThread());
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+#ifndef _MSC_VER
+BOOST_AUTO_TEST_CASE(test_event_fd)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    const int fd = service.getEventFD();
+    BOOST_REQUIRE_GE(fd, 0);
+    BOOST_CHECK_EQUAL(service.getEventFD(), fd);
+
+    servus::Servus announcer(servus::TEST_DRIVER);
+    BOOST_CHECK(announcer.announce(4242, "announcer"));
+
+    // integrate into a caller-owned poll loop
+    ::pollfd pfd = {fd, POLLIN, 0};
+    BOOST_REQUIRE_EQUAL(::poll(&pfd, 1, _propagationTime), 1);
+    BOOST_CHECK(service.processEvents());
+    BOOST_CHECK_EQUAL(listener.added.size(), 1);
+    BOOST_CHECK_EQUAL(service.getInstances().size(), 1);
+
+    // drained, no more events pending
+    BOOST_CHECK_EQUAL(::poll(&pfd, 1, 0), 0);
+    BOOST_CHECK(service.processEvents());
+    BOOST_CHECK_EQUAL(listener.added.size(), 1);
+
+    BOOST_CHECK(service.startEventThread());
+    BOOST_CHECK(service.processEvents() == servus::Servus::Result::PENDING);
+    service.stopEventThread();
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_instance_updated)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set("foo", "bar");
+    announcer.set("bar", "foo");
+    BOOST_CHECK(announcer.announce(4242, "announcer"));
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.added.size(), 1);
+    BOOST_CHECK(listener.updated.empty());
+
+    // unchanged data does not trigger an update
+    announcer.set("foo", "bar");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(listener.updated.empty());
+
+    announcer.set("foo", "baz");
+    announcer.set("foobar", "42");
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 1);
+    BOOST_CHECK_EQUAL(listener.updated.front(), "announcer");
+    BOOST_REQUIRE_EQUAL(listener.changed.size(), 2);
+    BOOST_CHECK_EQUAL(listener.changed[0], "foo");
+    BOOST_CHECK_EQUAL(listener.changed[1], "foobar");
+    BOOST_CHECK(listener.removedValues.empty());
+    BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "baz");
+    BOOST_CHECK_EQUAL(listener.added.size(), 1);
+
+    // a queried value outlives the snapshot it was read from
+    const std::string& foo = service.get("announcer", "foo");
+    announcer.set("foo", "qux");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get("announcer", "foobar"), "42");
+    BOOST_CHECK_EQUAL(foo, "baz");
+
+    announcer.announce(4242, "announcer2");
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.removed.size(), 1);
+    BOOST_CHECK_EQUAL(listener.removed.front(), "announcer");
+    BOOST_REQUIRE_EQUAL(listener.added.size(), 2);
+    BOOST_CHECK_EQUAL(listener.added.back(), "announcer2");
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_reads)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    BOOST_CHECK(service.startEventThread());
+
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set("value", "0");
+    BOOST_CHECK(announcer.announce(4242, "announcer"));
+    BOOST_REQUIRE(listener.waitAdded(1, _propagationTime));
+
+    std::atomic<bool> running(true);
+    std::atomic<size_t> nErrors(0);
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < 4; ++i)
+        readers.emplace_back([&] {
+            while (running)
+            {
+                // snapshots are immutable, the instance is always complete
+                if (service.getInstances().size() != 1 ||
+                    service.get("announcer", "value").empty() ||
+                    service.getHost("announcer") != "localhost")
+                {
+                    ++nErrors;
+                }
+            }
+        });
+
+    for (size_t i = 1; i <= 100; ++i)
+        announcer.set("value", std::to_string(i));
+
+    running = false;
+    for (std::thread& reader : readers)
+        reader.join();
+    BOOST_CHECK_EQUAL(nErrors, 0);
+
+    service.stopEventThread();
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_many_instances)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    std::vector<std::unique_ptr<servus::Servus>> announcers;
+    for (size_t i = 0; i < 500; ++i)
+    {
+        announcers.emplace_back(new servus::Servus(servus::TEST_DRIVER));
+        announcers.back()->set("index", std::to_string(i));
+        BOOST_CHECK(
+            announcers.back()->announce(4242, "instance" + std::to_string(i)));
+    }
+    BOOST_CHECK(service.browse(0));
+
+    const servus::Strings instances = service.getInstances();
+    BOOST_REQUIRE_EQUAL(instances.size(), 500);
+    BOOST_CHECK(std::is_sorted(instances.begin(), instances.end()));
+    for (size_t i = 0; i < 500; ++i)
+    {
+        const std::string instance = "instance" + std::to_string(i);
+        BOOST_CHECK_EQUAL(service.get(instance, "index"), std::to_string(i));
+        BOOST_CHECK(service.containsKey(instance, "servus_host"));
+        BOOST_CHECK(!service.containsKey(instance, "foo"));
+        BOOST_CHECK_EQUAL(service.getKeys(instance).size(), 2);
+    }
+    BOOST_CHECK(!service.containsKey("instance500", "index"));
+    BOOST_CHECK(service.get("instance500", "index").empty());
+
+    announcers.resize(250);
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.getInstances().size(), 250);
+    BOOST_CHECK_EQUAL(service.get("instance249", "index"), "249");
+    BOOST_CHECK(service.get("instance250", "index").empty());
+
+    // distinct keys per instance rebuild the key table of the browser
+    for (size_t i = 0; i < 250; ++i)
+    {
+        const std::string id = std::to_string(i);
+        announcers[i]->set({{"a" + id, id}, {"b" + id, id}});
+    }
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get("instance0", "a0"), "0");
+    BOOST_CHECK_EQUAL(service.get("instance249", "b249"), "249");
+    BOOST_CHECK_EQUAL(service.getKeys("instance42").size(), 4);
+    BOOST_CHECK(!service.containsKey("instance42", "a41"));
+    service.endBrowsing();
+}
+
+BOOST_AUTO_TEST_CASE(test_incremental_browse)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    std::vector<std::unique_ptr<servus::Servus>> announcers;
+    for (size_t i = 0; i < 2000; ++i)
+    {
+        announcers.emplace_back(new servus::Servus(servus::TEST_DRIVER));
+        BOOST_CHECK(
+            announcers.back()->announce(4242, "instance" + std::to_string(i)));
+    }
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.added.size(), 2000);
+
+    // only the changed instances are applied and notified
+    announcers[42]->set("foo", "bar");
+    announcers[43].reset();
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 1);
+    BOOST_CHECK_EQUAL(listener.updated.front(), "instance42");
+    BOOST_REQUIRE_EQUAL(listener.removed.size(), 1);
+    BOOST_CHECK_EQUAL(listener.removed.front(), "instance43");
+    BOOST_CHECK_EQUAL(service.get("instance42", "foo"), "bar");
+
+    // a browser behind the change log catches up with all instances
+    for (size_t i = 0; i < 70000; ++i)
+        announcers[0]->set("counter", std::to_string(i));
+    announcers[1].reset();
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.updated.size(), 2);
+    BOOST_CHECK_EQUAL(listener.removed.size(), 2);
+    BOOST_CHECK_EQUAL(service.get("instance0", "counter"), "69999");
+    BOOST_CHECK_EQUAL(service.getInstances().size(), 1998);
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_network_conditions)
+{
+    using std::chrono::milliseconds;
+    servus::TestDriver::setVirtualClock(true);
+
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    // delayed delivery on the virtual clock
+    servus::TestDriver::Conditions slow;
+    slow.delay = milliseconds(100);
+    servus::Servus announcer(servus::TEST_DRIVER);
+    servus::TestDriver::setConditions(announcer, slow);
+    BOOST_CHECK(announcer.announce(4242, "slow"));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(listener.added.empty());
+    servus::TestDriver::advanceClock(milliseconds(99));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(listener.added.empty());
+    servus::TestDriver::advanceClock(milliseconds(1));
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.added.size(), 1);
+    BOOST_CHECK_EQUAL(listener.added.front(), "slow");
+
+    // a partition hides the instance, healing it resynchronizes
+    servus::TestDriver::setPartition(announcer, 1);
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.removed.size(), 1);
+    announcer.set("foo", "bar");
+    servus::TestDriver::advanceClock(milliseconds(100));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(listener.updated.empty());
+    servus::TestDriver::setPartition(announcer, 0);
+    BOOST_CHECK(service.browse(0));
+    servus::TestDriver::advanceClock(milliseconds(100));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.added.size(), 2);
+    BOOST_CHECK_EQUAL(service.get("slow", "foo"), "bar");
+
+    // a lost change is delivered with the next change, deterministically
+    servus::TestDriver::Conditions lossy;
+    lossy.loss = 0.5f;
+    servus::TestDriver::setConditions(announcer, lossy);
+    size_t lost = 0;
+    for (size_t i = 0; i < 100; ++i)
+    {
+        announcer.set("counter", std::to_string(i));
+        BOOST_CHECK(service.browse(0));
+        if (service.get("slow", "counter") != std::to_string(i))
+            ++lost;
+    }
+    BOOST_CHECK_GT(lost, 25);
+    BOOST_CHECK_LT(lost, 75);
+
+    servus::TestDriver::reset();
+    announcer.set("counter", "done");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get("slow", "counter"), "done");
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_statistics)
+{
+    const servus::Servus::Statistics global =
+        servus::Servus::getGlobalStatistics();
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    {
+        servus::Servus announcer(servus::TEST_DRIVER);
+        BOOST_CHECK(announcer.announce(4242, "statistics"));
+        BOOST_CHECK(service.browse(0));
+        announcer.set("foo", "bar");
+        BOOST_CHECK(service.browse(0));
+
+        const servus::Servus::Statistics statistics =
+            announcer.getStatistics();
+        BOOST_CHECK_EQUAL(statistics.updatesSent, 1);
+        BOOST_CHECK_EQUAL(statistics.announceTime.count, 1);
+        BOOST_CHECK_EQUAL(statistics.instancesAdded, 0);
+    }
+    BOOST_CHECK(service.browse(0));
+    service.endBrowsing();
+    service.removeListener(&listener);
+
+    const servus::Servus::Statistics statistics = service.getStatistics();
+    BOOST_CHECK_EQUAL(statistics.instancesAdded, 1);
+    BOOST_CHECK_EQUAL(statistics.instancesUpdated, 1);
+    BOOST_CHECK_EQUAL(statistics.instancesRemoved, 1);
+    BOOST_CHECK_EQUAL(statistics.listenerTime.count, 3);
+    BOOST_CHECK_EQUAL(statistics.browseTime.count, 3);
+    BOOST_CHECK_EQUAL(statistics.pollErrors, 0);
+
+    uint64_t nBrowses = 0;
+    for (const uint64_t bucket : statistics.browseTime.buckets)
+        nBrowses += bucket;
+    BOOST_CHECK_EQUAL(nBrowses, 3);
+    BOOST_CHECK_LE(statistics.browseTime.max, statistics.browseTime.total);
+
+    const servus::Servus::Statistics now =
+        servus::Servus::getGlobalStatistics();
+    BOOST_CHECK_EQUAL(now.instancesAdded - global.instancesAdded, 1);
+    BOOST_CHECK_EQUAL(now.updatesSent - global.updatesSent, 1);
+}
+
+namespace
+{
+class BlockingListener : public servus::Listener
+{
+public:
+    std::promise<void> entered;
+    std::promise<void> release;
+
+    void instanceAdded(const std::string&) final
+    {
+        if (_blocked)
+            return;
+        _blocked = true;
+        entered.set_value();
+        release.get_future().wait();
+    }
+    void instanceRemoved(const std::string&) final {}
+
+private:
+    bool _blocked{false};
+};
+}
+
+BOOST_AUTO_TEST_CASE(test_dispatch_worker)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    service.setDispatch(servus::Servus::DISPATCH_BLOCK, 16);
+    BlockingListener blocking;
+    EventListener listener;
+    service.addListener(&blocking);
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    // a blocked listener does not block the event processing
+    servus::Servus announcer1(servus::TEST_DRIVER);
+    BOOST_CHECK(announcer1.announce(4242, "dispatch1"));
+    BOOST_CHECK(service.browse(0));
+    blocking.entered.get_future().wait();
+
+    servus::Servus announcer2(servus::TEST_DRIVER);
+    BOOST_CHECK(announcer2.announce(4242, "dispatch2"));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.getInstances().size(), 2);
+
+    blocking.release.set_value();
+    BOOST_CHECK(listener.waitAdded(2, 5000));
+    service.removeListener(&blocking);
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_dispatch_executor)
+{
+    std::vector<std::function<void()>> tasks;
+    const auto run = [&tasks] {
+        const std::vector<std::function<void()>> pending = std::move(tasks);
+        tasks.clear();
+        for (const auto& task : pending)
+            task();
+    };
+
+    servus::Servus service(servus::TEST_DRIVER);
+    service.setDispatch(servus::Servus::DISPATCH_DROP_OLDEST, 2,
+                        [&tasks](const std::function<void()>& task) {
+                            tasks.push_back(task);
+                        });
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    std::vector<std::unique_ptr<servus::Servus>> announcers;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        announcers.emplace_back(new servus::Servus(servus::TEST_DRIVER));
+        BOOST_CHECK(
+            announcers.back()->announce(4242, "drop" + std::to_string(i)));
+    }
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(listener.added.empty());
+    BOOST_CHECK_EQUAL(tasks.size(), 1);
+    run();
+    BOOST_REQUIRE_EQUAL(listener.added.size(), 2);
+    BOOST_CHECK_EQUAL(listener.added[0], "drop2");
+    BOOST_CHECK_EQUAL(listener.added[1], "drop3");
+    BOOST_CHECK_EQUAL(service.getStatistics().eventsDropped, 2);
+
+    // the events of an instance merge into the pending event
+    service.setDispatch(servus::Servus::DISPATCH_COALESCE, 1,
+                        [&tasks](const std::function<void()>& task) {
+                            tasks.push_back(task);
+                        });
+    announcers[0]->set("foo", "bar");
+    BOOST_CHECK(service.browse(0));
+    announcers[0]->set("foo", "baz");
+    announcers[0]->set("bar", "foo");
+    BOOST_CHECK(service.browse(0));
+    run();
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 1);
+    BOOST_CHECK_EQUAL(listener.changed.size(), 2);
+
+    announcers.emplace_back(new servus::Servus(servus::TEST_DRIVER));
+    BOOST_CHECK(announcers.back()->announce(4242, "transient"));
+    BOOST_CHECK(service.browse(0));
+    announcers.back()->withdraw();
+    BOOST_CHECK(service.browse(0));
+    run();
+    BOOST_CHECK_EQUAL(listener.added.size(), 2);
+    BOOST_CHECK(listener.removed.empty());
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+namespace
+{
+class DestroyingListener : public servus::Listener
+{
+public:
+    std::unique_ptr<servus::Servus> service;
+    std::promise<void> browsed;
+    std::promise<void> destroyed;
+
+    void instanceAdded(const std::string&) final
+    {
+        // reconfigures the dispatch from its worker, then destroys it
+        browsed.get_future().wait();
+        service->setDispatch(servus::Servus::DISPATCH_BLOCK, 4);
+        service.reset();
+        destroyed.set_value();
+    }
+    void instanceRemoved(const std::string&) final {}
+};
+}
+
+BOOST_AUTO_TEST_CASE(test_dispatch_from_listener)
+{
+    DestroyingListener listener;
+    listener.service.reset(new servus::Servus(servus::TEST_DRIVER));
+    listener.service->setDispatch(servus::Servus::DISPATCH_BLOCK, 4);
+    listener.service->addListener(&listener);
+    BOOST_CHECK(listener.service->beginBrowsing(servus::Servus::IF_ALL));
+
+    servus::Servus announcer(servus::TEST_DRIVER);
+    BOOST_CHECK(announcer.announce(4242, "destroyer"));
+    std::future<void> destroyed = listener.destroyed.get_future();
+    BOOST_CHECK(listener.service->browse(0));
+    listener.browsed.set_value();
+    BOOST_CHECK(destroyed.wait_for(std::chrono::seconds(5)) ==
+                std::future_status::ready);
+}
+
+class BatchingListener : public servus::BatchListener
+{
+public:
+    size_t calls{0};
+    servus::Strings added;
+    servus::Strings removed;
+    servus::Strings updated;
+
+    void instancesChanged(const servus::Strings& added_,
+                          const servus::Strings& removed_,
+                          const servus::Strings& updated_) final
+    {
+        ++calls;
+        added = added_;
+        removed = removed_;
+        updated = updated_;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(test_batch_listener)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    BatchingListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    std::vector<std::unique_ptr<servus::Servus>> announcers;
+    for (size_t i = 0; i < 10; ++i)
+    {
+        announcers.emplace_back(new servus::Servus(servus::TEST_DRIVER));
+        BOOST_CHECK(
+            announcers.back()->announce(4242, "batch" + std::to_string(i)));
+    }
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.calls, 1);
+    BOOST_CHECK_EQUAL(listener.added.size(), 10);
+    BOOST_CHECK(listener.removed.empty());
+    BOOST_CHECK(listener.updated.empty());
+
+    // no notification without changes
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.calls, 1);
+
+    announcers[0]->set("foo", "bar");
+    announcers[1]->withdraw();
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.calls, 2);
+    BOOST_CHECK(listener.added.empty());
+    BOOST_REQUIRE_EQUAL(listener.removed.size(), 1);
+    BOOST_CHECK_EQUAL(listener.removed[0], "batch1");
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 1);
+    BOOST_CHECK_EQUAL(listener.updated[0], "batch0");
+
+    // changes are collected during the window
+    service.removeListener(&listener);
+    service.addListener(&listener, 100);
+    announcers[2]->set("foo", "bar");
+    BOOST_CHECK(service.browse(0));
+    announcers.emplace_back(new servus::Servus(servus::TEST_DRIVER));
+    BOOST_CHECK(announcers.back()->announce(4242, "transient"));
+    BOOST_CHECK(service.browse(0));
+    announcers.back()->withdraw();
+    announcers[3]->set("foo", "bar");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.calls, 2);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.calls, 3);
+    BOOST_CHECK(listener.added.empty());
+    BOOST_CHECK(listener.removed.empty());
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 2);
+    BOOST_CHECK_EQUAL(listener.updated[0], "batch2");
+    BOOST_CHECK_EQUAL(listener.updated[1], "batch3");
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_typed_values)
+{
+    const servus::uint128_t id = servus::make_UUID();
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set("load", 0.75f);
+    announcer.set("priority", -3);
+    announcer.set("id", id);
+    announcer.set("name", "node");
+    BOOST_CHECK_EQUAL(announcer.get<float>("load"), 0.75f);
+    BOOST_CHECK_EQUAL(announcer.get<int>("priority"), -3);
+    BOOST_CHECK(announcer.announce(4242, "typed"));
+
+    servus::Servus service(servus::TEST_DRIVER);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get<float>("typed", "load"), 0.75f);
+    BOOST_CHECK_EQUAL(service.get<double>("typed", "load"), 0.75);
+    BOOST_CHECK_EQUAL(service.get<int>("typed", "priority"), -3);
+    BOOST_CHECK_EQUAL(service.get<servus::uint128_t>("typed", "id"), id);
+    BOOST_CHECK_EQUAL(service.getValue("typed", "id").getType(),
+                      servus::Value::TYPE_UINT128);
+    BOOST_CHECK(!service.getValue("typed", "name").isValid());
+    BOOST_CHECK(!service.getValue("typed", "foo").isValid());
+    BOOST_CHECK(!service.getValue("foo", "load").isValid());
+    BOOST_CHECK_EQUAL(service.get<int>("typed", "name"), 0);
+
+    announcer.set("priority", 7u);
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get<int>("typed", "priority"), 7);
+    service.endBrowsing();
+}
+
+BOOST_AUTO_TEST_CASE(test_large_values)
+{
+    const std::string large(1000, 'x');
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set("small", "foo");
+    announcer.set("large", large);
+    BOOST_CHECK_EQUAL(announcer.get("large"), large);
+    BOOST_CHECK(announcer.announce(4242, "large"));
+
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get("large", "large"), large);
+    BOOST_CHECK_EQUAL(service.get("large", "small"), "foo");
+    BOOST_CHECK(!service.containsKey("large", "large#0"));
+
+    const std::string& small = announcer.get("small");
+    const std::string larger = large + std::string(500, 'y');
+    announcer.set("large", larger);
+    BOOST_CHECK_EQUAL(small, "foo"); // not invalidated by set()
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get("large", "large"), larger);
+    BOOST_REQUIRE_EQUAL(listener.changed.size(), 1);
+    BOOST_CHECK_EQUAL(listener.changed[0], "large");
+    BOOST_CHECK(listener.removedValues.empty());
+
+    // the TXT record size is limited
+    BOOST_CHECK_THROW(announcer.set("huge", std::string(65000, 'z')),
+                      std::length_error);
+    BOOST_CHECK(announcer.get("huge").empty());
+    BOOST_CHECK_THROW(announcer.set(std::string(300, 'k'), "foo"),
+                      std::length_error);
+
+    servus::Servus::Announcements announcements(1);
+    announcements[0].instance = "huge";
+    announcements[0].port = 4243;
+    announcements[0].data["huge"] = std::string(65000, 'z');
+    BOOST_CHECK_EQUAL(announcer.announce(announcements).getCode(), EMSGSIZE);
+
+    // the chunk keys are reserved
+    BOOST_CHECK_THROW(announcer.set("x#0", "foo"), std::invalid_argument);
+    BOOST_CHECK_THROW(announcer.set({{"x", "foo"}, {"x#12", "bar"}}),
+                      std::invalid_argument);
+    BOOST_CHECK(announcer.get("x").empty());
+    announcer.set("x#", "foo");
+    announcer.set("#1x", "bar");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.get("large", "x#"), "foo");
+    BOOST_CHECK_EQUAL(service.get("large", "#1x"), "bar");
+
+    announcements[0].data.clear();
+    announcements[0].data["x#1"] = "foo";
+    BOOST_CHECK_EQUAL(announcer.announce(announcements).getCode(), EINVAL);
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+/** A node descriptor announced as a Serializable. */
+class Descriptor : public servus::Serializable
+{
+public:
+    std::string payload;
+    static size_t nDeserialized;
+
+    std::string getTypeName() const final { return "test::Descriptor"; }
+    servus::uint128_t getTypeIdentifier() const final
+    {
+        return servus::make_uint128(getTypeName());
+    }
+
+private:
+    bool _fromBinary(const void* data, const size_t size) final
+    {
+        ++nDeserialized;
+        payload.assign(static_cast<const char*>(data), size);
+        return !payload.empty();
+    }
+
+    Data _toBinary() const final
+    {
+        const auto copy = std::make_shared<std::string>(payload);
+        Data data;
+        data.ptr = std::shared_ptr<const void>(copy, copy->data());
+        data.size = copy->size();
+        return data;
+    }
+
+    bool _fromJSON(const std::string& json) final
+    {
+        ++nDeserialized;
+        payload = json;
+        return true;
+    }
+
+    std::string _toJSON() const final { return payload; }
+};
+size_t Descriptor::nDeserialized = 0;
+
+BOOST_AUTO_TEST_CASE(test_serializable)
+{
+    Descriptor descriptor;
+    descriptor.payload = std::string(400, '\0') + "node";
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set(descriptor);
+    BOOST_CHECK(announcer.announce(4242, "object"));
+
+    servus::Servus service(servus::TEST_DRIVER);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    BOOST_CHECK(service.browse(0));
+
+    Descriptor received;
+    BOOST_CHECK(service.get("object", received));
+    BOOST_CHECK(received.payload == descriptor.payload);
+    BOOST_CHECK(!service.get("foo", received));
+
+    // deserialized once per announced data
+    Descriptor::nDeserialized = 0;
+    const auto object = service.getObject<Descriptor>("object");
+    BOOST_REQUIRE(object);
+    BOOST_CHECK(object->payload == descriptor.payload);
+    BOOST_CHECK_EQUAL(service.getObject<Descriptor>("object"), object);
+    BOOST_CHECK_EQUAL(Descriptor::nDeserialized, 1);
+    BOOST_CHECK(!service.getObject<Descriptor>("foo"));
+
+    descriptor.payload = "{\"node\": 42}";
+    announcer.set(descriptor, servus::Servus::FORMAT_JSON);
+    BOOST_CHECK(service.browse(0));
+    const auto updated = service.getObject<Descriptor>("object");
+    BOOST_REQUIRE(updated);
+    BOOST_CHECK_NE(updated, object);
+    BOOST_CHECK_EQUAL(updated->payload, descriptor.payload);
+    BOOST_CHECK_EQUAL(Descriptor::nDeserialized, 2);
+
+    // failed deserializations are cached as well
+    descriptor.payload.clear();
+    announcer.set(descriptor);
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(!service.getObject<Descriptor>("object"));
+    BOOST_CHECK(!service.getObject<Descriptor>("object"));
+    BOOST_CHECK_EQUAL(Descriptor::nDeserialized, 3);
+    service.endBrowsing();
+}
+
+BOOST_AUTO_TEST_CASE(test_views)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    const auto empty = service.getData();
+    BOOST_CHECK(empty->empty());
+
+    servus::Servus announcer1(servus::TEST_DRIVER);
+    servus::Servus announcer2(servus::TEST_DRIVER);
+    announcer1.set("foo", "bar");
+    BOOST_CHECK(announcer1.announce(4242, "announcer1"));
+    BOOST_CHECK(announcer2.announce(4243, "announcer2"));
+    BOOST_CHECK(service.browse(0));
+
+    servus::Strings instances;
+    service.forEachInstance(
+        [&](const std::string& instance) { instances.push_back(instance); });
+    BOOST_CHECK(instances == service.getInstances());
+    BOOST_CHECK_EQUAL(instances.size(), 2);
+
+    std::map<std::string, std::string> values;
+    BOOST_CHECK(service.forEachValue("announcer1",
+                                     [&](const std::string& key,
+                                         const std::string& value) {
+                                         values[key] = value;
+                                     }));
+    BOOST_CHECK_EQUAL(values.size(), 2);
+    BOOST_CHECK_EQUAL(values["foo"], "bar");
+    BOOST_CHECK_EQUAL(values["servus_host"], "localhost");
+    BOOST_CHECK(!service.forEachValue("announcer3",
+                                      [](const std::string&,
+                                         const std::string&) {}));
+
+    // snapshots are shared until the data changes and stay immutable
+    const auto data = service.getData();
+    BOOST_CHECK_EQUAL(data.get(), service.getData().get());
+    BOOST_CHECK(empty->empty());
+    BOOST_CHECK_EQUAL(data->size(), 2);
+    BOOST_CHECK_EQUAL(data->at("announcer1").at("foo"), "bar");
+
+    announcer1.set("foo", "baz");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_NE(data.get(), service.getData().get());
+    BOOST_CHECK_EQUAL(data->at("announcer1").at("foo"), "bar");
+    BOOST_CHECK_EQUAL(service.getData()->at("announcer1").at("foo"), "baz");
+
+    servus::Servus::Data copy;
+    service.getData(copy);
+    BOOST_CHECK(copy == *service.getData());
+    service.endBrowsing();
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_update)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    EventListener listener;
+    service.addListener(&listener);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set("foo", "bar");
+    BOOST_CHECK(announcer.announce(4242, "announcer"));
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.added.size(), 1);
+
+    announcer.beginUpdate();
+    announcer.set("foo", "baz");
+    announcer.beginUpdate();
+    announcer.set("bar", "foo");
+    announcer.commitUpdate();
+    BOOST_CHECK_EQUAL(announcer.get("foo"), "baz");
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(listener.updated.empty()); // not committed yet
+
+    announcer.commitUpdate();
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 1);
+    BOOST_CHECK_EQUAL(listener.changed.size(), 2);
+    BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "baz");
+
+    announcer.set({{"foo", "1"}, {"bar", "2"}, {"foobar", "3"}});
+    BOOST_CHECK(service.browse(0));
+    BOOST_REQUIRE_EQUAL(listener.updated.size(), 2);
+    BOOST_CHECK_EQUAL(listener.changed.size(), 3);
+
+    // debounced updates are announced once the delay has passed
+    announcer.setUpdateDelay(200);
+    announcer.set("foo", "4");
+    announcer.set("bar", "5");
+    BOOST_CHECK(announcer.processEvents());
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(listener.updated.size(), 2);
+    BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "1");
+
+    BOOST_CHECK(announcer.startEventThread());
+    BOOST_CHECK(service.startEventThread());
+    BOOST_REQUIRE(listener.waitUpdated(3, _propagationTime));
+    service.stopEventThread();
+    announcer.stopEventThread();
+    BOOST_CHECK_EQUAL(listener.changed.size(), 2);
+    BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "4");
+
+    service.endBrowsing();
+    service.removeListener(&listener);
+}
+
+BOOST_AUTO_TEST_CASE(test_discover_all_for_now)
+{
+    servus::Servus announcer(servus::TEST_DRIVER);
+    BOOST_CHECK(announcer.announce(4242, "announcer"));
+
+    servus::Servus service(servus::TEST_DRIVER);
+    const auto startTime = std::chrono::steady_clock::now();
+    const servus::Strings instances =
+        service.discover(servus::Servus::IF_ALL, 2000,
+                         servus::Servus::DISCOVER_ALL_FOR_NOW);
+    const auto elapsed = std::chrono::steady_clock::now() - startTime;
+
+    BOOST_REQUIRE_EQUAL(instances.size(), 1);
+    BOOST_CHECK_EQUAL(instances.front(), "announcer");
+    BOOST_CHECK(elapsed < std::chrono::milliseconds(1000));
+    BOOST_CHECK(!service.isBrowsing());
+}
+
+BOOST_AUTO_TEST_CASE(test_wait_for)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    const servus::Servus::InstancePredicate isMaster =
+        [&service](const std::string& instance) {
+            return service.get(instance, "role") == "master";
+        };
+
+    BOOST_CHECK(service.waitFor(isMaster, 100).empty());
+    BOOST_CHECK(!service.isBrowsing());
+
+    servus::Servus slave(servus::TEST_DRIVER);
+    slave.set("role", "slave");
+    BOOST_CHECK(slave.announce(4242, "slave"));
+
+    servus::Servus master(servus::TEST_DRIVER);
+    master.set("role", "slave");
+    BOOST_CHECK(master.announce(4243, "master"));
+
+    std::thread promote([&master] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        master.set("role", "master");
+    });
+    const auto startTime = std::chrono::steady_clock::now();
+    BOOST_CHECK_EQUAL(service.waitFor(isMaster, 5000), "master");
+    BOOST_CHECK(std::chrono::steady_clock::now() - startTime <
+                std::chrono::milliseconds(2000));
+    promote.join();
+
+    // already discovered instances match immediately
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(service.startEventThread());
+    BOOST_CHECK_EQUAL(service.waitFor(isMaster, 0), "master");
+    BOOST_CHECK(service.isBrowsing());
+    service.stopEventThread();
+    service.endBrowsing();
+}
+
+BOOST_AUTO_TEST_CASE(test_announce_async)
+{
+    testAnnounceAsync(servus::TEST_DRIVER);
+}
+
+BOOST_AUTO_TEST_CASE(test_announce_many)
+{
+    servus::Servus service(servus::TEST_DRIVER);
+    BOOST_CHECK(service.beginBrowsing(servus::Servus::IF_ALL));
+
+    servus::Servus announcer(servus::TEST_DRIVER);
+    announcer.set("foo", "bar");
+    BOOST_CHECK(announcer.announce(4242, "announcer"));
+
+    servus::Servus::Announcements shards;
+    for (unsigned i = 0; i < 100; ++i)
+    {
+        const std::string id = std::to_string(i);
+        shards.push_back({"shard" + id, (unsigned short)(5000 + i),
+                          {{"shard", id}}});
+    }
+    BOOST_CHECK(announcer.announce(shards));
+    BOOST_CHECK(announcer.isAnnounced());
+
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.getInstances().size(), 101);
+    BOOST_CHECK_EQUAL(service.get("announcer", "foo"), "bar");
+    BOOST_CHECK_EQUAL(service.get("shard42", "shard"), "42");
+    BOOST_CHECK(service.get("shard42", "foo").empty());
+
+    // replaces the previous announcements
+    shards.resize(10);
+    BOOST_CHECK(announcer.announce(shards));
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK_EQUAL(service.getInstances().size(), 11);
+
+    announcer.withdraw();
+    BOOST_CHECK(!announcer.isAnnounced());
+    BOOST_CHECK(service.browse(0));
+    BOOST_CHECK(service.getInstances().empty());
+    service.endBrowsing();
+}
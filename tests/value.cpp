@@ -0,0 +1,145 @@
+/* Copyright (c) 2017, Stefan.Eilemann@epfl.ch
+ *
+ * This file is part of Servus <https://github.com/HBPVIS/Servus>
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License version 3.0 as published
+ * by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define BOOST_TEST_MODULE servus_value
+#include <boost/test/unit_test.hpp>
+
+#include <servus/value.h>
+
+#include <limits>
+
+namespace
+{
+template <class T>
+T roundTrip(const T& value)
+{
+    const std::string data = servus::Value(value).encode();
+    BOOST_CHECK_EQUAL(data[0], '\0');
+    return servus::Value::decode(data).get<T>();
+}
+}
+
+BOOST_AUTO_TEST_CASE(value_binary)
+{
+    BOOST_CHECK_EQUAL(roundTrip(true), true);
+    BOOST_CHECK_EQUAL(roundTrip(false), false);
+    BOOST_CHECK_EQUAL(roundTrip(0), 0);
+    BOOST_CHECK_EQUAL(roundTrip(-1), -1);
+    BOOST_CHECK_EQUAL(roundTrip(std::numeric_limits<int64_t>::min()),
+                      std::numeric_limits<int64_t>::min());
+    BOOST_CHECK_EQUAL(roundTrip(std::numeric_limits<int64_t>::max()),
+                      std::numeric_limits<int64_t>::max());
+    BOOST_CHECK_EQUAL(roundTrip(std::numeric_limits<uint64_t>::max()),
+                      std::numeric_limits<uint64_t>::max());
+    BOOST_CHECK_EQUAL(roundTrip(uint16_t(4242)), 4242);
+    BOOST_CHECK_EQUAL(roundTrip(0.25f), 0.25f);
+    BOOST_CHECK_EQUAL(roundTrip(-1.5e300), -1.5e300);
+
+    const servus::uint128_t id = servus::make_UUID();
+    BOOST_CHECK_EQUAL(roundTrip(id), id);
+    BOOST_CHECK_EQUAL(roundTrip(servus::uint128_t(42)), servus::uint128_t(42));
+
+    // small values are compact
+    BOOST_CHECK_EQUAL(servus::Value(0u).encode().size(), 2);
+    BOOST_CHECK_EQUAL(servus::Value(-1).encode().size(), 3);
+    BOOST_CHECK_EQUAL(servus::Value(4242u).encode().size(), 4);
+    BOOST_CHECK_EQUAL(servus::Value(1.f).encode().size(), 6);
+    BOOST_CHECK_EQUAL(servus::Value(id).encode().size(), 18);
+}
+
+BOOST_AUTO_TEST_CASE(value_conversion)
+{
+    const servus::Value value(uint8_t(200));
+    BOOST_CHECK_EQUAL(value.getType(), servus::Value::TYPE_UNSIGNED);
+    BOOST_CHECK_EQUAL(value.get<int>(), 200);
+    BOOST_CHECK_EQUAL(value.get<double>(), 200.);
+    BOOST_CHECK_EQUAL(value.get<servus::uint128_t>(), servus::uint128_t(200));
+
+    BOOST_CHECK_EQUAL(servus::Value(2.5).get<int>(), 2);
+    BOOST_CHECK_EQUAL(servus::Value(-1).get<servus::uint128_t>(),
+                      servus::uint128_t());
+    BOOST_CHECK_EQUAL(servus::Value(servus::uint128_t(1, 2)).get<uint64_t>(),
+                      0);
+    BOOST_CHECK(!servus::Value().isValid());
+    BOOST_CHECK_EQUAL(servus::Value().get<int>(), 0);
+
+    // floating point values not representable by the integer
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    BOOST_CHECK_EQUAL(servus::Value(nan).get<int>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(1e300).get<int64_t>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(-1.).get<unsigned>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(-0.5).get<unsigned>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(256.).get<uint8_t>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(255.9).get<uint8_t>(), 255);
+    BOOST_CHECK_EQUAL(servus::Value(-128.).get<int8_t>(), -128);
+    BOOST_CHECK_EQUAL(servus::Value(-9223372036854775808.).get<int64_t>(),
+                      std::numeric_limits<int64_t>::min());
+    BOOST_CHECK_EQUAL(servus::Value(9223372036854775808.).get<int64_t>(), 0);
+
+    // integers out of the range of the integer
+    BOOST_CHECK_EQUAL(servus::Value(300).get<int8_t>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(-1).get<unsigned>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(-129).get<int8_t>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(-128).get<int8_t>(), -128);
+    BOOST_CHECK_EQUAL(servus::Value(255u).get<uint8_t>(), 255);
+    BOOST_CHECK_EQUAL(servus::Value(-5).get<int>(), -5);
+    BOOST_CHECK_EQUAL(
+        servus::Value(std::numeric_limits<uint64_t>::max()).get<int64_t>(), 0);
+    BOOST_CHECK_EQUAL(servus::Value(servus::uint128_t(0, 1ull << 32))
+                          .get<uint32_t>(),
+                      0);
+    BOOST_CHECK(servus::Value(-1).get<bool>());
+    BOOST_CHECK(servus::Value(256u).get<bool>());
+}
+
+BOOST_AUTO_TEST_CASE(value_text)
+{
+    using servus::Value;
+    BOOST_CHECK_EQUAL(Value::decode("42").getType(), Value::TYPE_UNSIGNED);
+    BOOST_CHECK_EQUAL(Value::decode("42").get<int>(), 42);
+    BOOST_CHECK_EQUAL(Value::decode("-42").get<int>(), -42);
+    BOOST_CHECK_EQUAL(Value::decode("0.5").get<double>(), 0.5);
+    BOOST_CHECK_EQUAL(Value::decode("18446744073709551615").get<uint64_t>(),
+                      std::numeric_limits<uint64_t>::max());
+
+    const servus::uint128_t id = servus::make_UUID();
+    BOOST_CHECK_EQUAL(Value::decode(id.getString()).get<servus::uint128_t>(),
+                      id);
+
+    BOOST_CHECK(!Value::decode("").isValid());
+    BOOST_CHECK(!Value::decode("foo").isValid());
+    BOOST_CHECK(!Value::decode(" 42").isValid());
+    BOOST_CHECK(!Value::decode("42 ").isValid());
+    BOOST_CHECK(!Value::decode("1:2:3").isValid());
+    BOOST_CHECK(!Value::decode("nan").isValid());
+    BOOST_CHECK(!Value::decode("-inf").isValid());
+    BOOST_CHECK(!Value::decode("infinity").isValid());
+    BOOST_CHECK_EQUAL(Value::decode("99999999999999999999").getType(),
+                      Value::TYPE_DOUBLE);
+}
+
+BOOST_AUTO_TEST_CASE(value_invalid_binary)
+{
+    using servus::Value;
+    BOOST_CHECK(!Value::decode(std::string(1, '\0')).isValid());
+    BOOST_CHECK(!Value::decode(std::string("\0\x7f", 2)).isValid());
+    BOOST_CHECK(!Value::decode(std::string("\0\x01\x02", 3)).isValid());
+    BOOST_CHECK(!Value::decode(std::string("\0\x05\x01", 3)).isValid());
+    BOOST_CHECK(!Value::decode(std::string(12, '\x01').insert(0, 1, '\0'))
+                     .isValid());
+}